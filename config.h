@@ -7,12 +7,18 @@
 #ifndef CONFIG_H_
 #define CONFIG_H_
 
-/** Enable support of keep-alive feature */
-#define CONFIG_KEEPALIVE_ENABLE 0
-
-/** Define timeout for keep-alive in seconds */
+/** Define default timeout for keep-alive in seconds */
 #define CONFIG_KEEPALIVE_TIMEOUT_SEC 15
 
+/** Define default time to receive request header in seconds */
+#define CONFIG_HEADER_TIMEOUT_SEC 10
+
+/** Define default time to send next piece of response in seconds */
+#define CONFIG_WRITE_TIMEOUT_SEC 30
+
+/** Define resolution of connection timers in event loop in milliseconds */
+#define CONFIG_TIMER_TICK_MS 100
+
 /** Define size of buffer for input (from client to server) data in bytes */
 #define CONFIG_INPUT_BUFF_LEN 1024
 
@@ -22,4 +28,124 @@
 /** Define maxinum path size in HTTP request */
 #define CONFIG_MAX_PATH_SIZE 128
 
+/** Define maximum number of headers in HTTP request */
+#define CONFIG_HTTP_MAX_HEADERS 32
+
+/** Define size of per-connection storage for upper layer protocol state in bytes */
+#define CONFIG_PROTO_CTX_LEN 512
+
+/** Define maximum size of file in bytes that is sent in one piece with status and headers */
+#define CONFIG_HTTP_INLINE_BODY_LEN 8192
+
+/** Define size of buffer used by TLS layer to pack files and vectored data into records in bytes */
+#define CONFIG_TLS_RECORD_BUFF_LEN 16384
+
+/** Define lifetime of TLS session tickets in seconds, ticket keys are rotated with the same period */
+#define CONFIG_TLS_TICKET_LIFETIME_SEC 86400
+
+/** Define maximum number of TLS sessions kept in session cache for clients without tickets, 0 disables cache */
+#define CONFIG_TLS_SESSION_CACHE_SIZE 8192
+
+/** Define number of independently locked parts of TLS session cache */
+#define CONFIG_TLS_SESSION_CACHE_SHARDS 16
+
+/** Define time in seconds a session is kept in TLS session cache */
+#define CONFIG_TLS_SESSION_CACHE_TIMEOUT_SEC 3600
+
+/** Define number of random number requests after which per-thread TLS generator reseeds from entropy source */
+#define CONFIG_TLS_DRBG_RESEED_INTERVAL 10000
+
+/** Define 1 to pass TLS 1.2 record encryption to kernel (kTLS) after handshake when it is supported, 0 otherwise */
+#define CONFIG_TLS_KTLS 1
+
+/** Define maximum number of certificates (e.g. ECDSA and RSA) of one TLS listener */
+#define CONFIG_TLS_MAX_CERTS 4
+
+/** Define number of threads doing TLS private key operations for event loops, 0 makes them inline */
+#define CONFIG_TLS_SIGN_WORKERS 2
+
+/** Define maximum number of private key operations waiting for signing thread, more are done inline */
+#define CONFIG_TLS_SIGN_QUEUE_DEPTH 256
+
+/** Define maximum amount of early (0-RTT) data in bytes accepted on resumed TLS 1.3 session, 0 disables it */
+#define CONFIG_TLS_EARLY_DATA_MAX_SIZE 16384
+
+/** Define time in seconds a session ticket that carried early data is remembered to reject its replay */
+#define CONFIG_TLS_EARLY_DATA_REPLAY_WINDOW_SEC 10
+
+/** Define number of tickets remembered within replay window, early data is rejected once it is full */
+#define CONFIG_TLS_EARLY_DATA_REPLAY_SLOTS 65536
+
+/** Define number of TLS contexts with record buffers kept ready by all TLS listeners for new and woken connections */
+#define CONFIG_TLS_CONTEXT_POOL_SIZE 256
+
+/** Define amount of data in bytes sent in small (one TCP segment) TLS records after handshake or idle period */
+#define CONFIG_TLS_RECORD_BOOST_LEN 16384
+
+/** Define idle time in milliseconds after which TLS records are small again */
+#define CONFIG_TLS_RECORD_IDLE_MS 1000
+
+/** Define payload of small TLS record in bytes if segment size of connection is unknown */
+#define CONFIG_TLS_RECORD_SMALL_LEN 1400
+
+/** Define maximum number of open files kept in file cache, 0 disables cache */
+#define CONFIG_FCACHE_SIZE 256
+
+/** Define number of independently locked parts of file cache */
+#define CONFIG_FCACHE_SHARDS 16
+
+/** Define time in milliseconds a cached file is served without checking it on disk */
+#define CONFIG_FCACHE_TTL_MS 1000
+
+/** Define memory in bytes taken by rendered responses of small files, 0 disables response cache */
+#define CONFIG_RCACHE_SIZE (8 * 1024 * 1024)
+
+/** Define number of independently locked parts of response cache */
+#define CONFIG_RCACHE_SHARDS 16
+
+/** Define maximum size of file in bytes which response is rendered and cached */
+#define CONFIG_RCACHE_FILE_MAX_LEN 16384
+
+/** Define time in milliseconds a rendered response is sent before it is rendered from file again */
+#define CONFIG_RCACHE_TTL_MS 1000
+
+/** Define number of recently missing files remembered to answer them without lookup */
+#define CONFIG_NCACHE_SIZE 4096
+
+/** Define number of independently locked parts of cache of missing files */
+#define CONFIG_NCACHE_SHARDS 16
+
+/** Define time in milliseconds a missing file is remembered if root directory tree is not watched */
+#define CONFIG_NCACHE_TTL_MS 1000
+
+/** Define size in bits of filter of existing files, shall be power of two */
+#define CONFIG_NCACHE_BLOOM_BITS (1 << 23)
+
+/** Define number of removed files after which filter of existing files is rebuilt */
+#define CONFIG_NCACHE_REBUILD_REMOVED 4096
+
+/** Define time in milliseconds cached files and responses are kept while root directory tree is watched for changes */
+#define CONFIG_WATCH_TTL_MS 60000
+
+/** Define maximum number of events handled by event loop per one wait call */
+#define CONFIG_EVLOOP_MAX_EVENTS 64
+
+/** Define default maximum number of accepted connections waiting for worker thread */
+#define CONFIG_POOL_QUEUE_DEPTH 1024
+
+/** Define stack size of worker threads in bytes */
+#define CONFIG_POOL_STACK_SIZE (512 * 1024)
+
+/** Define maximum number of modules that report statistic */
+#define CONFIG_STATS_MAX_REPORTERS 64
+
+/** Define number of entries in submission queue of io_uring */
+#define CONFIG_URING_ENTRIES 64
+
+/** Define number of provided receive buffers per io_uring, shall be power of two */
+#define CONFIG_URING_BUFS 64
+
+/** Define amount of output data in bytes collected by io_uring backend before submission */
+#define CONFIG_URING_SEND_BATCH 16384
+
 #endif
\ No newline at end of file
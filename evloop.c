@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+#include "evloop.h"
+#include "timer.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "evloop"
+
+/**
+ * @brief Kinds of connection deadlines
+ **/
+enum evloop_deadline_e
+{
+    EVLOOP_DEADLINE_NONE = 0,
+    EVLOOP_DEADLINE_HEADER, /// request header shall be received
+    EVLOOP_DEADLINE_IDLE,   /// next request shall start
+    EVLOOP_DEADLINE_WRITE,  /// client shall accept next piece of response
+};
+
+struct evloop_s
+{
+    int epfd;
+    struct server_s *srv;      /// the first of listeners served by the loop
+    server_listen_handler_f handler;
+    struct timer_wheel_s wheel;
+    struct epoll_event *batch; /// events returned by the last wait
+    int batchlen;              /// number of events in the batch
+    int batchpos;              /// index of event that is being handled
+};
+
+static uint64_t evloop_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int evloop_conn_update(int epfd, struct conn_s *conn)
+{
+    struct epoll_event ev = {0};
+    uint32_t events = 0;
+
+    /* Do not read anymore if connection is going to be closed. Handshake
+        waiting for background operation does not read either. Requests
+        are not read while output is pending, so client that does not
+        read responses can not make server queue more of them */
+    if (conn->closing == false && server_conn_pending(conn) == false &&
+        conn->handshake != SERVER_HANDSHAKE_WANT_WRITE &&
+        conn->handshake != SERVER_HANDSHAKE_WANT_ASYNC)
+    {
+        events |= EPOLLIN | EPOLLRDHUP;
+    }
+
+    /* Wait for writability only if something is pending */
+    if (server_conn_pending(conn) == true || conn->handshake == SERVER_HANDSHAKE_WANT_WRITE)
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events == conn->events)
+    {
+        return 0;
+    }
+
+    ev.events = events;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->iface->fd(conn->ctx), &ev) < 0)
+    {
+        LOGERR("Fail to modify connection events. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    conn->events = events;
+
+    return 0;
+}
+
+static void evloop_conn_close(struct evloop_s *loop, struct conn_s *conn)
+{
+    timer_cancel(&loop->wheel, &conn->timer);
+
+    /* Closing of descriptor removes it from epoll set as well, but do it
+        explicitly in case if descriptor is shared with someone else */
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->iface->fd(conn->ctx), NULL);
+
+    /* Descriptor of background operation may outlive the connection */
+    if (conn->asyncfd >= 0)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->asyncfd, NULL);
+    }
+
+    /* Connection may have one more event in the batch (socket and background
+        operation), it shall not be handled once connection is released */
+    for (int i = loop->batchpos + 1; i < loop->batchlen; i++)
+    {
+        if (loop->batch[i].data.ptr == conn)
+        {
+            loop->batch[i].data.ptr = loop;
+        }
+    }
+
+    server_conn_close(conn);
+}
+
+/**
+ * @brief Watch descriptor of background operation while handshake waits for it
+ * 
+ * @param loop[in] - event loop
+ * @param conn[in] - connection
+ * 
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+static int evloop_conn_async(struct evloop_s *loop, struct conn_s *conn)
+{
+    struct epoll_event ev = {0};
+    int fd = -1;
+
+    if (conn->handshake == SERVER_HANDSHAKE_WANT_ASYNC && conn->asyncfd < 0)
+    {
+        fd = conn->iface->async_fd != NULL ? conn->iface->async_fd(conn->ctx) : -1;
+        if (fd < 0)
+        {
+            LOGERR("Background operation of connection can not be watched");
+
+            return -ENOSYS;
+        }
+
+        /* Completion is reported as an event of the connection itself */
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            LOGERR("Fail to watch background operation. Result: %s", strerror(errno));
+
+            return -errno;
+        }
+
+        conn->asyncfd = fd;
+    }
+    else if (conn->handshake != SERVER_HANDSHAKE_WANT_ASYNC && conn->asyncfd >= 0)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->asyncfd, NULL);
+
+        conn->asyncfd = -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Arm connection timer according to what the connection waits for
+ * 
+ * Header deadline is not moved while request comes piece by piece, so slow
+ * clients can not hold connection forever. It starts again once a request is
+ * handled, since pipelining client may always have the next one incomplete.
+ * Write deadline is moved every time client accepts some data.
+ * 
+ * @param loop[in] - event loop
+ * @param conn[in] - connection
+ * @param progress[in] - some output was accepted by client
+ * @param handled[in] - some request was handled
+ **/
+static void evloop_conn_deadline(struct evloop_s *loop, struct conn_s *conn, bool progress,
+                                 bool handled)
+{
+    struct server_conf_s *conf = &conn->srv->conf;
+    enum evloop_deadline_e deadline = EVLOOP_DEADLINE_IDLE;
+    unsigned int timeout = conf->keepalive;
+
+    if (server_conn_pending(conn) == true)
+    {
+        deadline = EVLOOP_DEADLINE_WRITE;
+        timeout = conf->write_timeout;
+    }
+    else if (conn->inlen > 0 || conn->handshake != 0 || conf->keepalive == 0)
+    {
+        deadline = EVLOOP_DEADLINE_HEADER;
+        timeout = conf->header_timeout;
+    }
+
+    if (deadline == conn->deadline &&
+        (deadline != EVLOOP_DEADLINE_WRITE || progress == false) &&
+        (deadline != EVLOOP_DEADLINE_HEADER || handled == false))
+    {
+        return;
+    }
+
+    conn->deadline = deadline;
+    timer_add(&loop->wheel, &conn->timer, (uint64_t)timeout * 1000);
+}
+
+static void evloop_conn_expire(struct timer_s *timer, void *arg)
+{
+    struct evloop_s *loop = arg;
+    struct conn_s *conn = (struct conn_s *)((char *)timer - offsetof(struct conn_s, timer));
+
+    LOGINF("Connection timed out waiting for %s",
+           conn->deadline == EVLOOP_DEADLINE_WRITE ? "client to read" :
+           conn->deadline == EVLOOP_DEADLINE_IDLE ? "next request" : "request header");
+
+    evloop_conn_close(loop, conn);
+}
+
+static void evloop_accept(struct evloop_s *loop, struct server_s *srv)
+{
+    struct conn_iface_s *conn_iface = srv->iface->conn_iface();
+    void *connctx = NULL;
+    struct conn_s *conn = NULL;
+    struct epoll_event ev = {0};
+
+    /* Accept all pending connections */
+    while ((connctx = srv->iface->accept(srv->ctx)) != NULL)
+    {
+        atomic_fetch_add_explicit(&srv->accepted, 1, memory_order_relaxed);
+
+        conn = server_conn_create(srv, conn_iface, connctx, loop->handler);
+        if (conn == NULL)
+        {
+            conn_iface->close(connctx);
+
+            continue;
+        }
+
+        if (conn_iface->nonblock(connctx) < 0)
+        {
+            LOGERR("Fail to switch connection to non-blocking mode");
+
+            server_conn_close(conn);
+
+            continue;
+        }
+
+        conn->nonblock = true;
+        conn->events = EPOLLIN | EPOLLRDHUP;
+
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn_iface->fd(connctx), &ev) < 0)
+        {
+            LOGERR("Fail to add connection to epoll. Result: %s", strerror(errno));
+
+            server_conn_close(conn);
+
+            continue;
+        }
+
+        /* The first request is expected right away */
+        conn->deadline = EVLOOP_DEADLINE_HEADER;
+        timer_add(&loop->wheel, &conn->timer, (uint64_t)srv->conf.header_timeout * 1000);
+    }
+}
+
+static void evloop_conn_event(struct evloop_s *loop, struct conn_s *conn, uint32_t events)
+{
+    unsigned long requests = conn->requests;
+    int len = 0;
+
+    if (events & EPOLLERR)
+    {
+        evloop_conn_close(loop, conn);
+
+        return;
+    }
+
+    /* Establish channel first. Peer may send data right after the
+        handshake, so try to read it once channel is established */
+    if (conn->handshake != 0)
+    {
+        if ((events & EPOLLHUP) ||
+            server_conn_handshake(conn) < 0 ||
+            evloop_conn_async(loop, conn) < 0)
+        {
+            evloop_conn_close(loop, conn);
+
+            return;
+        }
+
+        events = conn->handshake == 0 ? EPOLLIN : 0;
+    }
+
+    /* Flush whatever is waiting in output queue */
+    if (events & EPOLLOUT)
+    {
+        if (server_conn_flush(conn) < 0)
+        {
+            evloop_conn_close(loop, conn);
+
+            return;
+        }
+
+        /* Queue is drained, so handle requests that waited in input buffer
+            and continue reading. TLS layer may hold data already, so its
+            descriptor would not report it */
+        if (server_conn_pending(conn) == false && conn->closing == false)
+        {
+            if (server_conn_process(conn) < 0)
+            {
+                conn->closing = true;
+            }
+
+            events |= EPOLLIN;
+        }
+    }
+
+    /* Read until channel is drained. TLS layer may hold decrypted data
+        in its own buffers, so readiness of descriptor is not enough */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+    {
+        while (conn->closing == false && server_conn_pending(conn) == false)
+        {
+            len = conn->iface->recv(conn->ctx, conn->inbuf + conn->inlen,
+                                    sizeof(conn->inbuf) - conn->inlen);
+            if (len == -EAGAIN)
+            {
+                break;
+            }
+
+            if (len <= 0)
+            {
+                /* Peer has closed connection or error occured */
+                evloop_conn_close(loop, conn);
+
+                return;
+            }
+
+            conn->inlen += len;
+
+            if (server_conn_process(conn) < 0)
+            {
+                conn->closing = true;
+            }
+        }
+    }
+
+    /* Close connection once everything is sent */
+    if (conn->closing == true && server_conn_pending(conn) == false)
+    {
+        evloop_conn_close(loop, conn);
+
+        return;
+    }
+
+    if (evloop_conn_update(loop->epfd, conn) < 0)
+    {
+        evloop_conn_close(loop, conn);
+
+        return;
+    }
+
+    evloop_conn_deadline(loop, conn, (events & EPOLLOUT) != 0, conn->requests != requests);
+}
+
+/**
+ * @brief Find listener of the loop an event belongs to
+ * 
+ * @retval listener or NULL if event belongs to connection
+ **/
+static struct server_s *evloop_listener(struct evloop_s *loop, void *ptr)
+{
+    struct server_s *srv = NULL;
+
+    for (srv = loop->srv; srv != NULL; srv = srv->next)
+    {
+        if (srv == ptr)
+        {
+            return srv;
+        }
+    }
+
+    return NULL;
+}
+
+static int evloop_listener_check(struct server_s *srv)
+{
+    struct conn_iface_s *conn_iface = NULL;
+    int result = 0;
+
+    /* Check if required interface is available */
+    if (srv->iface->accept == NULL ||
+        srv->iface->fd == NULL ||
+        srv->iface->nonblock == NULL ||
+        srv->iface->conn_iface == NULL)
+    {
+        LOGERR("Required interfaces are not implemented");
+
+        return -ENOSYS;
+    }
+
+    conn_iface = srv->iface->conn_iface();
+    if (conn_iface == NULL ||
+        conn_iface->recv == NULL ||
+        conn_iface->send == NULL ||
+        conn_iface->fd == NULL ||
+        conn_iface->nonblock == NULL)
+    {
+        LOGERR("Required connection interfaces are not implemented");
+
+        return -ENOSYS;
+    }
+
+    result = srv->iface->nonblock(srv->ctx);
+    if (result < 0)
+    {
+        LOGERR("Fail to switch listener to non-blocking mode. Result: %d", result);
+
+        return result;
+    }
+
+    return 0;
+}
+
+int evloop_run(struct server_s *srv, server_listen_handler_f handler)
+{
+    struct epoll_event events[CONFIG_EVLOOP_MAX_EVENTS];
+    struct epoll_event ev = {0};
+    struct epoll_event *event = NULL;
+    struct server_s *listener = NULL;
+    struct evloop_s *loop = NULL;
+    int num = 0;
+    int result = 0;
+
+    for (listener = srv; listener != NULL; listener = listener->next)
+    {
+        result = evloop_listener_check(listener);
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+
+    loop = malloc(sizeof(struct evloop_s));
+    if (loop == NULL)
+    {
+        LOGERR("Fail to allocate memory for event loop");
+
+        return -ENOMEM;
+    }
+
+    loop->srv = srv;
+    loop->handler = handler;
+    loop->batch = events;
+    loop->batchlen = 0;
+    loop->batchpos = 0;
+    timer_wheel_init(&loop->wheel, evloop_now(), CONFIG_TIMER_TICK_MS);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+    {
+        LOGERR("Fail to create epoll. Result: %s", strerror(errno));
+
+        free(loop);
+
+        return -errno;
+    }
+
+    /* Listener is marked with its server object */
+    for (listener = srv; listener != NULL; listener = listener->next)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = listener;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listener->iface->fd(listener->ctx), &ev) < 0)
+        {
+            LOGERR("Fail to add listener to epoll. Result: %s", strerror(errno));
+
+            result = -errno;
+
+            goto exit;
+        }
+    }
+
+    LOGINF("Event loop started");
+
+    while (1)
+    {
+        /* Sleep no longer than the nearest connection deadline */
+        num = epoll_wait(loop->epfd, events, CONFIG_EVLOOP_MAX_EVENTS,
+                         timer_wheel_timeout(&loop->wheel, evloop_now()));
+        if (num < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (num < 0)
+        {
+            LOGERR("Fail to wait for events. Result: %s", strerror(errno));
+
+            result = -errno;
+
+            break;
+        }
+
+        loop->batchlen = num;
+        loop->batchpos = -1;
+
+        /* Wheel is brought to the current time before deadlines are armed by
+            the batch, otherwise they would count from the time wait started.
+            Expired connection drops its events from the batch on close */
+        timer_wheel_advance(&loop->wheel, evloop_now(), evloop_conn_expire, loop);
+
+        for (loop->batchpos = 0; loop->batchpos < num; loop->batchpos++)
+        {
+            event = &events[loop->batchpos];
+
+            /* Event of connection closed while handling the batch is marked with loop */
+            if (event->data.ptr == loop)
+            {
+                continue;
+            }
+
+            listener = evloop_listener(loop, event->data.ptr);
+            if (listener != NULL)
+            {
+                evloop_accept(loop, listener);
+            }
+            else
+            {
+                evloop_conn_event(loop, event->data.ptr, event->events);
+            }
+        }
+
+        loop->batchlen = 0;
+    }
+
+exit:
+    close(loop->epfd);
+    free(loop);
+
+    return result;
+}
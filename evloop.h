@@ -0,0 +1,28 @@
+/**
+ * @file evloop.h
+ * @brief This module implements event-driven (epoll reactor) connection handling
+ * 
+ * The module do following:
+ *  - switch listening and connection channels to non-blocking mode
+ *  - wait for readiness of all channels in a single thread
+ *  - receive data and pass it to upper layer when channel is readable
+ *  - flush queued output data when channel is writable
+ **/
+
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+#include "server.h"
+
+/**
+ * @brief Run event loop for the server and listeners attached to it
+ * 
+ * @param srv[in]     - server object/context
+ * @param handler[in] - handler function that should handle incoming data on upper layer
+ * 
+ * @retval The function should not return back if everything is ok.
+ * If something goes wrong it returns negative errno value
+ **/
+int evloop_run(struct server_s *srv, server_listen_handler_f handler);
+
+#endif
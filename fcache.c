@@ -0,0 +1,698 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fcache.h"
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "fcache"
+
+/* Number of files kept by one shard */
+#define FCACHE_SHARD_SIZE ((CONFIG_FCACHE_SIZE + CONFIG_FCACHE_SHARDS - 1) / CONFIG_FCACHE_SHARDS)
+
+/* Twice as many buckets as files keep hash chains short */
+#define FCACHE_BUCKETS (FCACHE_SHARD_SIZE * 2)
+
+struct fcache_entry_s
+{
+    struct fcache_file_s file;    /// shall be the first, user gets pointer to it
+    atomic_uint refs;             /// one reference is held by the table while file is cached
+    bool cached;                  /// entry is in the table
+    uint64_t hash;
+    uint64_t expires;             /// time in milliseconds the file is checked on disk again
+    struct fcache_entry_s *chain; /// next entry in hash bucket
+    struct fcache_entry_s *next;  /// less recently used entry
+    struct fcache_entry_s *prev;  /// more recently used entry
+    char path[CONFIG_MAX_PATH_SIZE];
+};
+
+#if CONFIG_FCACHE_SIZE > 0
+struct fcache_shard_s
+{
+    pthread_mutex_t lock;
+    pthread_cond_t landed;     /// signaled once any open of the shard is finished
+    struct fcache_entry_s lru; /// head of LRU list, lru.next is the most recently used entry
+    struct fcache_entry_s *buckets[FCACHE_BUCKETS];
+    atomic_uint_fast64_t generations[FCACHE_BUCKETS]; /// changed by invalidation of bucket
+    struct fcache_flight_s *flights;
+    size_t count;
+};
+
+/* File opened by one thread, while other threads that miss it wait */
+struct fcache_flight_s
+{
+    unsigned int refs;            /// opener and waiting threads, guarded by shard lock
+    bool landed;                  /// open is finished
+    int result;                   /// result of open
+    struct fcache_entry_s *entry; /// opened file, waiting threads hold a reference each
+    struct fcache_flight_s *next;
+    uint64_t hash;
+    const char *path;             /// path of opener, valid while the flight is in the shard
+};
+#endif
+
+struct fcache_s
+{
+#if CONFIG_FCACHE_SIZE > 0
+    struct fcache_shard_s shards[CONFIG_FCACHE_SHARDS];
+#endif
+
+    /* Statistic */
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t coalesced; /// misses that waited for open by another thread
+    atomic_uint_fast64_t evicts;
+    atomic_uint_fast64_t unchanged; /// expired files found unchanged on disk
+    atomic_uint_fast64_t reloaded;  /// expired files found changed or removed
+    atomic_size_t files;            /// open files, including evicted ones still in use
+    atomic_uint_fast64_t invalidated;
+
+    atomic_uint ttl;                /// time to live of files in milliseconds
+    atomic_uint_fast64_t generation; /// changed by invalidation of all files
+};
+
+static struct fcache_s cache = { .ttl = CONFIG_FCACHE_TTL_MS };
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static uint64_t fcache_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a, paths are short and differ mostly at the end */
+static uint64_t fcache_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool fcache_file_changed(const struct fcache_file_s *file, const struct stat *st)
+{
+    return file->ino != st->st_ino || file->size != (size_t)st->st_size ||
+           file->mtime.tv_sec != st->st_mtim.tv_sec || file->mtime.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+static int fcache_entry_load(const char *path, uint64_t hash, fcache_type_f type,
+                             struct fcache_entry_s **entry)
+{
+    struct fcache_entry_s *loaded = NULL;
+    struct stat st = {0};
+    int result = 0;
+
+    if (strlen(path) >= sizeof(loaded->path))
+    {
+        return -ENAMETOOLONG;
+    }
+
+    /* Type is resolved by path, so there is no need to open what is not served */
+    result = type(path);
+    if (result < 0)
+    {
+        return -EINVAL;
+    }
+
+    loaded = calloc(1, sizeof(*loaded));
+    if (loaded == NULL)
+    {
+        LOGERR("Fail to allocate file entry");
+
+        return -ENOMEM;
+    }
+
+    loaded->file.type = result;
+
+    loaded->file.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (loaded->file.fd < 0)
+    {
+        result = -errno;
+
+        free(loaded);
+
+        return result;
+    }
+
+    if (fstat(loaded->file.fd, &st) < 0 || S_ISREG(st.st_mode) == 0)
+    {
+        close(loaded->file.fd);
+        free(loaded);
+
+        return -ENOENT;
+    }
+
+    loaded->file.size = st.st_size;
+    loaded->file.mtime = st.st_mtim;
+    loaded->file.ino = st.st_ino;
+    loaded->hash = hash;
+    loaded->expires = fcache_now() + atomic_load_explicit(&cache.ttl, memory_order_relaxed);
+    strcpy(loaded->path, path);
+    atomic_init(&loaded->refs, 1);
+
+    atomic_fetch_add_explicit(&cache.files, 1, memory_order_relaxed);
+
+    *entry = loaded;
+
+    return 0;
+}
+
+static void fcache_entry_put(struct fcache_entry_s *entry)
+{
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    close(entry->file.fd);
+    free(entry);
+
+    atomic_fetch_sub_explicit(&cache.files, 1, memory_order_relaxed);
+}
+
+#if CONFIG_FCACHE_SIZE > 0
+static struct fcache_shard_s *fcache_shard_get(uint64_t hash)
+{
+    return &cache.shards[hash % CONFIG_FCACHE_SHARDS];
+}
+
+static struct fcache_entry_s **fcache_shard_bucket(struct fcache_shard_s *shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / CONFIG_FCACHE_SHARDS) % FCACHE_BUCKETS];
+}
+
+/* Sum of growing counters, so change of file does not affect open of files in other buckets */
+static uint64_t fcache_generation(uint64_t hash)
+{
+    struct fcache_shard_s *shard = fcache_shard_get(hash);
+
+    return atomic_load(&cache.generation) +
+           atomic_load(&shard->generations[(hash / CONFIG_FCACHE_SHARDS) % FCACHE_BUCKETS]);
+}
+
+static struct fcache_entry_s *fcache_shard_find(struct fcache_shard_s *shard, uint64_t hash,
+                                                const char *path)
+{
+    struct fcache_entry_s *entry = *fcache_shard_bucket(shard, hash);
+
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+    {
+        entry = entry->chain;
+    }
+
+    return entry;
+}
+
+static void fcache_lru_del(struct fcache_entry_s *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void fcache_lru_add(struct fcache_shard_s *shard, struct fcache_entry_s *entry)
+{
+    entry->next = shard->lru.next;
+    entry->prev = &shard->lru;
+    shard->lru.next->prev = entry;
+    shard->lru.next = entry;
+}
+
+/* Table reference is passed to caller, who drops it outside of shard lock */
+static void fcache_shard_unlink(struct fcache_shard_s *shard, struct fcache_entry_s *entry)
+{
+    struct fcache_entry_s **link = fcache_shard_bucket(shard, entry->hash);
+
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+
+    *link = entry->chain;
+    fcache_lru_del(entry);
+    entry->cached = false;
+    shard->count--;
+}
+
+static void fcache_shard_link(struct fcache_shard_s *shard, struct fcache_entry_s *entry)
+{
+    struct fcache_entry_s **bucket = fcache_shard_bucket(shard, entry->hash);
+
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+
+    entry->chain = *bucket;
+    *bucket = entry;
+    fcache_lru_add(shard, entry);
+    entry->cached = true;
+    shard->count++;
+}
+
+static struct fcache_entry_s *fcache_lookup(uint64_t hash, const char *path)
+{
+    struct fcache_shard_s *shard = fcache_shard_get(hash);
+    struct fcache_entry_s *entry = NULL;
+    uint64_t now = fcache_now();
+    struct stat st = {0};
+    bool fresh = false;
+    bool unlinked = false;
+
+    pthread_mutex_lock(&shard->lock);
+
+    entry = fcache_shard_find(shard, hash, path);
+    if (entry != NULL)
+    {
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+
+        fcache_lru_del(entry);
+        fcache_lru_add(shard, entry);
+
+        fresh = entry->expires > now;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    if (fresh == true)
+    {
+        atomic_fetch_add_explicit(&cache.hits, 1, memory_order_relaxed);
+
+        return entry;
+    }
+
+    /* Time to live is over, so check the file on disk. It is done out of
+        shard lock, other files of the shard are served meanwhile */
+    if (stat(path, &st) == 0 && fcache_file_changed(&entry->file, &st) == false)
+    {
+        pthread_mutex_lock(&shard->lock);
+        entry->expires = now + atomic_load_explicit(&cache.ttl, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->lock);
+
+        atomic_fetch_add_explicit(&cache.unchanged, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache.hits, 1, memory_order_relaxed);
+
+        return entry;
+    }
+
+    /* File was changed, replaced or removed, so it is opened again */
+    pthread_mutex_lock(&shard->lock);
+
+    if (entry->cached == true)
+    {
+        fcache_shard_unlink(shard, entry);
+        unlinked = true;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (unlinked == true)
+    {
+        fcache_entry_put(entry);
+    }
+
+    fcache_entry_put(entry);
+
+    atomic_fetch_add_explicit(&cache.reloaded, 1, memory_order_relaxed);
+
+    return NULL;
+}
+
+static struct fcache_entry_s *fcache_insert(struct fcache_entry_s *entry, uint64_t generation)
+{
+    struct fcache_shard_s *shard = fcache_shard_get(entry->hash);
+    struct fcache_entry_s *existing = NULL;
+    struct fcache_entry_s *evicted = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* File may be changed while it was opened, so it serves this request only */
+    if (fcache_generation(entry->hash) != generation)
+    {
+        pthread_mutex_unlock(&shard->lock);
+
+        return entry;
+    }
+
+    /* The same file may be opened by another thread meanwhile. Fresh one
+        is used, so all threads share single descriptor */
+    existing = fcache_shard_find(shard, entry->hash, entry->path);
+    if (existing != NULL && existing->expires > fcache_now())
+    {
+        atomic_fetch_add_explicit(&existing->refs, 1, memory_order_relaxed);
+
+        pthread_mutex_unlock(&shard->lock);
+
+        fcache_entry_put(entry);
+
+        return existing;
+    }
+
+    if (existing != NULL)
+    {
+        fcache_shard_unlink(shard, existing);
+        evicted = existing;
+    }
+    else if (shard->count >= FCACHE_SHARD_SIZE)
+    {
+        evicted = shard->lru.prev;
+        fcache_shard_unlink(shard, evicted);
+
+        atomic_fetch_add_explicit(&cache.evicts, 1, memory_order_relaxed);
+    }
+
+    fcache_shard_link(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Descriptor of evicted file is closed once the last response that uses it is sent */
+    if (evicted != NULL)
+    {
+        fcache_entry_put(evicted);
+    }
+
+    return entry;
+}
+
+/* Wait for the file if another thread opens it at the moment. Otherwise other threads
+    wait for caller, who shall land the flight. Returns true if file is got by waiting */
+static bool fcache_flight_wait(uint64_t hash, const char *path, struct fcache_flight_s **flight,
+                               struct fcache_entry_s **entry, int *result)
+{
+    struct fcache_shard_s *shard = fcache_shard_get(hash);
+    struct fcache_flight_s *joined = NULL;
+    struct fcache_entry_s *existing = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Open may be finished since lookup */
+    existing = fcache_shard_find(shard, hash, path);
+    if (existing != NULL && existing->expires > fcache_now())
+    {
+        atomic_fetch_add_explicit(&existing->refs, 1, memory_order_relaxed);
+
+        pthread_mutex_unlock(&shard->lock);
+
+        atomic_fetch_add_explicit(&cache.hits, 1, memory_order_relaxed);
+
+        *entry = existing;
+        *result = 0;
+
+        return true;
+    }
+
+    joined = shard->flights;
+    while (joined != NULL && (joined->hash != hash || strcmp(joined->path, path) != 0))
+    {
+        joined = joined->next;
+    }
+
+    if (joined != NULL)
+    {
+        joined->refs++;
+
+        while (joined->landed == false)
+        {
+            pthread_cond_wait(&shard->landed, &shard->lock);
+        }
+
+        *entry = joined->entry;
+        *result = joined->result;
+
+        if (--joined->refs == 0)
+        {
+            free(joined);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        atomic_fetch_add_explicit(&cache.coalesced, 1, memory_order_relaxed);
+
+        return true;
+    }
+
+    /* Threads are not coalesced if there is no memory for it */
+    joined = calloc(1, sizeof(*joined));
+    if (joined != NULL)
+    {
+        joined->refs = 1;
+        joined->hash = hash;
+        joined->path = path;
+        joined->next = shard->flights;
+        shard->flights = joined;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    *flight = joined;
+
+    return false;
+}
+
+/* Let waiting threads go with result of open */
+static void fcache_flight_land(struct fcache_flight_s *flight, int result, struct fcache_entry_s *entry)
+{
+    struct fcache_shard_s *shard = NULL;
+    struct fcache_flight_s **link = NULL;
+
+    if (flight == NULL)
+    {
+        return;
+    }
+
+    shard = fcache_shard_get(flight->hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    link = &shard->flights;
+    while (*link != flight)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = flight->next;
+
+    if (result == 0)
+    {
+        atomic_fetch_add_explicit(&entry->refs, flight->refs - 1, memory_order_relaxed);
+    }
+
+    flight->result = result;
+    flight->entry = entry;
+    flight->landed = true;
+    pthread_cond_broadcast(&shard->landed);
+
+    if (--flight->refs == 0)
+    {
+        free(flight);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+#endif
+
+static void fcache_stats_report(void *arg)
+{
+    uint64_t hits = atomic_load(&cache.hits);
+    uint64_t misses = atomic_load(&cache.misses);
+
+    LOGINF("files %zu open, hits %lu, misses %lu (%lu%% hit), coalesced %lu, evictions %lu, "
+           "expired %lu/%lu (unchanged/reloaded), invalidated %lu",
+           atomic_load(&cache.files), hits, misses, hits + misses > 0 ? hits * 100 / (hits + misses) : 0,
+           atomic_load(&cache.coalesced), atomic_load(&cache.evicts), atomic_load(&cache.unchanged), atomic_load(&cache.reloaded),
+           atomic_load(&cache.invalidated));
+}
+
+static void fcache_init(void)
+{
+#if CONFIG_FCACHE_SIZE > 0
+    for (size_t i = 0; i < CONFIG_FCACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache.shards[i].lock, NULL);
+        pthread_cond_init(&cache.shards[i].landed, NULL);
+        cache.shards[i].lru.next = &cache.shards[i].lru;
+        cache.shards[i].lru.prev = &cache.shards[i].lru;
+    }
+#endif
+
+    stats_register(fcache_stats_report, NULL);
+}
+
+int fcache_open(const char *path, fcache_type_f type, const struct fcache_file_s **file)
+{
+#if CONFIG_FCACHE_SIZE > 0
+    struct fcache_flight_s *flight = NULL;
+    uint64_t generation = 0;
+#endif
+    struct fcache_entry_s *entry = NULL;
+    uint64_t hash = 0;
+    int result = 0;
+
+    if (path == NULL || type == NULL || file == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    pthread_once(&cache_once, fcache_init);
+
+    hash = fcache_hash(path);
+
+#if CONFIG_FCACHE_SIZE > 0
+    entry = fcache_lookup(hash, path);
+    if (entry != NULL)
+    {
+        *file = &entry->file;
+
+        return 0;
+    }
+
+    /* Cold file requested by many clients at once is opened once */
+    if (fcache_flight_wait(hash, path, &flight, &entry, &result) == true)
+    {
+        if (result < 0)
+        {
+            return result;
+        }
+
+        *file = &entry->file;
+
+        return 0;
+    }
+#endif
+
+    atomic_fetch_add_explicit(&cache.misses, 1, memory_order_relaxed);
+
+#if CONFIG_FCACHE_SIZE > 0
+    generation = fcache_generation(hash);
+#endif
+
+    result = fcache_entry_load(path, hash, type, &entry);
+
+#if CONFIG_FCACHE_SIZE > 0
+    if (result == 0)
+    {
+        entry = fcache_insert(entry, generation);
+    }
+
+    fcache_flight_land(flight, result, entry);
+#endif
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    *file = &entry->file;
+
+    return 0;
+}
+
+void fcache_close(const struct fcache_file_s *file)
+{
+    if (file == NULL)
+    {
+        return;
+    }
+
+    /* File is the first member of entry */
+    fcache_entry_put((struct fcache_entry_s *)file);
+}
+
+void fcache_invalidate(const char *path)
+{
+#if CONFIG_FCACHE_SIZE > 0
+    uint64_t hash = fcache_hash(path);
+    struct fcache_shard_s *shard = fcache_shard_get(hash);
+    struct fcache_entry_s *entry = NULL;
+
+    pthread_once(&cache_once, fcache_init);
+
+    pthread_mutex_lock(&shard->lock);
+
+    atomic_fetch_add(&shard->generations[(hash / CONFIG_FCACHE_SHARDS) % FCACHE_BUCKETS], 1);
+
+    entry = fcache_shard_find(shard, hash, path);
+    if (entry != NULL)
+    {
+        fcache_shard_unlink(shard, entry);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry != NULL)
+    {
+        atomic_fetch_add_explicit(&cache.invalidated, 1, memory_order_relaxed);
+
+        fcache_entry_put(entry);
+    }
+#endif
+}
+
+void fcache_invalidate_all(void)
+{
+#if CONFIG_FCACHE_SIZE > 0
+    struct fcache_shard_s *shard = NULL;
+    struct fcache_entry_s *entry = NULL;
+    struct fcache_entry_s *dropped = NULL;
+
+    pthread_once(&cache_once, fcache_init);
+
+    atomic_fetch_add(&cache.generation, 1);
+
+    for (size_t i = 0; i < CONFIG_FCACHE_SHARDS; i++)
+    {
+        shard = &cache.shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        while (shard->lru.next != &shard->lru)
+        {
+            entry = shard->lru.next;
+            fcache_shard_unlink(shard, entry);
+
+            entry->chain = dropped;
+            dropped = entry;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    while (dropped != NULL)
+    {
+        entry = dropped;
+        dropped = entry->chain;
+
+        atomic_fetch_add_explicit(&cache.invalidated, 1, memory_order_relaxed);
+
+        fcache_entry_put(entry);
+    }
+#endif
+}
+
+void fcache_ttl_set(unsigned int ttl)
+{
+    atomic_store(&cache.ttl, ttl);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file fcache.h
+ * @brief This module caches open descriptors and metadata of served files
+ *
+ * The module do following:
+ *  - keep descriptor, size, modification time, inode and content type of
+ *    recently served files in hash table split into independently locked shards
+ *  - check cached file on disk once its time to live expires, and reopen it if it was changed
+ *  - evict least recently used file when shard is full
+ *  - open file missed by concurrent requests once, they wait and share the descriptor
+ *
+ * Files are also dropped on demand, once a change of them is noticed.
+ * Files are reference counted, so descriptor stays open while response is
+ * sent even if the file is evicted meanwhile.
+ **/
+
+#ifndef FCACHE_H_
+#define FCACHE_H_
+
+#include <time.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/**
+ * @brief The structure represents cached file
+ **/
+struct fcache_file_s
+{
+    int fd;                /// descriptor of file, shall not be closed by user
+    size_t size;           /// size of file in bytes
+    struct timespec mtime; /// time of last modification
+    ino_t ino;             /// inode number
+    int type;              /// content type returned by type function when file was opened
+};
+
+/**
+ * @brief Function type that resolves content type of file by its path
+ *
+ * @param path[in] - path of file
+ *
+ * @retval content type, negative value if file shall not be served
+ **/
+typedef int (*fcache_type_f)(const char *path);
+
+/**
+ * @brief Get regular file from cache, or open it and put to cache
+ *
+ * @param path[in] - normalized path of file, it is the key of cache
+ * @param type[in] - function to resolve content type of file that is not cached yet
+ * @param file[out] - cached file, shall be released by fcache_close
+ *
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int fcache_open(const char *path, fcache_type_f type, const struct fcache_file_s **file);
+
+/**
+ * @brief Release file got by fcache_open
+ *
+ * @param file[in] - cached file
+ **/
+void fcache_close(const struct fcache_file_s *file);
+
+/**
+ * @brief Drop file from cache, it is opened again by next request
+ *
+ * @param path[in] - normalized path of file
+ **/
+void fcache_invalidate(const char *path);
+
+/**
+ * @brief Drop all files from cache
+ **/
+void fcache_invalidate_all(void);
+
+/**
+ * @brief Set time cached files are used without checking them on disk
+ *
+ * New time applies to files opened or checked after the call.
+ *
+ * @param ttl[in] - time to live in milliseconds
+ **/
+void fcache_ttl_set(unsigned int ttl);
+
+#endif
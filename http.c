@@ -3,11 +3,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
 
-#include <libgen.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "server.h"
 #include "http.h"
+#include "scan.h"
+#include "fcache.h"
+#include "rcache.h"
+#include "ncache.h"
 #include "config.h"
 #include "log.h"
 
@@ -22,6 +30,51 @@ enum resource_type_e
     RESOURCE_TYPE_INVALID = -1
 };
 
+enum http_parse_state_e
+{
+    HTTP_PARSE_STATE_METHOD = 0,
+    HTTP_PARSE_STATE_TARGET,
+    HTTP_PARSE_STATE_VERSION,
+    HTTP_PARSE_STATE_REQLINE_LF,
+    HTTP_PARSE_STATE_HEADER_START,
+    HTTP_PARSE_STATE_HEADER_NAME,
+    HTTP_PARSE_STATE_HEADER_VALUE_START,
+    HTTP_PARSE_STATE_HEADER_VALUE,
+    HTTP_PARSE_STATE_HEADER_LF,
+    HTTP_PARSE_STATE_END_LF,
+};
+
+/** Piece of request located in connection input buffer */
+struct http_span_s
+{
+    uint16_t off;
+    uint16_t len;
+};
+
+struct http_header_s
+{
+    struct http_span_s name;
+    struct http_span_s value;
+};
+
+/** Parser state kept in connection between pieces of request */
+struct http_parser_s
+{
+    enum http_parse_state_e state;
+    size_t pos;  /// offset of the next byte to parse
+    size_t mark; /// offset of the first byte of current token
+    struct http_span_s method;
+    struct http_span_s target;
+    struct http_span_s version;
+    struct http_header_s headers[CONFIG_HTTP_MAX_HEADERS];
+    size_t nheaders;
+};
+
+_Static_assert(sizeof(struct http_parser_s) <= CONFIG_PROTO_CTX_LEN,
+               "HTTP parser state does not fit connection protocol storage");
+_Static_assert(CONFIG_INPUT_BUFF_LEN <= UINT16_MAX,
+               "Input buffer is too big for HTTP parser offsets");
+
 struct http_req_s
 {
     char method[8];
@@ -33,15 +86,18 @@ struct http_req_s
 struct http_resp_s
 {
     char status[128];
-    char header[128];
-    FILE *file;
+    char header[256];
+    int fd;
+    size_t size;
 };
 
 static int http_send_responce(void *connctx, struct http_resp_s *resp)
 {
-    char buf[CONFIG_OUTPUT_BUFF_LEN] = {0};
+    char body[CONFIG_HTTP_INLINE_BODY_LEN];
+    struct iovec iov[3] = {0};
+    ssize_t readlen = 0;
+    int iovcnt = 0;
     int sendlen = 0;
-    int readlen = 0;
 
     /* Check output arguments */
     if(resp == NULL)
@@ -51,16 +107,30 @@ static int http_send_responce(void *connctx, struct http_resp_s *resp)
         return -EINVAL;
     }
 
-    /* Copy status to output buffer */
-    strcpy(buf, resp->status);
-    sendlen += strlen(resp->status);
+    /* Status and headers are sent straight from response without copying */
+    iov[iovcnt].iov_base = resp->status;
+    iov[iovcnt++].iov_len = strlen(resp->status);
 
-    /* Copy headers to output bufer */
-    strcpy(buf + sendlen, resp->header);
-    sendlen += strlen(resp->header);
+    iov[iovcnt].iov_base = resp->header;
+    iov[iovcnt++].iov_len = strlen(resp->header);
 
-    /* Send status and header */
-    sendlen = server_send(connctx, buf, sendlen);
+    /* Small body leaves together with status and headers */
+    if(resp->fd >= 0 && resp->size <= sizeof(body))
+    {
+        readlen = pread(resp->fd, body, resp->size, 0);
+        if(readlen < 0)
+        {
+            LOGERR("Fail to read file. Result: %s", strerror(errno));
+
+            return -errno;
+        }
+
+        iov[iovcnt].iov_base = body;
+        iov[iovcnt++].iov_len = readlen;
+    }
+
+    /* Send status, header and body if it is small enough */
+    sendlen = server_sendv(connctx, iov, iovcnt);
     if(sendlen < 0)
     {
         LOGERR("Fail to send status and header Result %d", sendlen);
@@ -68,39 +138,143 @@ static int http_send_responce(void *connctx, struct http_resp_s *resp)
         return sendlen;
     }
 
-    /* Send file if necessary */
-    if(resp->file != NULL)
+    /* Send large file separately */
+    if(resp->fd >= 0 && resp->size > sizeof(body))
     {
-        while((readlen = fread(buf, sizeof(char), CONFIG_OUTPUT_BUFF_LEN, resp->file)) != 0)
+        sendlen = server_sendfile(connctx, resp->fd, 0, resp->size);
+        if(sendlen < 0)
         {
-            sendlen = server_send(connctx, buf, readlen);
-            if(sendlen < 0)
-            {
-                LOGERR("Fail to send file. Result %d", sendlen);
+            LOGERR("Fail to send file. Result %d", sendlen);
 
-                return sendlen;
-            }
+            return sendlen;
         }
+
+        readlen = sendlen;
+    }
+
+    /* File is truncated after its length was sent in header. Client would take
+        the next response for the rest of body, so connection is closed instead */
+    if(resp->fd >= 0 && (size_t)readlen < resp->size)
+    {
+        LOGERR("File is truncated while it is sent");
+
+        return -ENODATA;
     }
 
     return 0;
 }
 
-static int http_send_not_found(void *connctx)
+/* Render status, header and small body into one block, offer it to response cache and send.
+    Response is offered first, so requests that wait for it are not held by slow client */
+static int http_send_rendered(void *connctx, struct http_req_s *req, struct http_resp_s *resp,
+                              uint64_t generation, struct rcache_flight_s *flight)
 {
-    int result = 0;
+    size_t statuslen = strlen(resp->status);
+    size_t headerlen = strlen(resp->header);
+    size_t len = statuslen + headerlen + resp->size;
+    ssize_t readlen = 0;
+    char *block = NULL;
+    struct iovec iov = {0};
+    int sendlen = 0;
+
+    block = malloc(len);
+    if(block == NULL)
+    {
+        rcache_cancel(flight);
+
+        return http_send_responce(connctx, resp);
+    }
+
+    memcpy(block, resp->status, statuslen);
+    memcpy(block + statuslen, resp->header, headerlen);
+
+    readlen = pread(resp->fd, block + statuslen + headerlen, resp->size, 0);
+    if(readlen < 0)
+    {
+        LOGERR("Fail to read file. Result: %s", strerror(errno));
+
+        rcache_cancel(flight);
+
+        free(block);
+
+        return -errno;
+    }
+
+    /* File may be truncated meanwhile, so send what was read and close connection */
+    len = statuslen + headerlen + readlen;
+
+    if((size_t)readlen == resp->size)
+    {
+        rcache_add(req->path, req->keepalive > 0, block, len, generation, flight);
+    }
+    else
+    {
+        rcache_cancel(flight);
+    }
+
+    iov.iov_base = block;
+    iov.iov_len = len;
+
+    sendlen = server_sendv(connctx, &iov, 1);
+    if(sendlen < 0)
+    {
+        LOGERR("Fail to send rendered responce. Result %d", sendlen);
+
+        free(block);
+
+        return sendlen;
+    }
+
+    if((size_t)readlen < resp->size)
+    {
+        LOGERR("File is truncated while it is sent");
+
+        free(block);
+
+        return -ENODATA;
+    }
+
+    free(block);
+
+    return 0;
+}
+
+static int http_send_cached(void *connctx, const struct rcache_resp_s *cached)
+{
+    struct iovec iov =
+    {
+        .iov_base = (void *)cached->data,
+        .iov_len = cached->len
+    };
+    int sendlen = 0;
 
-    struct http_resp_s resp =
+    /* Response is copied to output queue if it is not sent at once */
+    sendlen = server_sendv(connctx, &iov, 1);
+    if(sendlen < 0)
     {
-        .status = "HTTP/1.1 404 Not Found\n\n",
-        .header = "Not Found\n\n",
-        .file = NULL
+        LOGERR("Fail to send cached responce. Result %d", sendlen);
+
+        return sendlen;
+    }
+
+    return 0;
+}
+
+static int http_send_not_found(void *connctx)
+{
+    /* Scanners probe many missing paths, so response is ready to send as is */
+    static const char not_found[] = "HTTP/1.1 404 Not Found\n\nNot Found\n\n";
+    struct iovec iov =
+    {
+        .iov_base = (void *)not_found,
+        .iov_len = sizeof(not_found) - 1
     };
+    int result = 0;
 
     LOGINF("404: page not found");
 
-    /* Send responce header */
-    result = http_send_responce(connctx, &resp);
+    /* Send responce */
+    result = server_sendv(connctx, &iov, 1);
     if(result < 0)
     {
         LOGERR("Fail to send responce. Result: %d", result);
@@ -119,7 +293,7 @@ static int http_send_not_implemented(void *connctx)
     {
         .status = "HTTP/1.1 501 Not Implemented\n\n",
         .header = "Not Implemented\n\n",
-        .file = NULL
+        .fd = -1
     };
 
     LOGINF("501: not implemented");
@@ -136,6 +310,31 @@ static int http_send_not_implemented(void *connctx)
     return 0;
 }
 
+static int http_send_too_early(void *connctx)
+{
+    int result = 0;
+
+    struct http_resp_s resp = 
+    {
+        .status = "HTTP/1.1 425 Too Early\n\n",
+        .header = "Too Early\n\n",
+        .fd = -1
+    };
+
+    LOGINF("425: too early");
+
+    /* Send responce header */
+    result = http_send_responce(connctx, &resp);
+    if(result < 0)
+    {
+        LOGERR("Fail to send responce. Result: %d", result);
+
+        return result;
+    }
+
+    return 0;
+}
+
 static int http_send_bad_request(void *connctx)
 {
     int result = 0;
@@ -144,7 +343,7 @@ static int http_send_bad_request(void *connctx)
     {
         .status = "HTTP/1.1 400 Bad Request\n\n",
         .header = "Bad Request\n\n",
-        .file = NULL
+        .fd = -1
     };
 
     LOGINF("400: bad request");
@@ -161,73 +360,56 @@ static int http_send_bad_request(void *connctx)
     return 0;
 }
 
-static enum resource_type_e http_resource_type_get(char *filepath)
+static int http_resource_type_get(const char *filepath)
 {
-    char *filebase = NULL;
-    char *extension = NULL;
-    enum resource_type_e type = RESOURCE_TYPE_INVALID;
+    const char *filebase = NULL;
+    const char *extension = NULL;
 
-    char *dupfilepath = strdup(filepath);
+    filebase = strrchr(filepath, '/');
+    filebase = filebase == NULL ? filepath : filebase + 1;
 
-    filebase = strtok(dupfilepath, ".");
-    if(filebase == NULL)
-    {
-        LOGERR("Fail to parse filebase");
-
-        goto exit;
-    }
-    
-    extension = strtok(NULL, ".");
-    if(extension == NULL)
+    extension = strrchr(filebase, '.');
+    if(extension == NULL || extension == filebase)
     {
         LOGERR("Fail to parse extension");
 
-        goto exit;
+        return RESOURCE_TYPE_INVALID;
     }
 
+    extension++;
+
     if(strcmp(extension, "html") == 0)
     {
-        type = RESOURCE_TYPE_TEXT_HTTP;
-
-        goto exit;
-
+        return RESOURCE_TYPE_TEXT_HTTP;
     }
 
     if(strcmp(extension, "xml") == 0)
     {
-        type = RESOURCE_TYPE_TEXT_XML;
-
-        goto exit;
-
+        return RESOURCE_TYPE_TEXT_XML;
     }
 
     if(strcmp(extension, "json") == 0)
     {
-        type = RESOURCE_TYPE_TEXT_JSON;
-
-        goto exit;
+        return RESOURCE_TYPE_TEXT_JSON;
     }
 
     /* By default type is file */
-    type = RESOURCE_TYPE_FILE;
-
-exit:
-
-    free(dupfilepath);
-
-    return type;
+    return RESOURCE_TYPE_FILE;
 }
 
 static int http_header_generate(struct http_req_s *req, struct http_resp_s *resp)
 {
-    size_t offset = 0;
+    int offset = 0;
+    int len = 0;
 
     static const char text_html[] = "text/html";
     static const char text_xml[] = "text/xml";
     static const char text_json[] = "text/json";
     static const char text_header_format[] = "Content-type: %s\n";
     static const char file_header_format[] = "Content-Disposition: attachment; filename=%s\n";
+    static const char length_format[] = "Content-Length: %zu\n";
     static const char keepalive[] = "Connection: keep-alive\n";
+    static const char noalive[] = "Connection: close\n";
     
     if(req == NULL)
     {
@@ -239,105 +421,407 @@ static int http_header_generate(struct http_req_s *req, struct http_resp_s *resp
     switch(req->type)
     {
         case RESOURCE_TYPE_TEXT_HTTP:
-            offset = sprintf(resp->header, text_header_format, text_html);
+            offset = snprintf(resp->header, sizeof(resp->header), text_header_format, text_html);
             break;
         
         case RESOURCE_TYPE_TEXT_XML:
-            offset = sprintf(resp->header, text_header_format, text_xml);
+            offset = snprintf(resp->header, sizeof(resp->header), text_header_format, text_xml);
             break;
 
         case RESOURCE_TYPE_TEXT_JSON:
-            offset = sprintf(resp->header, text_header_format, text_json);
+            offset = snprintf(resp->header, sizeof(resp->header), text_header_format, text_json);
             break;
 
         default:
-            offset = sprintf(resp->header, file_header_format, req->path);
+            offset = snprintf(resp->header, sizeof(resp->header), file_header_format, req->path);
     }
 
-    /// @todo: check for buffer overflow
+    if(offset < 0 || (size_t)offset >= sizeof(resp->header))
+    {
+        return -ENOMEM;
+    }
 
-    /* Append keepalive */
-    if(req->keepalive > 0)
+    /* Append length, so client knows where the body ends on persistent connection,
+        and connection option followed by final \n */
+    len = snprintf(resp->header + offset, sizeof(resp->header) - offset, length_format, resp->size);
+    if(len < 0 || (size_t)(offset + len) >= sizeof(resp->header))
     {
-        strcpy(resp->header + offset, keepalive);
-        offset += strlen(keepalive);
+        return -ENOMEM;
     }
 
-    /* Append final /n */
-    strcpy(resp->header + offset, "\n");
+    offset += len;
+
+    len = snprintf(resp->header + offset, sizeof(resp->header) - offset, "%s\n",
+                   req->keepalive > 0 ? keepalive : noalive);
+    if(len < 0 || (size_t)(offset + len) >= sizeof(resp->header))
+    {
+        return -ENOMEM;
+    }
 
     return 0;
 }
 
-#if CONFIG_KEEPALIVE_ENABLE
-static int http_keepalive_parse(char *buf, size_t len, struct http_req_s *req)
+static void http_span_set(struct http_span_s *span, size_t start, size_t end)
 {
-    if(buf == NULL || req == NULL)
-    {
-        return -EINVAL;
-    }
+    span->off = start;
+    span->len = end - start;
+}
+
+/**
+ * @brief Skip run of characters of the class
+ * 
+ * @param parser[in] - parser state
+ * @param cls[in] - class of characters to skip
+ * @param buf[in] - buffer with request
+ * @param len[in] - length of data in buffer
+ * 
+ * @retval true if parser stopped at the byte that ends the run,
+ * false if end of data was reached
+ **/
+static bool http_parser_skip(struct http_parser_s *parser, enum scan_class_e cls,
+                             const char *buf, size_t len)
+{
+    parser->pos += scan_span(cls, buf + parser->pos, len - parser->pos);
+
+    return parser->pos < len;
+}
+
+static void http_parser_reset(struct http_parser_s *parser)
+{
+    parser->state = HTTP_PARSE_STATE_METHOD;
+    parser->pos = 0;
+    parser->mark = 0;
+    parser->nheaders = 0;
+}
 
-    req->keepalive = 0;
+/**
+ * @brief Continue parsing of request head from the place where previous call stopped
+ * 
+ * @param parser[in] - parser state
+ * @param buf[in] - buffer with request
+ * @param len[in] - length of data in buffer
+ * 
+ * @retval length of request head if it is complete, 0 if more data is required,
+ * negative errno value if request is malformed
+ **/
+static int http_parser_run(struct http_parser_s *parser, const char *buf, size_t len)
+{
+    struct http_header_s *header = NULL;
+    unsigned char ch = 0;
 
-    if(strstr(buf, "Connection: keep-alive") != NULL)
+    for(; parser->pos < len; parser->pos++)
     {
-        req->keepalive = 1;
+        ch = buf[parser->pos];
+
+        switch(parser->state)
+        {
+            case HTTP_PARSE_STATE_METHOD:
+                /* Empty lines before request line are ignored */
+                if(parser->pos == parser->mark && (ch == '\r' || ch == '\n'))
+                {
+                    parser->mark++;
+
+                    break;
+                }
+
+                if(http_parser_skip(parser, SCAN_CLASS_TOKEN, buf, len) == false)
+                {
+                    return 0;
+                }
+
+                ch = buf[parser->pos];
+                if(ch != ' ' || parser->pos == parser->mark)
+                {
+                    return -ENOMSG;
+                }
+
+                http_span_set(&parser->method, parser->mark, parser->pos);
+                parser->mark = parser->pos + 1;
+                parser->state = HTTP_PARSE_STATE_TARGET;
+                break;
+
+            case HTTP_PARSE_STATE_TARGET:
+                if(http_parser_skip(parser, SCAN_CLASS_VCHAR, buf, len) == false)
+                {
+                    return 0;
+                }
+
+                ch = buf[parser->pos];
+                if(ch != ' ' || parser->pos == parser->mark)
+                {
+                    return -ENOMSG;
+                }
+
+                http_span_set(&parser->target, parser->mark, parser->pos);
+                parser->mark = parser->pos + 1;
+                parser->state = HTTP_PARSE_STATE_VERSION;
+                break;
+
+            case HTTP_PARSE_STATE_VERSION:
+                if(http_parser_skip(parser, SCAN_CLASS_VCHAR, buf, len) == false)
+                {
+                    return 0;
+                }
+
+                ch = buf[parser->pos];
+                if(ch != '\r' && ch != '\n')
+                {
+                    return -ENOMSG;
+                }
+
+                http_span_set(&parser->version, parser->mark, parser->pos);
+                if(parser->version.len != 8 || memcmp(buf + parser->mark, "HTTP/1.", 7) != 0)
+                {
+                    return -EPROTONOSUPPORT;
+                }
+
+                parser->state = ch == '\r' ? HTTP_PARSE_STATE_REQLINE_LF : HTTP_PARSE_STATE_HEADER_START;
+                break;
+
+            case HTTP_PARSE_STATE_REQLINE_LF:
+            case HTTP_PARSE_STATE_HEADER_LF:
+                if(ch != '\n')
+                {
+                    return -ENOMSG;
+                }
+
+                parser->state = HTTP_PARSE_STATE_HEADER_START;
+                break;
+
+            case HTTP_PARSE_STATE_HEADER_START:
+                if(ch == '\r')
+                {
+                    parser->state = HTTP_PARSE_STATE_END_LF;
+
+                    break;
+                }
+
+                if(ch == '\n')
+                {
+                    return parser->pos + 1;
+                }
+
+                if(parser->nheaders == CONFIG_HTTP_MAX_HEADERS)
+                {
+                    LOGERR("Too many headers");
+
+                    return -E2BIG;
+                }
+
+                parser->mark = parser->pos;
+                parser->state = HTTP_PARSE_STATE_HEADER_NAME;
+                /* fall through */
+
+            case HTTP_PARSE_STATE_HEADER_NAME:
+                if(http_parser_skip(parser, SCAN_CLASS_TOKEN, buf, len) == false)
+                {
+                    return 0;
+                }
+
+                /* Empty name means obsolete line folding, it is not accepted as well */
+                ch = buf[parser->pos];
+                if(ch != ':' || parser->pos == parser->mark)
+                {
+                    return -ENOMSG;
+                }
+
+                header = &parser->headers[parser->nheaders];
+                http_span_set(&header->name, parser->mark, parser->pos);
+                parser->state = HTTP_PARSE_STATE_HEADER_VALUE_START;
+                break;
+
+            case HTTP_PARSE_STATE_HEADER_VALUE_START:
+                /* Skip leading whitespaces */
+                if(ch == ' ' || ch == '\t')
+                {
+                    break;
+                }
+
+                parser->mark = parser->pos;
+                parser->state = HTTP_PARSE_STATE_HEADER_VALUE;
+                /* fall through */
+
+            case HTTP_PARSE_STATE_HEADER_VALUE:
+                if(http_parser_skip(parser, SCAN_CLASS_FIELD, buf, len) == false)
+                {
+                    return 0;
+                }
+
+                ch = buf[parser->pos];
+                if(ch != '\r' && ch != '\n')
+                {
+                    return -ENOMSG;
+                }
+
+                header = &parser->headers[parser->nheaders++];
+                http_span_set(&header->value, parser->mark, parser->pos);
+
+                /* Strip trailing whitespaces */
+                while(header->value.len > 0 &&
+                      (buf[header->value.off + header->value.len - 1] == ' ' ||
+                       buf[header->value.off + header->value.len - 1] == '\t'))
+                {
+                    header->value.len--;
+                }
+
+                parser->state = ch == '\r' ? HTTP_PARSE_STATE_HEADER_LF : HTTP_PARSE_STATE_HEADER_START;
+                break;
+
+            case HTTP_PARSE_STATE_END_LF:
+                if(ch != '\n')
+                {
+                    return -ENOMSG;
+                }
+
+                return parser->pos + 1;
+        }
     }
 
     return 0;
 }
-#endif
 
-int http_request_parse(char *buf, size_t len, struct http_req_s *req)
+static bool http_span_equal(const char *buf, const struct http_span_s *span, const char *str)
 {
-    int result = 0;
-    char *dupbuf = strdup(buf);
-    char *token = NULL;
+    return span->len == strlen(str) && strncasecmp(buf + span->off, str, span->len) == 0;
+}
+
+/**
+ * @brief Check if comma separated list in header value contains the token
+ * 
+ * @param buf[in] - buffer with request
+ * @param header[in] - header to look in
+ * @param token[in] - token to look for
+ * 
+ * @retval true if the token is found, false otherwise
+ **/
+static bool http_header_has_token(const char *buf, const struct http_header_s *header,
+                                  const char *token)
+{
+    struct http_span_s item = { .off = header->value.off };
+    size_t end = header->value.off + header->value.len;
+    size_t pos = 0;
 
-    if(dupbuf == NULL)
+    for(pos = header->value.off; pos <= end; pos++)
     {
-        LOGERR("Fail to duplicate incoming buffer");
+        if(pos < end && buf[pos] != ',')
+        {
+            continue;
+        }
 
-        return -ENOMEM;
+        /* Trim whitespaces around the item */
+        while(item.off < pos && (buf[item.off] == ' ' || buf[item.off] == '\t'))
+        {
+            item.off++;
+        }
+
+        item.len = pos - item.off;
+        while(item.len > 0 && (buf[item.off + item.len - 1] == ' ' ||
+                               buf[item.off + item.len - 1] == '\t'))
+        {
+            item.len--;
+        }
+
+        if(http_span_equal(buf, &item, token) == true)
+        {
+            return true;
+        }
+
+        item.off = pos + 1;
     }
 
-    /* Get method */
-    token = strtok(dupbuf, " ");
-    if(token == NULL)
+    return false;
+}
+
+static void http_keepalive_parse(const char *buf, const struct http_parser_s *parser,
+                                 struct http_req_s *req)
+{
+    const struct http_header_s *header = NULL;
+    size_t i = 0;
+
+    /* Connection is persistent by default since HTTP/1.1 */
+    req->keepalive = memcmp(buf + parser->version.off, "HTTP/1.0", parser->version.len) != 0;
+
+    for(i = 0; i < parser->nheaders; i++)
     {
-        LOGERR("Fail to parse method");
+        header = &parser->headers[i];
+
+        if(http_span_equal(buf, &header->name, "Connection") == false)
+        {
+            continue;
+        }
+
+        if(http_header_has_token(buf, header, "close") == true)
+        {
+            req->keepalive = 0;
 
-        result = -ENOMSG;
+            return;
+        }
 
-        goto exit;
+        if(http_header_has_token(buf, header, "keep-alive") == true)
+        {
+            req->keepalive = 1;
+        }
     }
+}
 
-    strcpy(req->method, token);
+/* Collapse repeated slashes and "/./" segments, so the same file has single path */
+static void http_path_normalize(char *path)
+{
+    char *src = path;
+    char *dst = path;
 
-    /* Get path */
-    token = strtok(NULL, " ");
-    if(token == NULL)
+    while(*src != '\0')
     {
-        LOGERR("Fail to parse path");
+        if(*src == '/' && src[1] == '/')
+        {
+            src++;
+
+            continue;
+        }
 
-        result = -ENOMSG;
+        if(*src == '/' && src[1] == '.' && (src[2] == '/' || src[2] == '\0') && dst != path)
+        {
+            src += 2;
 
-        goto exit;
+            continue;
+        }
+
+        *dst++ = *src++;
     }
 
-    if(strlen(token) > CONFIG_MAX_PATH_SIZE)
-    {
-        LOGERR("Path is to big (%lu bytes)", strlen(token));
+    *dst = '\0';
+}
 
-        result = -ENOMEM;
+static int http_request_parse(const char *buf, const struct http_parser_s *parser,
+                              struct http_req_s *req)
+{
+    int result = 0;
 
-        goto exit;
+    /* Get method */
+    if(parser->method.len >= sizeof(req->method))
+    {
+        LOGERR("Method is too long (%u bytes)", parser->method.len);
+
+        return -ENOMSG;
     }
 
-    strcpy(&req->path[1], token);
+    memcpy(req->method, buf + parser->method.off, parser->method.len);
+    req->method[parser->method.len] = '\0';
+
+    /* Get path */
+    if(parser->target.len + 1 >= CONFIG_MAX_PATH_SIZE)
+    {
+        LOGERR("Path is to big (%u bytes)", parser->target.len);
+
+        return -ENOMEM;
+    }
 
     /* Add . at the begining of path to make it relative */
     req->path[0] = '.';
+    memcpy(&req->path[1], buf + parser->target.off, parser->target.len);
+    req->path[parser->target.len + 1] = '\0';
+
+    http_path_normalize(req->path);
 
     /* Replase / with index.html */
     if(strcmp(req->path, "./") == 0)
@@ -350,29 +834,10 @@ int http_request_parse(char *buf, size_t len, struct http_req_s *req)
     {
         LOGERR("Path conatins ../ or ~/");
 
-        result = -EINVAL;
-
-        goto exit;
-    }
-
-    /* Get resource type */
-    req->type = http_resource_type_get(basename(req->path));
-
-    if(RESOURCE_TYPE_INVALID == req->type)
-    {
-        LOGERR("Invalid resource type");
-
-        result = -EINVAL;
-
-        goto exit;
+        return -EINVAL;
     }
 
-#if CONFIG_KEEPALIVE_ENABLE
-    result = http_keepalive_parse(buf, len, req);
-#endif
-
-exit:
-    free(dupbuf);
+    http_keepalive_parse(buf, parser, req);
 
     return result;
 }
@@ -380,10 +845,43 @@ exit:
 int http_handler(void *connctx, char *buf, size_t len)
 {
     int result = 0;
+    int reqlen = 0;
+    struct conn_s *conn = connctx;
+    struct http_parser_s *parser = (struct http_parser_s *)conn->proto;
     struct http_req_s req = {0};
-    struct http_resp_s resp = { .status = "HTTP/1.1 200 OK\n" };
+    struct http_resp_s resp = { .status = "HTTP/1.1 200 OK\n", .fd = -1 };
+    const struct fcache_file_s *file = NULL;
+    const struct rcache_resp_s *cached = NULL;
+    struct rcache_flight_s *flight = NULL;
+    uint64_t generation = 0;
+    uint64_t missgen = 0;
+
+    reqlen = http_parser_run(parser, buf, len);
+    if(reqlen == 0)
+    {
+        if(len < CONFIG_INPUT_BUFF_LEN)
+        {
+            /* Wait for the rest of request */
+            return 0;
+        }
+
+        LOGERR("Request does not fit input buffer");
+
+        reqlen = -EMSGSIZE;
+    }
+
+    if(reqlen > 0)
+    {
+        result = http_request_parse(buf, parser, &req);
+    }
+    else
+    {
+        result = reqlen;
+    }
+
+    /* Parser starts from scratch for next request */
+    http_parser_reset(parser);
 
-    result = http_request_parse(buf, len, &req);
     if(result < 0)
     {
         LOGERR("Fail to parse request. Result: %d", result);
@@ -395,8 +893,26 @@ int http_handler(void *connctx, char *buf, size_t len)
 
     LOGINF("METHOD: %s", req.method);
     LOGINF("PATH: %s", req.path);
+    /* Keep-alive may be disabled by server configuration */
+    if(conn->srv->conf.keepalive == 0)
+    {
+        req.keepalive = 0;
+    }
+
     LOGINF("KEEPALIFE: %d", req.keepalive);
 
+    /* Early data may be replayed, so only idempotent requests are served
+        from it, client repeats others once handshake is complete */
+    if(conn->iface->early != NULL && conn->iface->early(conn->ctx, reqlen) == true &&
+       strcmp(req.method, "GET") != 0)
+    {
+        LOGERR("%s in early data\r\n", req.method);
+
+        http_send_too_early(connctx);
+
+        return -ENOMSG;
+    }
+
     /* Our server supports only GET method, so if not,
         retuen 501 error then */
     if(strcmp(req.method, "GET") != 0)
@@ -408,45 +924,108 @@ int http_handler(void *connctx, char *buf, size_t len)
         return -ENOMSG;
     }
 
-    /* Open the resource file */
-    resp.file = fopen(req.path, "r");
-    if(resp.file == NULL)
+    /* Hot small files are sent as response rendered before, or rendered by
+        concurrent request. Otherwise the request renders it for others */
+    result = rcache_get(req.path, req.keepalive > 0, &cached, &flight);
+    if(result == 0)
+    {
+        result = http_send_cached(connctx, cached);
+        rcache_put(cached);
+
+        goto sent;
+    }
+
+    /* Missing file is certain, so the file system is not touched */
+    if(ncache_missing(req.path) == true)
+    {
+        rcache_cancel(flight);
+
+        http_send_not_found(connctx);
+
+        return -ENOENT;
+    }
+
+    /* File is read after this point, so its change is noticed by response cache,
+        and file added meanwhile is not remembered as missing */
+    generation = rcache_generation(req.path);
+    missgen = ncache_generation(req.path);
+
+    /* Get the resource file, hot ones are open already */
+    result = fcache_open(req.path, http_resource_type_get, &file);
+    if(result == -EINVAL)
+    {
+        LOGERR("Invalid resource type");
+
+        rcache_cancel(flight);
+
+        http_send_bad_request(connctx);
+
+        return result;
+    }
+
+    if(result < 0)
     {
         LOGERR("Fail to open %s", req.path);
 
+        if(result == -ENOENT || result == -ENOTDIR)
+        {
+            ncache_miss(req.path, missgen);
+        }
+
+        rcache_cancel(flight);
+
         /* send 404 */
         http_send_not_found(connctx);
 
         return -ENOENT;
     }
 
+    req.type = file->type;
+    resp.fd = file->fd;
+    resp.size = file->size;
+
     /* Generate header */
     result = http_header_generate(&req, &resp);
     if(result < 0)
     {
         LOGERR("Fail to generate header. Result %d", result);
 
-        fclose(resp.file);
+        rcache_cancel(flight);
+
+        fcache_close(file);
 
         return -ENOMEM;
     }
 
-    /* Send requested file */
-    result = http_send_responce(connctx, &resp);
+    /* Send requested file, descriptor stays open in cache */
+    if(CONFIG_RCACHE_SIZE > 0 && resp.size <= CONFIG_RCACHE_FILE_MAX_LEN)
+    {
+        result = http_send_rendered(connctx, &req, &resp, generation, flight);
+    }
+    else
+    {
+        /* Large file is not rendered, waiting requests send it from the same descriptor */
+        rcache_cancel(flight);
+
+        result = http_send_responce(connctx, &resp);
+    }
+
+    fcache_close(file);
+
+sent:
     if(result < 0)
     {
         LOGERR("Fail to send responce. Result %d", result);
 
-        fclose(resp.file);
-
-        return 0;
+        return result;
     }
 
     LOGINF("Request handled successfully");
 
-#if CONFIG_KEEPALIVE_ENABLE
-    return req.keepalive;
-#else
-    return 0;
-#endif
+    if(req.keepalive > 0)
+    {
+        return reqlen;
+    }
+
+    return SERVER_HANDLER_CLOSE;
 }
\ No newline at end of file
@@ -11,13 +11,15 @@
  * @brief HTTP data handler
  * 
  * The function parses incoming request stored in buffer 
- * and handle it according to the requested data.
+ * and handle it according to the requested data. Parsing continues
+ * from the place where it was stopped if request came in several pieces.
  * 
  * @param connctx[in] - connection context
  * @param buf[in] - bufer that contains incoming data
  * @param len[in] - lenght of incoming data
  * 
- * @retval 1 if connection shall remains open, 0 otherwise
+ * @retval length of handled request if connection shall remains open,
+ * 0 if request is not complete yet, negative value otherwise
  **/
 int http_handler(void *connctx, char *buf, size_t len);
 
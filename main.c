@@ -7,6 +7,10 @@
 
 #include "server.h"
 #include "http.h"
+#include "stats.h"
+#include "scan.h"
+#include "watch.h"
+#include "config.h"
 #include "log.h"
 
 #define MODULE_NAME "main"
@@ -19,15 +23,48 @@ static char doc[] = "Simple HTTP server writen on C";
 
 /* A description of the arguments we accept. */
 
+/* Keys of options that have no short form */
+enum option_key_e
+{
+    OPTION_KEY_STATS = 0x100,
+    OPTION_KEY_PIN,
+    OPTION_KEY_HEADER_TIMEOUT,
+    OPTION_KEY_WRITE_TIMEOUT,
+    OPTION_KEY_CERT,
+    OPTION_KEY_KEY,
+    OPTION_KEY_SECURE_PORT,
+};
+
 /* The options we understand. */
 static struct argp_option options[] = {
   {"root",   'r', "root", 0, "Rood directory for resources" },
   {"addr",   'a', "addr", 0, "IP address of the server"},
   {"port",   'p', "port", 0, "TCP port to access server" },
   {"secure", 's', 0, 0, "Create secure HTTPS connection"},
+  {"secure-port", OPTION_KEY_SECURE_PORT, "port", 0, "TCP port of HTTPS listener served next to the main one"},
+  {"uring",  'u', 0, 0, "Use io_uring transport for plain HTTP connection in pool mode"},
+  {"mode",   'm', "mode", 0, "Connection handling mode: thread (default), pool, epoll or reuseport"},
+  {"workers", 'w', "num", 0, "Number of worker threads in pool mode (default is number of CPUs)"},
+  {"queue-depth", 'q', "num", 0, "Maximum number of connections waiting for pool worker"},
+  {"pin",    OPTION_KEY_PIN, 0, 0, "Pin listener threads to CPUs in reuseport mode"},
+  {"keepalive", 'k', "sec", 0, "Time an idle connection is kept open between requests (0 disables keep-alive)"},
+  {"header-timeout", OPTION_KEY_HEADER_TIMEOUT, "sec", 0, "Time a client has to send request header"},
+  {"write-timeout", OPTION_KEY_WRITE_TIMEOUT, "sec", 0, "Time a client has to accept next piece of response"},
+  {"cert",   OPTION_KEY_CERT, "file", 0, "Certificate chain of HTTPS server in PEM or DER format, may be repeated (e.g. ECDSA and RSA)"},
+  {"key",    OPTION_KEY_KEY, "file", 0, "Private key of certificate given by preceding --cert"},
+  {"stats",  OPTION_KEY_STATS, "sec", 0, "Period of statistic reports in seconds (0 disables)"},
   { 0 }
 };
 
+/* Names of connection handling modes for logging */
+static const char *mode_names[] =
+{
+    [SERVER_MODE_THREAD] = "thread",
+    [SERVER_MODE_EPOLL]  = "epoll",
+    [SERVER_MODE_POOL]   = "pool",
+    [SERVER_MODE_REUSEPORT] = "reuseport",
+};
+
 /* Used by main to communicate with parse_opt. */
 struct arguments
 {
@@ -35,6 +72,20 @@ struct arguments
     char *addr;
     int port;
     bool secure;
+    int secure_port;
+    bool uring;
+    enum server_mode_e mode;
+    size_t workers;
+    size_t queue_depth;
+    bool pin;
+    unsigned int keepalive;
+    unsigned int header_timeout;
+    unsigned int write_timeout;
+    const char *cert[CONFIG_TLS_MAX_CERTS];
+    const char *key[CONFIG_TLS_MAX_CERTS];
+    size_t certs;
+    size_t keys;
+    unsigned int stats;
 };
 
 /* Parse a single option. */
@@ -62,6 +113,126 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
             arguments->secure = true;
             break;
 
+        case OPTION_KEY_SECURE_PORT:
+            arguments->secure_port = atoi(arg);
+            if(arguments->secure_port <= 0)
+            {
+                argp_error(state, "Secure port shall be positive");
+            }
+            break;
+
+        case 'u':
+            arguments->uring = true;
+            break;
+
+        case 'm':
+            if(strcmp(arg, "thread") == 0)
+            {
+                arguments->mode = SERVER_MODE_THREAD;
+            }
+            else if(strcmp(arg, "epoll") == 0)
+            {
+                arguments->mode = SERVER_MODE_EPOLL;
+            }
+            else if(strcmp(arg, "pool") == 0)
+            {
+                arguments->mode = SERVER_MODE_POOL;
+            }
+            else if(strcmp(arg, "reuseport") == 0)
+            {
+                arguments->mode = SERVER_MODE_REUSEPORT;
+            }
+            else
+            {
+                argp_error(state, "Unknown mode %s", arg);
+            }
+            break;
+
+        case 'w':
+            arguments->workers = atoi(arg);
+            break;
+
+        case 'q':
+            arguments->queue_depth = atoi(arg);
+            if(arguments->queue_depth == 0)
+            {
+                argp_error(state, "Queue depth shall be positive");
+            }
+            break;
+
+        case OPTION_KEY_PIN:
+            arguments->pin = true;
+            break;
+
+        case 'k':
+            arguments->keepalive = atoi(arg);
+            break;
+
+        case OPTION_KEY_HEADER_TIMEOUT:
+            arguments->header_timeout = atoi(arg);
+            if(arguments->header_timeout == 0)
+            {
+                argp_error(state, "Header timeout shall be positive");
+            }
+            break;
+
+        case OPTION_KEY_WRITE_TIMEOUT:
+            arguments->write_timeout = atoi(arg);
+            if(arguments->write_timeout == 0)
+            {
+                argp_error(state, "Write timeout shall be positive");
+            }
+            break;
+
+        case OPTION_KEY_CERT:
+            if(arguments->certs == CONFIG_TLS_MAX_CERTS)
+            {
+                argp_error(state, "Too many certificates, up to %d are supported", CONFIG_TLS_MAX_CERTS);
+            }
+            arguments->cert[arguments->certs++] = arg;
+            break;
+
+        case OPTION_KEY_KEY:
+            if(arguments->keys == arguments->certs)
+            {
+                argp_error(state, "Key shall follow its certificate");
+            }
+            arguments->key[arguments->keys++] = arg;
+            break;
+
+        case OPTION_KEY_STATS:
+            arguments->stats = atoi(arg);
+            break;
+
+        case ARGP_KEY_END:
+            if(arguments->secure == true && arguments->uring == true)
+            {
+                argp_error(state, "io_uring transport does not support secure connection");
+            }
+
+            /* Ring is set up per thread, so thread per connection would pay for it
+                every time, while event loop modes do not drive the ring at all */
+            if(arguments->uring == true && arguments->mode != SERVER_MODE_POOL)
+            {
+                argp_error(state, "io_uring transport is supported in pool mode only");
+            }
+
+            if(arguments->keys != arguments->certs)
+            {
+                argp_error(state, "Every certificate shall have a key");
+            }
+
+            if(arguments->certs > 0 && arguments->secure == false && arguments->secure_port == 0)
+            {
+                argp_error(state, "Certificates are used by secure connection only");
+            }
+
+            if(arguments->secure_port == arguments->port)
+            {
+                argp_error(state, "Secure port shall differ from the main one");
+            }
+            break;
+
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -72,12 +243,77 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 /* argp parser. */
 static struct argp argp = { options, parse_opt, NULL, doc };
 
-static int start_server(char *addr, int port, bool secure, server_listen_handler_f handler)
+/* Create HTTPS listener that is served by threads of the main server */
+static int attach_secure_listener(struct server_s *server, struct arguments *arguments,
+                                  const struct server_conf_s *conf)
+{
+    struct server_s *listener = NULL;
+    int result = 0;
+
+    listener = server_create(SERVER_BACKEND_TLS);
+    if(listener == NULL)
+    {
+        LOGERR("Fail to create secure listener");
+
+        return -1;
+    }
+
+    result = server_configure(listener, conf);
+    if(result == 0)
+    {
+        result = server_init(listener, arguments->addr, arguments->secure_port);
+    }
+
+    if(result == 0)
+    {
+        result = server_attach(server, listener);
+    }
+
+    if(result < 0)
+    {
+        LOGERR("Fail to init secure listener. Result %d", result);
+
+        server_close(listener);
+    }
+
+    return result;
+}
+
+static int start_server(struct arguments *arguments, server_listen_handler_f handler)
 {
     struct server_s *server = NULL;
+    enum server_backend_e backend = SERVER_BACKEND_SOC;
+    struct server_conf_s conf =
+    {
+        .mode = arguments->mode,
+        .workers = arguments->workers,
+        .queue_depth = arguments->queue_depth,
+        .pin = arguments->pin,
+        .keepalive = arguments->keepalive,
+        .header_timeout = arguments->header_timeout,
+        .write_timeout = arguments->write_timeout
+    };
     int result = 0;
 
-    server = server_create(secure);
+    for(size_t i = 0; i < arguments->certs; i++)
+    {
+        conf.cert[i] = arguments->cert[i];
+        conf.key[i] = arguments->key[i];
+    }
+
+    /* Plain listener has no use for certificates, they are for secure one */
+    conf.certs = arguments->secure == true ? arguments->certs : 0;
+
+    if(arguments->secure == true)
+    {
+        backend = SERVER_BACKEND_TLS;
+    }
+    else if(arguments->uring == true)
+    {
+        backend = SERVER_BACKEND_URING;
+    }
+
+    server = server_create(backend);
     if(server == NULL)
     {
         LOGERR("Fail to create new server");
@@ -85,7 +321,15 @@ static int start_server(char *addr, int port, bool secure, server_listen_handler
         return -1;
     }
 
-    result = server_init(server, addr, port);
+    result = server_configure(server, &conf);
+    if(result < 0)
+    {
+        LOGERR("Fail to configure server. Result %d", result);
+
+        goto exit;
+    }
+
+    result = server_init(server, arguments->addr, arguments->port);
     if(result < 0)
     {
         LOGERR("Fail to init server. Result %d", result);
@@ -93,6 +337,17 @@ static int start_server(char *addr, int port, bool secure, server_listen_handler
         goto exit;
     }
 
+    if(arguments->secure_port > 0)
+    {
+        conf.certs = arguments->certs;
+
+        result = attach_secure_listener(server, arguments, &conf);
+        if(result < 0)
+        {
+            goto exit;
+        }
+    }
+
     result = server_listen(server, handler);
     if(result < 0)
     {
@@ -104,8 +359,6 @@ static int start_server(char *addr, int port, bool secure, server_listen_handler
 exit:
     server_close(server);
 
-    free(server);
-
     return result;
 }
 
@@ -118,6 +371,18 @@ int main(int argc, char **argv)
     arguments.addr = "127.0.0.1";
     arguments.port = 80;
     arguments.secure = false;
+    arguments.secure_port = 0;
+    arguments.uring = false;
+    arguments.mode = SERVER_MODE_THREAD;
+    arguments.workers = 0;
+    arguments.queue_depth = CONFIG_POOL_QUEUE_DEPTH;
+    arguments.pin = false;
+    arguments.keepalive = CONFIG_KEEPALIVE_TIMEOUT_SEC;
+    arguments.header_timeout = CONFIG_HEADER_TIMEOUT_SEC;
+    arguments.write_timeout = CONFIG_WRITE_TIMEOUT_SEC;
+    arguments.certs = 0;
+    arguments.keys = 0;
+    arguments.stats = 0;
 
     /* Parse our arguments; every option seen by parse_opt will
         be reflected in arguments. */
@@ -127,6 +392,18 @@ int main(int argc, char **argv)
     LOGINF("Address: %s", arguments.addr);
     LOGINF("Port: %d", arguments.port);
     LOGINF("Secure: %s", arguments.secure ? "yes": "no");
+    if(arguments.secure_port > 0)
+    {
+        LOGINF("Secure port: %d", arguments.secure_port);
+    }
+    for(size_t i = 0; i < arguments.certs; i++)
+    {
+        LOGINF("Certificate: %s, key: %s", arguments.cert[i], arguments.key[i]);
+    }
+    LOGINF("io_uring: %s", arguments.uring ? "yes": "no");
+    LOGINF("Mode: %s", mode_names[arguments.mode]);
+    LOGINF("Keep-alive: %u sec", arguments.keepalive);
+    LOGINF("Request scanning: %s", scan_impl_name());
 
     /* Change directory to specefied */
     if(chdir(arguments.root) < 0)
@@ -136,8 +413,22 @@ int main(int argc, char **argv)
         return -errno;
     }
 
+    /* Start periodic statistic reports */
+    if(stats_start(arguments.stats) < 0)
+    {
+        LOGERR("Fail to start statistic reports");
+
+        return -1;
+    }
+
+    /* Drop cached files as soon as they are changed */
+    if(watch_start(".") < 0)
+    {
+        LOGERR("Fail to watch root directory, cached files are checked periodically");
+    }
+
     /* Start server */
-    if(start_server(arguments.addr, arguments.port, arguments.secure, http_handler) < 0)
+    if(start_server(&arguments, http_handler) < 0)
     {
         LOGERR("Fail to start server");
 
@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ncache.h"
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "ncache"
+
+#define NCACHE_BLOOM_WORDS (CONFIG_NCACHE_BLOOM_BITS / 64)
+#define NCACHE_BLOOM_HASHES 4
+
+/* Number of recent misses kept by one shard */
+#define NCACHE_SHARD_SLOTS ((CONFIG_NCACHE_SIZE + CONFIG_NCACHE_SHARDS - 1) / CONFIG_NCACHE_SHARDS)
+
+_Static_assert((CONFIG_NCACHE_BLOOM_BITS & (CONFIG_NCACHE_BLOOM_BITS - 1)) == 0 &&
+               CONFIG_NCACHE_BLOOM_BITS >= 64,
+               "Size of filter of existing files shall be power of two");
+
+struct ncache_bloom_s
+{
+    atomic_uint readers; /// threads that check the filter, it is freed once they are done
+    size_t files;
+    atomic_uint_fast64_t words[NCACHE_BLOOM_WORDS];
+};
+
+/* Miss is forgotten once slot is taken by another one */
+struct ncache_slot_s
+{
+    atomic_uint_fast64_t generation; /// changed by every added file of the slot
+    uint64_t hash;
+    uint64_t expires; /// time in milliseconds miss is forgotten, 0 if slot is empty
+    char path[CONFIG_MAX_PATH_SIZE];
+};
+
+struct ncache_shard_s
+{
+    pthread_mutex_t lock;
+    struct ncache_slot_s slots[NCACHE_SHARD_SLOTS];
+};
+
+struct ncache_s
+{
+    struct ncache_bloom_s *_Atomic bloom; /// NULL if filter is not trusted
+    struct ncache_shard_s shards[CONFIG_NCACHE_SHARDS];
+    atomic_uint ttl;                      /// time to live of recent misses in milliseconds
+    atomic_uint_fast64_t generation;      /// changed once all misses are forgotten
+    atomic_size_t removed;                /// files removed since filter was built
+
+    /* Statistic */
+    atomic_uint_fast64_t filtered;        /// misses answered by filter
+    atomic_uint_fast64_t hits;            /// misses answered by recent misses
+    atomic_uint_fast64_t remembered;
+    atomic_uint_fast64_t builds;
+    atomic_size_t files;
+};
+
+static struct ncache_s cache = { .ttl = CONFIG_NCACHE_TTL_MS };
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static uint64_t ncache_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a, paths are short and differ mostly at the end */
+static uint64_t ncache_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static size_t ncache_bloom_bit(uint64_t hash, int i)
+{
+    /* Bits are chosen by double hashing of both halves of the hash */
+    return ((uint32_t)hash + i * ((uint32_t)(hash >> 32) | 1)) & (CONFIG_NCACHE_BLOOM_BITS - 1);
+}
+
+static void ncache_bloom_add(struct ncache_bloom_s *bloom, uint64_t hash)
+{
+    size_t bit = 0;
+
+    for (int i = 0; i < NCACHE_BLOOM_HASHES; i++)
+    {
+        bit = ncache_bloom_bit(hash, i);
+
+        atomic_fetch_or_explicit(&bloom->words[bit / 64], 1ULL << (bit % 64), memory_order_relaxed);
+    }
+
+    bloom->files++;
+}
+
+static bool ncache_bloom_test(struct ncache_bloom_s *bloom, uint64_t hash)
+{
+    size_t bit = 0;
+
+    for (int i = 0; i < NCACHE_BLOOM_HASHES; i++)
+    {
+        bit = ncache_bloom_bit(hash, i);
+
+        if ((atomic_load_explicit(&bloom->words[bit / 64], memory_order_relaxed) & (1ULL << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static struct ncache_bloom_s *ncache_bloom_acquire(void)
+{
+    struct ncache_bloom_s *bloom = NULL;
+
+    /* Filter is counted as used before it is checked that it is still current,
+        so the thread that replaces it sees the reader */
+    while (1)
+    {
+        bloom = atomic_load(&cache.bloom);
+        if (bloom == NULL)
+        {
+            return NULL;
+        }
+
+        atomic_fetch_add(&bloom->readers, 1);
+
+        if (atomic_load(&cache.bloom) == bloom)
+        {
+            return bloom;
+        }
+
+        atomic_fetch_sub(&bloom->readers, 1);
+    }
+}
+
+static void ncache_bloom_release(struct ncache_bloom_s *bloom)
+{
+    atomic_fetch_sub(&bloom->readers, 1);
+}
+
+static void ncache_bloom_replace(struct ncache_bloom_s *bloom)
+{
+    struct ncache_bloom_s *old = atomic_exchange(&cache.bloom, bloom);
+
+    atomic_store_explicit(&cache.files, bloom != NULL ? bloom->files : 0, memory_order_relaxed);
+
+    if (old == NULL)
+    {
+        return;
+    }
+
+    /* Check of filter takes a few nanoseconds */
+    while (atomic_load(&old->readers) > 0)
+    {
+        sched_yield();
+    }
+
+    free(old);
+}
+
+static struct ncache_shard_s *ncache_shard_get(uint64_t hash)
+{
+    return &cache.shards[hash % CONFIG_NCACHE_SHARDS];
+}
+
+static struct ncache_slot_s *ncache_shard_slot(struct ncache_shard_s *shard, uint64_t hash)
+{
+    return &shard->slots[(hash / CONFIG_NCACHE_SHARDS) % NCACHE_SHARD_SLOTS];
+}
+
+/* Both counters only grow, so added file prevents only misses of its own slot */
+static uint64_t ncache_slot_generation(struct ncache_slot_s *slot)
+{
+    return atomic_load(&cache.generation) + atomic_load(&slot->generation);
+}
+
+static void ncache_misses_forget(void)
+{
+    struct ncache_shard_s *shard = NULL;
+
+    for (size_t i = 0; i < CONFIG_NCACHE_SHARDS; i++)
+    {
+        shard = &cache.shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        atomic_fetch_add(&cache.generation, 1);
+
+        for (size_t j = 0; j < NCACHE_SHARD_SLOTS; j++)
+        {
+            shard->slots[j].expires = 0;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Filter is updated before miss is forgotten, so the file is never reported missing */
+static void ncache_file_add(struct ncache_bloom_s *bloom, const char *path)
+{
+    uint64_t hash = ncache_hash(path);
+    struct ncache_shard_s *shard = ncache_shard_get(hash);
+    struct ncache_slot_s *slot = ncache_shard_slot(shard, hash);
+
+    if (bloom != NULL)
+    {
+        ncache_bloom_add(bloom, hash);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    atomic_fetch_add(&slot->generation, 1);
+
+    if (slot->hash == hash && strcmp(slot->path, path) == 0)
+    {
+        slot->expires = 0;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static int ncache_walk(struct ncache_bloom_s *bloom, const char *path)
+{
+    char sub[CONFIG_MAX_PATH_SIZE];
+    struct dirent *ent = NULL;
+    struct stat st = {0};
+    DIR *dir = NULL;
+    bool isdir = false;
+    int result = 0;
+
+    /* Directory may be removed already. Any other failure leaves its files
+        out of filter, so filter can not be trusted */
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+
+        result = -errno;
+
+        LOGERR("Fail to open %s. Result: %s", path, strerror(-result));
+
+        return result;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        /* Files with longer paths are never requested */
+        if (snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name) >= (int)sizeof(sub))
+        {
+            continue;
+        }
+
+        isdir = ent->d_type == DT_DIR;
+
+        if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK)
+        {
+            if (stat(sub, &st) < 0)
+            {
+                if (errno == ENOENT)
+                {
+                    continue;
+                }
+
+                result = -errno;
+
+                LOGERR("Fail to stat %s. Result: %s", sub, strerror(-result));
+
+                break;
+            }
+
+            isdir = S_ISDIR(st.st_mode);
+        }
+
+        /* Tree behind the link is not watched, so its new files would be missed */
+        if (isdir == true && ent->d_type == DT_LNK)
+        {
+            LOGERR("%s links to directory, missing files are looked up on disk", sub);
+
+            result = -ELOOP;
+
+            break;
+        }
+
+        if (isdir == true)
+        {
+            result = ncache_walk(bloom, sub);
+            if (result < 0)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        ncache_file_add(bloom, sub);
+    }
+
+    closedir(dir);
+
+    return result;
+}
+
+static void ncache_stats_report(void *arg)
+{
+    LOGINF("filter %zu files (%s), misses %lu/%lu (filtered/remembered), remembered %lu, builds %lu",
+           atomic_load(&cache.files), atomic_load(&cache.bloom) != NULL ? "used" : "not used",
+           atomic_load(&cache.filtered), atomic_load(&cache.hits), atomic_load(&cache.remembered),
+           atomic_load(&cache.builds));
+}
+
+static void ncache_init(void)
+{
+    for (size_t i = 0; i < CONFIG_NCACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache.shards[i].lock, NULL);
+    }
+
+    stats_register(ncache_stats_report, NULL);
+}
+
+bool ncache_missing(const char *path)
+{
+    uint64_t hash = ncache_hash(path);
+    struct ncache_shard_s *shard = ncache_shard_get(hash);
+    struct ncache_slot_s *slot = ncache_shard_slot(shard, hash);
+    struct ncache_bloom_s *bloom = NULL;
+    bool missing = false;
+
+    pthread_once(&cache_once, ncache_init);
+
+    bloom = ncache_bloom_acquire();
+    if (bloom != NULL)
+    {
+        missing = ncache_bloom_test(bloom, hash) == false;
+
+        ncache_bloom_release(bloom);
+
+        if (missing == true)
+        {
+            atomic_fetch_add_explicit(&cache.filtered, 1, memory_order_relaxed);
+
+            return true;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+
+    missing = slot->expires > ncache_now() && slot->hash == hash && strcmp(slot->path, path) == 0;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (missing == true)
+    {
+        atomic_fetch_add_explicit(&cache.hits, 1, memory_order_relaxed);
+    }
+
+    return missing;
+}
+
+uint64_t ncache_generation(const char *path)
+{
+    uint64_t hash = ncache_hash(path);
+
+    return ncache_slot_generation(ncache_shard_slot(ncache_shard_get(hash), hash));
+}
+
+void ncache_miss(const char *path, uint64_t generation)
+{
+    uint64_t hash = ncache_hash(path);
+    struct ncache_shard_s *shard = ncache_shard_get(hash);
+    struct ncache_slot_s *slot = ncache_shard_slot(shard, hash);
+
+    if (strlen(path) >= sizeof(slot->path))
+    {
+        return;
+    }
+
+    pthread_once(&cache_once, ncache_init);
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* File may be added after it was looked up */
+    if (ncache_slot_generation(slot) == generation)
+    {
+        slot->hash = hash;
+        slot->expires = ncache_now() + atomic_load_explicit(&cache.ttl, memory_order_relaxed);
+        strcpy(slot->path, path);
+
+        atomic_fetch_add_explicit(&cache.remembered, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void ncache_add(const char *path)
+{
+    struct ncache_bloom_s *bloom = NULL;
+    struct stat st = {0};
+
+    pthread_once(&cache_once, ncache_init);
+
+    /* Link to directory is added as a file, but the tree behind it is not watched */
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode) != 0)
+    {
+        LOGERR("%s links to directory, missing files are looked up on disk", path);
+
+        ncache_disable();
+
+        return;
+    }
+
+    /* Filter is replaced by the same thread, so it is not freed meanwhile */
+    bloom = atomic_load(&cache.bloom);
+
+    ncache_file_add(bloom, path);
+
+    if (bloom != NULL)
+    {
+        atomic_store_explicit(&cache.files, bloom->files, memory_order_relaxed);
+    }
+}
+
+int ncache_add_tree(const char *path)
+{
+    struct ncache_bloom_s *bloom = NULL;
+    int result = 0;
+
+    pthread_once(&cache_once, ncache_init);
+
+    bloom = atomic_load(&cache.bloom);
+
+    result = ncache_walk(bloom, path);
+    if (result < 0)
+    {
+        ncache_disable();
+
+        return result;
+    }
+
+    if (bloom != NULL)
+    {
+        atomic_store_explicit(&cache.files, bloom->files, memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+void ncache_remove(void)
+{
+    /* Filter can not forget files, so it is rebuilt once false positives become many */
+    atomic_fetch_add_explicit(&cache.removed, 1, memory_order_relaxed);
+}
+
+void ncache_remove_tree(void)
+{
+    /* Number of files that went away with directory is not known */
+    atomic_store(&cache.removed, CONFIG_NCACHE_REBUILD_REMOVED);
+}
+
+int ncache_build(const char *root)
+{
+    struct ncache_bloom_s *bloom = NULL;
+    int result = 0;
+
+    pthread_once(&cache_once, ncache_init);
+
+    bloom = calloc(1, sizeof(*bloom));
+    if (bloom == NULL)
+    {
+        LOGERR("Fail to allocate filter of existing files");
+
+        ncache_disable();
+
+        return -ENOMEM;
+    }
+
+    atomic_store(&cache.removed, 0);
+
+    /* Filter in use answers requests until the new one is complete */
+    result = ncache_walk(bloom, root);
+    if (result < 0)
+    {
+        free(bloom);
+
+        ncache_disable();
+
+        return result;
+    }
+
+    if (bloom->files > CONFIG_NCACHE_BLOOM_BITS / 16)
+    {
+        LOGERR("%zu files make filter of existing files imprecise, increase CONFIG_NCACHE_BLOOM_BITS",
+               bloom->files);
+    }
+
+    ncache_bloom_replace(bloom);
+    ncache_misses_forget();
+
+    atomic_fetch_add_explicit(&cache.builds, 1, memory_order_relaxed);
+
+    return 0;
+}
+
+bool ncache_dirty(void)
+{
+    return atomic_load(&cache.bloom) != NULL &&
+           atomic_load(&cache.removed) >= CONFIG_NCACHE_REBUILD_REMOVED;
+}
+
+void ncache_disable(void)
+{
+    pthread_once(&cache_once, ncache_init);
+
+    ncache_bloom_replace(NULL);
+    ncache_misses_forget();
+}
+
+void ncache_ttl_set(unsigned int ttl)
+{
+    atomic_store(&cache.ttl, ttl);
+}
@@ -0,0 +1,110 @@
+/**
+ * @file ncache.h
+ * @brief This module answers requests of missing files without file system lookup
+ *
+ * The module do following:
+ *  - keep Bloom filter of paths of existing files built from root directory tree,
+ *    path that is not in the filter is certainly missing
+ *  - remember recent misses of paths that passed the filter
+ *  - update both as files are added and rebuild the filter once many files are removed
+ *
+ * Filter is trusted only while the whole tree is watched for changes, since
+ * added files shall get to it before they are requested.
+ * Filter is updated and rebuilt by one thread, it is checked by any.
+ **/
+
+#ifndef NCACHE_H_
+#define NCACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Check if file is certainly missing
+ *
+ * @param path[in] - normalized path of file
+ *
+ * @retval true if file is missing, false if it may exist
+ **/
+bool ncache_missing(const char *path);
+
+/**
+ * @brief Get generation of file, it is changed once file is added
+ *
+ * Files that share slot of recent misses share generation too
+ *
+ * @param path[in] - normalized path of file
+ *
+ * @retval generation
+ **/
+uint64_t ncache_generation(const char *path);
+
+/**
+ * @brief Remember that file is missing
+ *
+ * The miss is not remembered if the file was added since generation was taken.
+ *
+ * @param path[in] - normalized path of file
+ * @param generation[in] - value of ncache_generation taken before file was looked up
+ **/
+void ncache_miss(const char *path, uint64_t generation);
+
+/**
+ * @brief Let cache know that file was added
+ *
+ * @param path[in] - normalized path of file
+ **/
+void ncache_add(const char *path);
+
+/**
+ * @brief Let cache know that all files of directory tree were added
+ *
+ * @param path[in] - normalized path of directory
+ *
+ * @retval 0 in case of success, negative errno value if filter shall not be trusted anymore
+ **/
+int ncache_add_tree(const char *path);
+
+/**
+ * @brief Let cache know that file was removed
+ **/
+void ncache_remove(void);
+
+/**
+ * @brief Let cache know that directory was moved away together with its files
+ *
+ * Files are not counted, so filter is rebuilt on the next check
+ **/
+void ncache_remove_tree(void);
+
+/**
+ * @brief Build filter of files of directory tree and forget recent misses
+ *
+ * Filter in use is replaced once new one is complete.
+ *
+ * @param root[in] - root directory, it shall be the prefix of paths of files
+ *
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int ncache_build(const char *root);
+
+/**
+ * @brief Check if so many files were removed since filter was built, that it shall be rebuilt
+ *
+ * @retval true if filter shall be rebuilt
+ **/
+bool ncache_dirty(void);
+
+/**
+ * @brief Stop using filter and forget recent misses, since changes of files may be not noticed
+ **/
+void ncache_disable(void);
+
+/**
+ * @brief Set time recent miss is remembered
+ *
+ * @param ttl[in] - time to live in milliseconds
+ **/
+void ncache_ttl_set(unsigned int ttl);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "pool.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "pool"
+
+/**
+ * Bounded MPMC queue is based on per cell sequence numbers (D. Vyukov).
+ * Producers and consumers claim cells with CAS on positions, so no lock
+ * is taken on hand off. Semaphores are used only to park idle threads.
+ **/
+struct pool_cell_s
+{
+    atomic_size_t seq;
+    void *item;
+    struct timespec ts;
+};
+
+struct pool_s
+{
+    pool_work_f work;
+    size_t workers;
+    size_t depth;
+    size_t mask;
+    struct pool_cell_s *cells;
+    atomic_size_t enqpos;
+    atomic_size_t deqpos;
+    sem_t used;
+    sem_t free;
+
+    /* Statistic */
+    atomic_uint_fast64_t handled;
+    atomic_uint_fast64_t waitsum;
+    atomic_uint_fast64_t waitmax;
+    atomic_size_t len;
+    atomic_size_t lenmax;
+};
+
+static uint64_t pool_elapsed_us(const struct timespec *from)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - from->tv_sec) * 1000000ULL + (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void pool_enqueue(struct pool_s *pool, void *item)
+{
+    struct pool_cell_s *cell = NULL;
+    size_t pos = atomic_load_explicit(&pool->enqpos, memory_order_relaxed);
+    intptr_t dif = 0;
+
+    /* Free slot is guaranteed by the semaphore, so only race with
+        other producers for the position is possible here */
+    while (1)
+    {
+        cell = &pool->cells[pos & pool->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)pos;
+
+        if (dif == 0 && atomic_compare_exchange_weak_explicit(&pool->enqpos, &pos, pos + 1,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        {
+            break;
+        }
+
+        if (dif != 0)
+        {
+            pos = atomic_load_explicit(&pool->enqpos, memory_order_relaxed);
+        }
+    }
+
+    cell->item = item;
+    clock_gettime(CLOCK_MONOTONIC, &cell->ts);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+static void *pool_dequeue(struct pool_s *pool, struct timespec *ts)
+{
+    struct pool_cell_s *cell = NULL;
+    size_t pos = atomic_load_explicit(&pool->deqpos, memory_order_relaxed);
+    intptr_t dif = 0;
+    void *item = NULL;
+
+    while (1)
+    {
+        cell = &pool->cells[pos & pool->mask];
+        dif = (intptr_t)atomic_load_explicit(&cell->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+
+        if (dif == 0 && atomic_compare_exchange_weak_explicit(&pool->deqpos, &pos, pos + 1,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        {
+            break;
+        }
+
+        if (dif != 0)
+        {
+            pos = atomic_load_explicit(&pool->deqpos, memory_order_relaxed);
+        }
+    }
+
+    item = cell->item;
+    *ts = cell->ts;
+    atomic_store_explicit(&cell->seq, pos + pool->mask + 1, memory_order_release);
+
+    return item;
+}
+
+static void *pool_worker(void *data)
+{
+    struct pool_s *pool = (struct pool_s *)data;
+    struct timespec ts = {0};
+    uint64_t wait = 0;
+    uint64_t max = 0;
+    void *item = NULL;
+
+    while (1)
+    {
+        /* Wait until something is queued */
+        if (sem_wait(&pool->used) < 0)
+        {
+            continue;
+        }
+
+        item = pool_dequeue(pool, &ts);
+        atomic_fetch_sub(&pool->len, 1);
+        sem_post(&pool->free);
+
+        /* Account time the item spent in the queue */
+        wait = pool_elapsed_us(&ts);
+        atomic_fetch_add_explicit(&pool->waitsum, wait, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->handled, 1, memory_order_relaxed);
+
+        max = atomic_load_explicit(&pool->waitmax, memory_order_relaxed);
+        while (wait > max && !atomic_compare_exchange_weak(&pool->waitmax, &max, wait));
+
+        pool->work(item);
+    }
+
+    return NULL;
+}
+
+struct pool_s *pool_create(size_t workers, size_t depth, pool_work_f work)
+{
+    struct pool_s *pool = NULL;
+    pthread_attr_t attr;
+    pthread_t thread = 0;
+    size_t size = 1;
+    int result = 0;
+
+    if (work == NULL || depth == 0)
+    {
+        LOGERR("Invalid argument");
+
+        return NULL;
+    }
+
+    if (workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+
+    /* Queue size shall be power of two, depth limit is kept by semaphore */
+    while (size < depth)
+    {
+        size <<= 1;
+    }
+
+    pool = calloc(1, sizeof(struct pool_s));
+    if (pool == NULL)
+    {
+        LOGERR("Fail to allocate memory for pool");
+
+        return NULL;
+    }
+
+    pool->cells = calloc(size, sizeof(struct pool_cell_s));
+    if (pool->cells == NULL)
+    {
+        LOGERR("Fail to allocate memory for pool queue");
+
+        free(pool);
+
+        return NULL;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        atomic_init(&pool->cells[i].seq, i);
+    }
+
+    pool->work = work;
+    pool->workers = workers;
+    pool->depth = depth;
+    pool->mask = size - 1;
+
+    sem_init(&pool->used, 0, 0);
+    sem_init(&pool->free, 0, depth);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, CONFIG_POOL_STACK_SIZE);
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        result = pthread_create(&thread, &attr, pool_worker, pool);
+        if (result != 0)
+        {
+            LOGERR("Fail to create worker thread. Result %d", result);
+
+            /* Already started workers keep running, so the pool can not be freed */
+            pthread_attr_destroy(&attr);
+
+            return i > 0 ? pool : NULL;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    LOGINF("Started %lu workers, queue depth %lu", workers, depth);
+
+    return pool;
+}
+
+static void pool_queued(struct pool_s *pool, void *item)
+{
+    size_t len = 0;
+    size_t max = 0;
+
+    pool_enqueue(pool, item);
+
+    len = atomic_fetch_add(&pool->len, 1) + 1;
+    max = atomic_load_explicit(&pool->lenmax, memory_order_relaxed);
+    while (len > max && !atomic_compare_exchange_weak(&pool->lenmax, &max, len));
+
+    sem_post(&pool->used);
+}
+
+int pool_push(struct pool_s *pool, void *item)
+{
+    if (pool == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* Wait for free slot. Meanwhile new connections wait in kernel backlog */
+    while (sem_wait(&pool->free) < 0)
+    {
+        if (errno != EINTR)
+        {
+            LOGERR("Fail to wait for free slot. Result: %s", strerror(errno));
+
+            return -errno;
+        }
+    }
+
+    pool_queued(pool, item);
+
+    return 0;
+}
+
+int pool_trypush(struct pool_s *pool, void *item)
+{
+    if (pool == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* Caller has something better to do than wait, e.g. handle it by itself */
+    if (sem_trywait(&pool->free) < 0)
+    {
+        return -errno;
+    }
+
+    pool_queued(pool, item);
+
+    return 0;
+}
+
+void pool_stats_report(void *arg)
+{
+    struct pool_s *pool = (struct pool_s *)arg;
+    uint64_t handled = atomic_load(&pool->handled);
+    uint64_t waitsum = atomic_load(&pool->waitsum);
+
+    LOGINF("workers %lu, queued %lu/%lu (max %lu), handled %lu, wait avg %lu us, max %lu us",
+           pool->workers, atomic_load(&pool->len), pool->depth, atomic_load(&pool->lenmax),
+           handled, handled > 0 ? waitsum / handled : 0, atomic_load(&pool->waitmax));
+}
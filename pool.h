@@ -0,0 +1,69 @@
+/**
+ * @file pool.h
+ * @brief This module implements fixed-size pool of worker threads
+ * 
+ * The module do following:
+ *  - start fixed number of worker threads
+ *  - hand off work items to the workers via bounded lock-free MPMC queue
+ *  - block producer when queue depth limit is reached, or let it know the queue is full
+ *  - collect statistic how long items wait in the queue
+ **/
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdlib.h>
+
+/**
+ * @brief Function type that handles single work item in a worker thread
+ * 
+ * @param item[in] - work item
+ **/
+typedef void (*pool_work_f)(void *item);
+
+struct pool_s;
+
+/**
+ * @brief Create pool and start worker threads
+ * 
+ * @param workers[in] - number of worker threads, 0 means number of online CPUs
+ * @param depth[in]   - maximum number of items waiting in the queue
+ * @param work[in]    - function that handles work items
+ * 
+ * @retval pointer to pool object or NULL in case of error
+ **/
+struct pool_s *pool_create(size_t workers, size_t depth, pool_work_f work);
+
+/**
+ * @brief Pass work item to the pool
+ * 
+ * Blocks if queue depth limit is reached until some worker takes an item
+ * 
+ * @param pool[in] - pool object
+ * @param item[in] - work item
+ * 
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int pool_push(struct pool_s *pool, void *item);
+
+/**
+ * @brief Pass work item to the pool if there is room for it in the queue
+ * 
+ * @param pool[in] - pool object
+ * @param item[in] - work item
+ * 
+ * @retval 0 in case of success, -EAGAIN if queue depth limit is reached,
+ * negative errno value otherwise
+ **/
+int pool_trypush(struct pool_s *pool, void *item);
+
+/**
+ * @brief Log pool statistic
+ * 
+ * The function matches stats_report_f type
+ * 
+ * @param arg[in] - pool object
+ **/
+void pool_stats_report(void *arg);
+
+#endif
@@ -0,0 +1,742 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <time.h>
+#include <pthread.h>
+
+#include "rcache.h"
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "rcache"
+
+/* Memory in bytes responses of one shard may take */
+#define RCACHE_SHARD_BYTES (CONFIG_RCACHE_SIZE / CONFIG_RCACHE_SHARDS)
+
+#define RCACHE_BUCKETS 1024
+
+/**
+ * Frequency of requests is estimated by count-min sketch of 4-bit
+ * counters. Counters are halved every sample of requests, so the sketch
+ * follows what is popular now rather than what used to be.
+ **/
+#define RCACHE_SKETCH_DEPTH 4
+#define RCACHE_SKETCH_WIDTH 4096
+#define RCACHE_SKETCH_MAX 15
+#define RCACHE_SKETCH_SAMPLE (RCACHE_SKETCH_WIDTH * 8)
+
+_Static_assert((RCACHE_SKETCH_WIDTH & (RCACHE_SKETCH_WIDTH - 1)) == 0,
+               "Width of frequency sketch shall be power of two");
+
+struct rcache_entry_s
+{
+    struct rcache_resp_s resp;    /// shall be the first, user gets pointer to it
+    atomic_uint refs;             /// one reference is held by the table while response is cached
+    int variant;
+    uint64_t hash;
+    uint64_t expires;             /// time in milliseconds the response is rendered again
+    size_t cost;                  /// memory taken by the entry in bytes
+    struct rcache_entry_s *chain; /// next entry in hash bucket, or in list of evicted entries
+    struct rcache_entry_s *next;  /// less recently used entry
+    struct rcache_entry_s *prev;  /// more recently used entry
+    char path[CONFIG_MAX_PATH_SIZE];
+    char data[];
+};
+
+#if CONFIG_RCACHE_SIZE > 0
+struct rcache_sketch_s
+{
+    uint8_t rows[RCACHE_SKETCH_DEPTH][RCACHE_SKETCH_WIDTH];
+    size_t additions;
+};
+
+struct rcache_shard_s
+{
+    pthread_mutex_t lock;
+    pthread_cond_t landed;     /// signaled once any rendering of the shard is finished
+    struct rcache_entry_s lru; /// head of LRU list, lru.next is the most recently used entry
+    struct rcache_entry_s *buckets[RCACHE_BUCKETS];
+    atomic_uint_fast64_t generations[RCACHE_BUCKETS]; /// changed by invalidation of bucket
+    struct rcache_sketch_s sketch;
+    struct rcache_flight_s *flights;
+    size_t bytes;
+};
+
+/* Response rendered by one request, while other requests of it wait */
+struct rcache_flight_s
+{
+    struct rcache_shard_s *shard;
+    unsigned int refs;            /// renderer and waiting requests, guarded by shard lock
+    bool landed;                  /// response is offered or rendering is given up
+    struct rcache_entry_s *entry; /// rendered response, waiting requests hold a reference each
+    struct rcache_flight_s *next;
+    int variant;
+    uint64_t hash;
+    char path[CONFIG_MAX_PATH_SIZE];
+};
+#endif
+
+struct rcache_s
+{
+#if CONFIG_RCACHE_SIZE > 0
+    struct rcache_shard_s shards[CONFIG_RCACHE_SHARDS];
+#endif
+
+    /* Statistic */
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t coalesced;
+    atomic_uint_fast64_t admitted;
+    atomic_uint_fast64_t rejected;
+    atomic_uint_fast64_t evicts;
+    atomic_uint_fast64_t expired;
+    atomic_size_t bytes;
+    atomic_uint_fast64_t invalidated;
+
+    atomic_uint ttl;                 /// time to live of responses in milliseconds
+    atomic_uint_fast64_t generation; /// changed by invalidation of all responses
+};
+
+static struct rcache_s cache = { .ttl = CONFIG_RCACHE_TTL_MS };
+
+#if CONFIG_RCACHE_SIZE > 0
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void rcache_entry_put(struct rcache_entry_s *entry)
+{
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&cache.bytes, entry->cost, memory_order_relaxed);
+
+    free(entry);
+}
+
+#if CONFIG_RCACHE_SIZE > 0
+static uint64_t rcache_now(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a of path. Variants of response share it, so they are kept in one
+    bucket and are dropped together */
+static uint64_t rcache_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static size_t rcache_sketch_index(uint64_t hash, int row)
+{
+    /* Rows are indexed by double hashing of both halves of the hash */
+    return ((uint32_t)hash + row * ((uint32_t)(hash >> 32) | 1)) & (RCACHE_SKETCH_WIDTH - 1);
+}
+
+static void rcache_sketch_add(struct rcache_sketch_s *sketch, uint64_t hash)
+{
+    uint8_t *counter = NULL;
+
+    for (int row = 0; row < RCACHE_SKETCH_DEPTH; row++)
+    {
+        counter = &sketch->rows[row][rcache_sketch_index(hash, row)];
+        if (*counter < RCACHE_SKETCH_MAX)
+        {
+            (*counter)++;
+        }
+    }
+
+    if (++sketch->additions < RCACHE_SKETCH_SAMPLE)
+    {
+        return;
+    }
+
+    for (int row = 0; row < RCACHE_SKETCH_DEPTH; row++)
+    {
+        for (size_t i = 0; i < RCACHE_SKETCH_WIDTH; i++)
+        {
+            sketch->rows[row][i] >>= 1;
+        }
+    }
+
+    sketch->additions /= 2;
+}
+
+static unsigned int rcache_sketch_estimate(const struct rcache_sketch_s *sketch, uint64_t hash)
+{
+    unsigned int estimate = RCACHE_SKETCH_MAX;
+    unsigned int counter = 0;
+
+    for (int row = 0; row < RCACHE_SKETCH_DEPTH; row++)
+    {
+        counter = sketch->rows[row][rcache_sketch_index(hash, row)];
+        if (counter < estimate)
+        {
+            estimate = counter;
+        }
+    }
+
+    return estimate;
+}
+
+static struct rcache_shard_s *rcache_shard_get(uint64_t hash)
+{
+    return &cache.shards[hash % CONFIG_RCACHE_SHARDS];
+}
+
+static struct rcache_entry_s **rcache_shard_bucket(struct rcache_shard_s *shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / CONFIG_RCACHE_SHARDS) % RCACHE_BUCKETS];
+}
+
+/* Both counters only grow, so their sum is changed once any of them is.
+    Invalidation of other buckets does not make rendering stale */
+static uint64_t rcache_shard_generation(struct rcache_shard_s *shard, uint64_t hash)
+{
+    return atomic_load(&cache.generation) +
+           atomic_load(&shard->generations[(hash / CONFIG_RCACHE_SHARDS) % RCACHE_BUCKETS]);
+}
+
+static struct rcache_entry_s *rcache_shard_find(struct rcache_shard_s *shard, uint64_t hash,
+                                                const char *path, int variant)
+{
+    struct rcache_entry_s *entry = *rcache_shard_bucket(shard, hash);
+
+    while (entry != NULL &&
+           (entry->hash != hash || entry->variant != variant || strcmp(entry->path, path) != 0))
+    {
+        entry = entry->chain;
+    }
+
+    return entry;
+}
+
+static void rcache_lru_del(struct rcache_entry_s *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void rcache_lru_add(struct rcache_shard_s *shard, struct rcache_entry_s *entry)
+{
+    entry->next = shard->lru.next;
+    entry->prev = &shard->lru;
+    shard->lru.next->prev = entry;
+    shard->lru.next = entry;
+}
+
+/* Table reference is passed to caller, who drops it outside of shard lock */
+static void rcache_shard_unlink(struct rcache_shard_s *shard, struct rcache_entry_s *entry)
+{
+    struct rcache_entry_s **link = rcache_shard_bucket(shard, entry->hash);
+
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+
+    *link = entry->chain;
+    entry->chain = NULL;
+    rcache_lru_del(entry);
+    shard->bytes -= entry->cost;
+}
+
+static void rcache_shard_link(struct rcache_shard_s *shard, struct rcache_entry_s *entry)
+{
+    struct rcache_entry_s **bucket = rcache_shard_bucket(shard, entry->hash);
+
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+
+    entry->chain = *bucket;
+    *bucket = entry;
+    rcache_lru_add(shard, entry);
+    shard->bytes += entry->cost;
+}
+
+/* Check that the least recently used responses, which have to go for the new one,
+    are requested less often than the new one */
+static bool rcache_shard_admit(struct rcache_shard_s *shard, const struct rcache_entry_s *entry)
+{
+    const struct rcache_entry_s *victim = shard->lru.prev;
+    unsigned int frequency = rcache_sketch_estimate(&shard->sketch, entry->hash);
+    size_t freed = 0;
+
+    while (shard->bytes - freed + entry->cost > RCACHE_SHARD_BYTES)
+    {
+        if (rcache_sketch_estimate(&shard->sketch, victim->hash) >= frequency)
+        {
+            return false;
+        }
+
+        freed += victim->cost;
+        victim = victim->prev;
+    }
+
+    return true;
+}
+
+static struct rcache_flight_s *rcache_flight_find(struct rcache_shard_s *shard, uint64_t hash,
+                                                  const char *path, int variant)
+{
+    struct rcache_flight_s *flight = shard->flights;
+
+    while (flight != NULL &&
+           (flight->hash != hash || flight->variant != variant || strcmp(flight->path, path) != 0))
+    {
+        flight = flight->next;
+    }
+
+    return flight;
+}
+
+/* Let waiting requests go with rendered response, or render it on their own if it is NULL.
+    Called with shard lock held, returns true if waiting requests took the response */
+static bool rcache_flight_land(struct rcache_flight_s *flight, struct rcache_entry_s *entry)
+{
+    struct rcache_flight_s **link = &flight->shard->flights;
+    unsigned int waiting = flight->refs - 1;
+
+    while (*link != flight)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = flight->next;
+
+    if (entry != NULL && waiting > 0)
+    {
+        atomic_fetch_add_explicit(&entry->refs, waiting, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cache.coalesced, waiting, memory_order_relaxed);
+
+        flight->entry = entry;
+    }
+
+    flight->landed = true;
+    pthread_cond_broadcast(&flight->shard->landed);
+
+    if (--flight->refs == 0)
+    {
+        free(flight);
+    }
+
+    return entry != NULL && waiting > 0;
+}
+
+static void rcache_stats_report(void *arg)
+{
+    uint64_t hits = atomic_load(&cache.hits);
+    uint64_t misses = atomic_load(&cache.misses);
+
+    LOGINF("responses %zu KB, hits %lu, misses %lu (%lu%% hit), coalesced %lu, admitted %lu, "
+           "rejected %lu, evictions %lu, expired %lu, invalidated %lu",
+           atomic_load(&cache.bytes) / 1024, hits, misses,
+           hits + misses > 0 ? hits * 100 / (hits + misses) : 0,
+           atomic_load(&cache.coalesced), atomic_load(&cache.admitted), atomic_load(&cache.rejected),
+           atomic_load(&cache.evicts), atomic_load(&cache.expired), atomic_load(&cache.invalidated));
+}
+
+static void rcache_init(void)
+{
+    for (size_t i = 0; i < CONFIG_RCACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache.shards[i].lock, NULL);
+        pthread_cond_init(&cache.shards[i].landed, NULL);
+        cache.shards[i].lru.next = &cache.shards[i].lru;
+        cache.shards[i].lru.prev = &cache.shards[i].lru;
+    }
+
+    stats_register(rcache_stats_report, NULL);
+}
+#endif
+
+int rcache_get(const char *path, int variant, const struct rcache_resp_s **resp,
+               struct rcache_flight_s **flight)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    struct rcache_shard_s *shard = NULL;
+    struct rcache_entry_s *entry = NULL;
+    struct rcache_entry_s *expired = NULL;
+    struct rcache_flight_s *joined = NULL;
+    uint64_t hash = 0;
+#endif
+
+    if (path == NULL || resp == NULL || flight == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    *flight = NULL;
+
+#if CONFIG_RCACHE_SIZE > 0
+    pthread_once(&cache_once, rcache_init);
+
+    hash = rcache_hash(path);
+    shard = rcache_shard_get(hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    rcache_sketch_add(&shard->sketch, hash);
+
+    entry = rcache_shard_find(shard, hash, path, variant);
+    if (entry != NULL && entry->expires > rcache_now())
+    {
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+
+        rcache_lru_del(entry);
+        rcache_lru_add(shard, entry);
+
+        pthread_mutex_unlock(&shard->lock);
+
+        atomic_fetch_add_explicit(&cache.hits, 1, memory_order_relaxed);
+
+        *resp = &entry->resp;
+
+        return 0;
+    }
+
+    /* Expired response is rendered from file again */
+    if (entry != NULL)
+    {
+        rcache_shard_unlink(shard, entry);
+
+        expired = entry;
+        entry = NULL;
+    }
+
+    /* Response is rendered by another request at the moment, so its
+        file is read once however many requests come for it */
+    joined = rcache_flight_find(shard, hash, path, variant);
+    if (joined != NULL)
+    {
+        joined->refs++;
+
+        while (joined->landed == false)
+        {
+            pthread_cond_wait(&shard->landed, &shard->lock);
+        }
+
+        entry = joined->entry;
+
+        if (--joined->refs == 0)
+        {
+            free(joined);
+        }
+    }
+    else
+    {
+        /* Requests are not coalesced if there is no memory for it */
+        joined = strlen(path) < sizeof(joined->path) ? calloc(1, sizeof(*joined)) : NULL;
+        if (joined != NULL)
+        {
+            joined->shard = shard;
+            joined->refs = 1;
+            joined->variant = variant;
+            joined->hash = hash;
+            strcpy(joined->path, path);
+            joined->next = shard->flights;
+            shard->flights = joined;
+
+            *flight = joined;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (expired != NULL)
+    {
+        atomic_fetch_add_explicit(&cache.expired, 1, memory_order_relaxed);
+
+        rcache_entry_put(expired);
+    }
+
+    if (entry != NULL)
+    {
+        *resp = &entry->resp;
+
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&cache.misses, 1, memory_order_relaxed);
+#endif
+
+    return -ENOENT;
+}
+
+int rcache_add(const char *path, int variant, const char *data, size_t len, uint64_t generation,
+               struct rcache_flight_s *flight)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    struct rcache_shard_s *shard = NULL;
+    struct rcache_entry_s *entry = NULL;
+    struct rcache_entry_s *evicted = NULL;
+    struct rcache_entry_s *victim = NULL;
+    bool linked = false;
+    bool taken = false;
+    int result = 0;
+
+    if (path == NULL || data == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        rcache_cancel(flight);
+
+        return -EINVAL;
+    }
+
+    if (strlen(path) >= sizeof(entry->path) || sizeof(*entry) + len > RCACHE_SHARD_BYTES)
+    {
+        rcache_cancel(flight);
+
+        return -ENOSPC;
+    }
+
+    pthread_once(&cache_once, rcache_init);
+
+    entry = malloc(sizeof(*entry) + len);
+    if (entry == NULL)
+    {
+        LOGERR("Fail to allocate response entry");
+
+        rcache_cancel(flight);
+
+        return -ENOMEM;
+    }
+
+    memcpy(entry->data, data, len);
+    strcpy(entry->path, path);
+    entry->resp.data = entry->data;
+    entry->resp.len = len;
+    entry->variant = variant;
+    entry->hash = rcache_hash(path);
+    entry->expires = rcache_now() + atomic_load_explicit(&cache.ttl, memory_order_relaxed);
+    entry->cost = sizeof(*entry) + len;
+    atomic_init(&entry->refs, 0);
+
+    shard = rcache_shard_get(entry->hash);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (rcache_shard_generation(shard, entry->hash) != generation)
+    {
+        /* File was changed while the response was rendered */
+        result = -ESTALE;
+    }
+    else if (rcache_shard_find(shard, entry->hash, path, variant) != NULL)
+    {
+        /* Another thread rendered the same response meanwhile */
+        result = 0;
+    }
+    else if (rcache_shard_admit(shard, entry) == false)
+    {
+        atomic_fetch_add_explicit(&cache.rejected, 1, memory_order_relaxed);
+
+        result = -ENOSPC;
+    }
+    else
+    {
+        while (shard->bytes + entry->cost > RCACHE_SHARD_BYTES)
+        {
+            victim = shard->lru.prev;
+            rcache_shard_unlink(shard, victim);
+
+            victim->chain = evicted;
+            evicted = victim;
+        }
+
+        rcache_shard_link(shard, entry);
+        linked = true;
+
+        atomic_fetch_add_explicit(&cache.admitted, 1, memory_order_relaxed);
+    }
+
+    /* Waiting requests send the response even if it is not cached */
+    if (flight != NULL)
+    {
+        taken = rcache_flight_land(flight, result == -ESTALE ? NULL : entry);
+    }
+
+    /* Accounted before the entry may be evicted by another thread */
+    if (linked == true || taken == true)
+    {
+        atomic_fetch_add_explicit(&cache.bytes, entry->cost, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (linked == false && taken == false)
+    {
+        free(entry);
+    }
+
+    /* Evicted responses are freed once the last connection that sends them is done */
+    while (evicted != NULL)
+    {
+        victim = evicted;
+        evicted = victim->chain;
+
+        atomic_fetch_add_explicit(&cache.evicts, 1, memory_order_relaxed);
+
+        rcache_entry_put(victim);
+    }
+
+    return result;
+#else
+    return -ENOSPC;
+#endif
+}
+
+void rcache_cancel(struct rcache_flight_s *flight)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    struct rcache_shard_s *shard = NULL;
+
+    if (flight == NULL)
+    {
+        return;
+    }
+
+    shard = flight->shard;
+
+    pthread_mutex_lock(&shard->lock);
+
+    rcache_flight_land(flight, NULL);
+
+    pthread_mutex_unlock(&shard->lock);
+#endif
+}
+
+void rcache_put(const struct rcache_resp_s *resp)
+{
+    if (resp == NULL)
+    {
+        return;
+    }
+
+    /* Response is the first member of entry */
+    rcache_entry_put((struct rcache_entry_s *)resp);
+}
+
+uint64_t rcache_generation(const char *path)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    uint64_t hash = rcache_hash(path);
+
+    return rcache_shard_generation(rcache_shard_get(hash), hash);
+#else
+    return atomic_load(&cache.generation);
+#endif
+}
+
+void rcache_invalidate(const char *path)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    uint64_t hash = rcache_hash(path);
+    struct rcache_shard_s *shard = rcache_shard_get(hash);
+    struct rcache_entry_s **link = NULL;
+    struct rcache_entry_s *entry = NULL;
+    struct rcache_entry_s *dropped = NULL;
+
+    pthread_once(&cache_once, rcache_init);
+
+    pthread_mutex_lock(&shard->lock);
+
+    atomic_fetch_add(&shard->generations[(hash / CONFIG_RCACHE_SHARDS) % RCACHE_BUCKETS], 1);
+
+    /* All variants of response are in the same bucket */
+    link = rcache_shard_bucket(shard, hash);
+    while (*link != NULL)
+    {
+        entry = *link;
+        if (entry->hash != hash || strcmp(entry->path, path) != 0)
+        {
+            link = &entry->chain;
+
+            continue;
+        }
+
+        rcache_shard_unlink(shard, entry);
+
+        entry->chain = dropped;
+        dropped = entry;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    while (dropped != NULL)
+    {
+        entry = dropped;
+        dropped = entry->chain;
+
+        atomic_fetch_add_explicit(&cache.invalidated, 1, memory_order_relaxed);
+
+        rcache_entry_put(entry);
+    }
+#endif
+}
+
+void rcache_invalidate_all(void)
+{
+#if CONFIG_RCACHE_SIZE > 0
+    struct rcache_shard_s *shard = NULL;
+    struct rcache_entry_s *entry = NULL;
+    struct rcache_entry_s *dropped = NULL;
+
+    pthread_once(&cache_once, rcache_init);
+
+    atomic_fetch_add(&cache.generation, 1);
+
+    for (size_t i = 0; i < CONFIG_RCACHE_SHARDS; i++)
+    {
+        shard = &cache.shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+
+        while (shard->lru.next != &shard->lru)
+        {
+            entry = shard->lru.next;
+            rcache_shard_unlink(shard, entry);
+
+            entry->chain = dropped;
+            dropped = entry;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    while (dropped != NULL)
+    {
+        entry = dropped;
+        dropped = entry->chain;
+
+        atomic_fetch_add_explicit(&cache.invalidated, 1, memory_order_relaxed);
+
+        rcache_entry_put(entry);
+    }
+#endif
+}
+
+void rcache_ttl_set(unsigned int ttl)
+{
+    atomic_store(&cache.ttl, ttl);
+}
@@ -0,0 +1,122 @@
+/**
+ * @file rcache.h
+ * @brief This module caches complete responses rendered for small files
+ *
+ * The module do following:
+ *  - keep status line, headers and body of response in one block, so it is sent as is
+ *  - bound memory taken by responses, evicting least recently used ones
+ *  - admit new response only if it is requested more often than responses it evicts
+ *    (TinyLFU), so a burst of one-off requests does not flush hot responses
+ *  - drop response once its time to live expires, so it is rendered from disk again
+ *  - let one request render response that is missing, while concurrent requests
+ *    of it wait and send what was rendered
+ *
+ * Responses are also dropped on demand, once a change of their files is noticed.
+ * Responses are reference counted, so block stays valid while it is sent
+ * even if the response is evicted meanwhile.
+ **/
+
+#ifndef RCACHE_H_
+#define RCACHE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * @brief The structure represents cached response
+ **/
+struct rcache_resp_s
+{
+    const char *data; /// rendered response
+    size_t len;       /// length of response in bytes
+};
+
+/**
+ * @brief The structure represents rendering of missing response other requests wait for
+ **/
+struct rcache_flight_s;
+
+/**
+ * @brief Get response from cache
+ *
+ * Every call counts as a request of the response for admission, even if it is not cached.
+ * If the response is rendered by another request at the moment, the call waits for it.
+ * Otherwise caller is expected to render the response: requests of it wait until the
+ * flight is finished by rcache_add or rcache_cancel.
+ *
+ * @param path[in] - normalized path of resource
+ * @param variant[in] - variant of response for the same resource (e.g. keep-alive or not)
+ * @param resp[out] - cached response, shall be released by rcache_put
+ * @param flight[out] - rendering caller shall finish, NULL if it is not waited for
+ *
+ * @retval 0 in case of success, -ENOENT if response is not cached
+ **/
+int rcache_get(const char *path, int variant, const struct rcache_resp_s **resp,
+               struct rcache_flight_s **flight);
+
+/**
+ * @brief Offer rendered response to cache
+ *
+ * Response is copied if it is admitted or requests wait for it. It is not cached,
+ * nor given to waiting requests, if the resource was invalidated since generation was taken.
+ *
+ * @param path[in] - normalized path of resource
+ * @param variant[in] - variant of response for the same resource
+ * @param data[in] - rendered response
+ * @param len[in] - length of response in bytes
+ * @param generation[in] - value of rcache_generation taken before resource was read
+ * @param flight[in] - rendering got by rcache_get, it is finished by the call
+ *
+ * @retval 0 if response is cached, -ENOSPC if it is not admitted, -ESTALE if
+ * resource was invalidated, negative errno value in case of error
+ **/
+int rcache_add(const char *path, int variant, const char *data, size_t len, uint64_t generation,
+               struct rcache_flight_s *flight);
+
+/**
+ * @brief Finish rendering without response, so waiting requests render it on their own
+ *
+ * @param flight[in] - rendering got by rcache_get, NULL is ignored
+ **/
+void rcache_cancel(struct rcache_flight_s *flight);
+
+/**
+ * @brief Release response got by rcache_get
+ *
+ * @param resp[in] - cached response
+ **/
+void rcache_put(const struct rcache_resp_s *resp);
+
+/**
+ * @brief Get generation of resource, it is changed by its invalidation
+ *
+ * Resources that share hash bucket share generation too
+ *
+ * @param path[in] - normalized path of resource
+ *
+ * @retval generation
+ **/
+uint64_t rcache_generation(const char *path);
+
+/**
+ * @brief Drop all variants of response for resource
+ *
+ * @param path[in] - normalized path of resource
+ **/
+void rcache_invalidate(const char *path);
+
+/**
+ * @brief Drop all responses from cache
+ **/
+void rcache_invalidate_all(void);
+
+/**
+ * @brief Set time cached responses are sent before they are rendered again
+ *
+ * New time applies to responses cached after the call.
+ *
+ * @param ttl[in] - time to live in milliseconds
+ **/
+void rcache_ttl_set(unsigned int ttl);
+
+#endif
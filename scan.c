@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+#include "scan.h"
+#include "log.h"
+
+#define MODULE_NAME "scan"
+
+/**
+ * @brief Lookup tables of class of characters
+ *
+ * Vector kernels classify bytes below 0x80 with two shuffles: low nibble
+ * of a byte selects bit set of allowed high nibbles from lo table, high
+ * nibble selects single bit to test in it. Bytes 0x80-0xff are either
+ * all allowed or all disallowed.
+ **/
+struct scan_table_s
+{
+    uint8_t lo[16]; /// bit h of lo[n] is set if byte (h << 4 | n) is allowed
+    bool high;      /// bytes 0x80-0xff are allowed
+    bool map[256];  /// allowed bytes for scalar implementation
+};
+
+typedef size_t (*scan_span_f)(const struct scan_table_s *table, const char *buf, size_t len);
+
+static struct scan_table_s tables[SCAN_CLASS_NUM];
+
+static bool scan_is_token(unsigned char ch)
+{
+    if (ch >= 'a' && ch <= 'z')
+    {
+        return true;
+    }
+
+    if (ch >= 'A' && ch <= 'Z')
+    {
+        return true;
+    }
+
+    if (ch >= '0' && ch <= '9')
+    {
+        return true;
+    }
+
+    return ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != NULL;
+}
+
+static bool scan_is_vchar(unsigned char ch)
+{
+    return ch > ' ' && ch < 0x7f;
+}
+
+static bool scan_is_field(unsigned char ch)
+{
+    return ch == ' ' || ch == '\t' || ch >= 0x80 || scan_is_vchar(ch);
+}
+
+static void scan_table_build(struct scan_table_s *table, bool (*allowed)(unsigned char))
+{
+    unsigned int ch = 0;
+
+    memset(table, 0, sizeof(*table));
+
+    for (ch = 0; ch < 256; ch++)
+    {
+        table->map[ch] = allowed(ch);
+
+        if (ch < 0x80 && table->map[ch] == true)
+        {
+            table->lo[ch & 0x0f] |= 1 << (ch >> 4);
+        }
+    }
+
+    table->high = table->map[0x80];
+}
+
+static size_t scan_span_scalar(const struct scan_table_s *table, const char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len && table->map[(unsigned char)buf[pos]] == true)
+    {
+        pos++;
+    }
+
+    return pos;
+}
+
+#if SCAN_X86
+/* Inlined into AVX2 kernel as well, so its tail avoids SSE/AVX transition penalty */
+__attribute__((target("sse4.2"), always_inline))
+static inline size_t scan_span16(const struct scan_table_s *table, const char *buf, size_t len)
+{
+    const __m128i lo_table = _mm_loadu_si128((const __m128i *)table->lo);
+    const __m128i hi_table = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i high = _mm_set1_epi8(table->high ? -1 : 0);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i data;
+    __m128i bad;
+    unsigned int mask = 0;
+    size_t pos = 0;
+
+    for (; pos + sizeof(__m128i) <= len; pos += sizeof(__m128i))
+    {
+        data = _mm_loadu_si128((const __m128i *)(buf + pos));
+
+        bad = _mm_and_si128(_mm_shuffle_epi8(lo_table, _mm_and_si128(data, nibble)),
+                            _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(data, 4), nibble)));
+        bad = _mm_cmpeq_epi8(bad, zero);
+
+        /* Bytes with high bit set are not covered by lookup */
+        bad = _mm_andnot_si128(_mm_and_si128(_mm_cmplt_epi8(data, zero), high), bad);
+
+        mask = _mm_movemask_epi8(bad);
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+
+    return pos + scan_span_scalar(table, buf + pos, len - pos);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_span_sse42(const struct scan_table_s *table, const char *buf, size_t len)
+{
+    return scan_span16(table, buf, len);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_span_avx2(const struct scan_table_s *table, const char *buf, size_t len)
+{
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table->lo));
+    const __m256i hi_table = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i high = _mm256_set1_epi8(table->high ? -1 : 0);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i data;
+    __m256i bad;
+    unsigned int mask = 0;
+    size_t pos = 0;
+
+    /* Most of tokens are short, so the first step is 16 bytes only */
+    if (len >= sizeof(__m256i))
+    {
+        pos = scan_span16(table, buf, sizeof(__m128i));
+        if (pos < sizeof(__m128i))
+        {
+            return pos;
+        }
+    }
+
+    for (; pos + sizeof(__m256i) <= len; pos += sizeof(__m256i))
+    {
+        data = _mm256_loadu_si256((const __m256i *)(buf + pos));
+
+        bad = _mm256_and_si256(_mm256_shuffle_epi8(lo_table, _mm256_and_si256(data, nibble)),
+                               _mm256_shuffle_epi8(hi_table,
+                                                   _mm256_and_si256(_mm256_srli_epi16(data, 4), nibble)));
+        bad = _mm256_cmpeq_epi8(bad, zero);
+
+        /* Bytes with high bit set are not covered by lookup */
+        bad = _mm256_andnot_si256(_mm256_and_si256(_mm256_cmpgt_epi8(zero, data), high), bad);
+
+        mask = _mm256_movemask_epi8(bad);
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+
+    /* Tail shorter than 32 bytes is still worth one 16 bytes step */
+    return pos + scan_span16(table, buf + pos, len - pos);
+}
+#endif
+
+static scan_span_f scan_span_impl = scan_span_scalar;
+static enum scan_impl_e scan_impl = SCAN_IMPL_SCALAR;
+
+static const char *scan_impl_names[] =
+{
+    [SCAN_IMPL_AUTO] = "auto",
+    [SCAN_IMPL_SCALAR] = "scalar",
+    [SCAN_IMPL_SSE42] = "sse4.2",
+    [SCAN_IMPL_AVX2] = "avx2",
+};
+
+static bool scan_impl_supported(enum scan_impl_e impl)
+{
+    switch (impl)
+    {
+        case SCAN_IMPL_SCALAR:
+            return true;
+
+#if SCAN_X86
+        case SCAN_IMPL_SSE42:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2");
+
+        case SCAN_IMPL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+#endif
+
+        default:
+            return false;
+    }
+}
+
+int scan_select(enum scan_impl_e impl)
+{
+    if (impl == SCAN_IMPL_AUTO)
+    {
+        impl = SCAN_IMPL_AVX2;
+
+        while (scan_impl_supported(impl) == false)
+        {
+            impl--;
+        }
+    }
+
+    if (scan_impl_supported(impl) == false)
+    {
+        LOGERR("%s scanning is not supported by CPU", scan_impl_names[impl]);
+
+        return -ENOTSUP;
+    }
+
+    switch (impl)
+    {
+#if SCAN_X86
+        case SCAN_IMPL_SSE42:
+            scan_span_impl = scan_span_sse42;
+            break;
+
+        case SCAN_IMPL_AVX2:
+            scan_span_impl = scan_span_avx2;
+            break;
+#endif
+
+        default:
+            scan_span_impl = scan_span_scalar;
+    }
+
+    scan_impl = impl;
+
+    return 0;
+}
+
+const char *scan_impl_name(void)
+{
+    return scan_impl_names[scan_impl];
+}
+
+size_t scan_span(enum scan_class_e cls, const char *buf, size_t len)
+{
+    return scan_span_impl(&tables[cls], buf, len);
+}
+
+__attribute__((constructor))
+static void scan_init(void)
+{
+    scan_table_build(&tables[SCAN_CLASS_TOKEN], scan_is_token);
+    scan_table_build(&tables[SCAN_CLASS_VCHAR], scan_is_vchar);
+    scan_table_build(&tables[SCAN_CLASS_FIELD], scan_is_field);
+
+    scan_select(SCAN_IMPL_AUTO);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file scan.h
+ * @brief This module implements fast scanning of request bytes for HTTP parser
+ *
+ * The module do following:
+ *  - find the first byte that does not belong to a class of characters
+ *    (token, visible characters, header field value)
+ *  - check 16 (SSE4.2) or 32 (AVX2) bytes at once if CPU supports it
+ *  - select implementation at runtime according to CPUID
+ **/
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stdlib.h>
+
+/**
+ * @brief Classes of characters allowed in parts of HTTP request
+ **/
+enum scan_class_e
+{
+    SCAN_CLASS_TOKEN = 0, /// method and header name characters (tchar)
+    SCAN_CLASS_VCHAR,     /// request target and version characters
+    SCAN_CLASS_FIELD,     /// header value characters (VCHAR, SP, HTAB, obs-text)
+    SCAN_CLASS_NUM
+};
+
+/**
+ * @brief Available scanning implementations
+ **/
+enum scan_impl_e
+{
+    SCAN_IMPL_AUTO = 0, /// the best one supported by CPU
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE42,
+    SCAN_IMPL_AVX2,
+};
+
+/**
+ * @brief Select scanning implementation
+ *
+ * The best implementation supported by CPU is selected at program start,
+ * so it is needed only to force particular one.
+ *
+ * @param impl[in] - implementation to use
+ *
+ * @retval 0 in case of success, -ENOTSUP if CPU does not support it
+ **/
+int scan_select(enum scan_impl_e impl);
+
+/**
+ * @brief Provide name of selected implementation
+ *
+ * @retval name of implementation
+ **/
+const char *scan_impl_name(void);
+
+/**
+ * @brief Measure length of data that consists of characters of the class only
+ *
+ * @param cls[in] - class of allowed characters
+ * @param buf[in] - data to scan
+ * @param len[in] - length of data
+ *
+ * @retval offset of the first byte that does not belong to the class,
+ * or len if all bytes belong to it
+ **/
+size_t scan_span(enum scan_class_e cls, const char *buf, size_t len);
+
+#endif
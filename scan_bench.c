@@ -0,0 +1,169 @@
+/**
+ * @file scan_bench.c
+ * @brief Microbenchmark of request scanning implementations
+ *
+ * Walks over typical browser and curl requests the same way HTTP parser
+ * does and reports time per request for each implementation supported
+ * by CPU. Results of all implementations are cross-checked first.
+ **/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scan.h"
+
+#define BENCH_ITERATIONS 1000000
+
+static const char browser_request[] =
+    "GET /static/js/app.bundle.min.js?v=3f2a91c HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: _ga=GA1.1.123456789.1700000000; session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "\r\n";
+
+static const char curl_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char *impl_names[] =
+{
+    [SCAN_IMPL_SCALAR] = "scalar",
+    [SCAN_IMPL_SSE42] = "sse4.2",
+    [SCAN_IMPL_AVX2] = "avx2",
+};
+
+/* Walk over request like HTTP parser does and return position where it stopped */
+static size_t bench_walk(const char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    pos += scan_span(SCAN_CLASS_TOKEN, buf + pos, len - pos) + 1;
+    pos += scan_span(SCAN_CLASS_VCHAR, buf + pos, len - pos) + 1;
+    pos += scan_span(SCAN_CLASS_VCHAR, buf + pos, len - pos) + 2;
+
+    while (pos < len && buf[pos] != '\r')
+    {
+        pos += scan_span(SCAN_CLASS_TOKEN, buf + pos, len - pos) + 1;
+
+        while (buf[pos] == ' ')
+        {
+            pos++;
+        }
+
+        pos += scan_span(SCAN_CLASS_FIELD, buf + pos, len - pos) + 2;
+    }
+
+    return pos;
+}
+
+static int bench_check(void)
+{
+    char buf[256];
+    size_t expected = 0;
+    size_t result = 0;
+    size_t len = 0;
+    size_t j = 0;
+    int impl = 0;
+    int cls = 0;
+    int i = 0;
+
+    srand(1);
+
+    for (i = 0; i < 100000; i++)
+    {
+        /* Mostly allowed bytes with rare random ones */
+        for (j = 0; j < sizeof(buf); j++)
+        {
+            buf[j] = rand() % 64 == 0 ? (char)rand() : 'a' + rand() % 26;
+        }
+
+        len = rand() % sizeof(buf);
+
+        for (cls = 0; cls < SCAN_CLASS_NUM; cls++)
+        {
+            scan_select(SCAN_IMPL_SCALAR);
+            expected = scan_span(cls, buf, len);
+
+            for (impl = SCAN_IMPL_SSE42; impl <= SCAN_IMPL_AVX2; impl++)
+            {
+                if (scan_select(impl) < 0)
+                {
+                    continue;
+                }
+
+                result = scan_span(cls, buf, len);
+                if (result != expected)
+                {
+                    printf("%s mismatch: %zu instead of %zu\n", impl_names[impl], result, expected);
+
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void bench_run(const char *name, const char *buf, size_t len)
+{
+    struct timespec start;
+    struct timespec end;
+    volatile size_t sink = 0;
+    double ns = 0;
+    int impl = 0;
+    int i = 0;
+
+    for (impl = SCAN_IMPL_SCALAR; impl <= SCAN_IMPL_AVX2; impl++)
+    {
+        if (scan_select(impl) < 0)
+        {
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (i = 0; i < BENCH_ITERATIONS; i++)
+        {
+            sink += bench_walk(buf, len);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+        printf("%-8s %4zu bytes %-7s %8.1f ns/request %8.2f GB/s\n", name, len, impl_names[impl],
+               ns / BENCH_ITERATIONS, (double)len * BENCH_ITERATIONS / ns);
+    }
+
+    (void)sink;
+}
+
+int main(void)
+{
+    if (bench_check() < 0)
+    {
+        return 1;
+    }
+
+    bench_run("browser", browser_request, sizeof(browser_request) - 1);
+    bench_run("curl", curl_request, sizeof(curl_request) - 1);
+
+    return 0;
+}
@@ -1,25 +1,34 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
+#include <sched.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "server.h"
 #include "tls.h"
 #include "soc.h"
+#include "uring.h"
+#include "evloop.h"
+#include "pool.h"
+#include "stats.h"
 #include "config.h"
 #include "log.h"
 
 #define MODULE_NAME "server"
 
-struct server_s *server_create(bool is_secure)
+struct server_s *server_create(enum server_backend_e backend)
 {
     struct server_s *srv = NULL;
 
-    /* Allocate mamory for server */
-    srv = malloc(sizeof(struct server_s));
+    /* Allocate mamory for server. Configuration is zeroed, so server without
+        certificates set does not load garbage ones */
+    srv = calloc(1, sizeof(struct server_s));
     if (srv == NULL)
     {
         LOGERR("Fail allocate memory for server object");
@@ -27,16 +36,22 @@ struct server_s *server_create(bool is_secure)
         return NULL;
     }
 
-    /* Get server context and interface depend on secure option */
-    if (is_secure == true)
+    /* Get server context and interface depend on backend option */
+    switch (backend)
     {
-        srv->ctx = tls_serv_ctx_alloc();
-        srv->iface = tls_serv_iface_get();
-    }
-    else
-    {
-        srv->ctx = soc_serv_ctx_alloc();
-        srv->iface = soc_serv_iface_get();
+        case SERVER_BACKEND_TLS:
+            srv->ctx = tls_serv_ctx_alloc();
+            srv->iface = tls_serv_iface_get();
+            break;
+
+        case SERVER_BACKEND_URING:
+            srv->ctx = uring_serv_ctx_alloc();
+            srv->iface = uring_serv_iface_get();
+            break;
+
+        default:
+            srv->ctx = soc_serv_ctx_alloc();
+            srv->iface = soc_serv_iface_get();
     }
 
     if (srv->ctx == NULL)
@@ -58,11 +73,42 @@ struct server_s *server_create(bool is_secure)
         return NULL;
     }
 
+    srv->backend = backend;
+    srv->addr = NULL;
+    srv->port = 0;
+    srv->next = NULL;
+    atomic_init(&srv->accepted, 0);
+
+    /* Thread per connection is default mode */
+    srv->conf.mode = SERVER_MODE_THREAD;
+    srv->conf.workers = 0;
+    srv->conf.queue_depth = CONFIG_POOL_QUEUE_DEPTH;
+    srv->conf.pin = false;
+    srv->conf.keepalive = CONFIG_KEEPALIVE_TIMEOUT_SEC;
+    srv->conf.header_timeout = CONFIG_HEADER_TIMEOUT_SEC;
+    srv->conf.write_timeout = CONFIG_WRITE_TIMEOUT_SEC;
+
     return srv;
 }
 
+int server_configure(struct server_s *srv, const struct server_conf_s *conf)
+{
+    if (srv == NULL || conf == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    memcpy(&srv->conf, conf, sizeof(struct server_conf_s));
+
+    return 0;
+}
+
 int server_init(struct server_s *srv, char *addr, int port)
 {
+    int result = 0;
+
     if (srv == NULL)
     {
         LOGERR("Invalid argument");
@@ -77,171 +123,1141 @@ int server_init(struct server_s *srv, char *addr, int port)
         return -ENOSYS;
     }
 
+    /* Every listener of the mode binds the same address */
+    if (srv->conf.mode == SERVER_MODE_REUSEPORT)
+    {
+        if (srv->iface->reuseport == NULL)
+        {
+            LOGERR("Reuse port is not implemented");
+
+            return -ENOSYS;
+        }
+
+        srv->iface->reuseport(srv->ctx);
+    }
+
+    /* Blocking connections are not watched by timers, so they are limited
+        by socket timeouts. The same timeout covers header and idle time */
+    if (srv->iface->timeout != NULL)
+    {
+        srv->iface->timeout(srv->ctx,
+                            srv->conf.keepalive > srv->conf.header_timeout ?
+                                srv->conf.keepalive : srv->conf.header_timeout,
+                            srv->conf.write_timeout);
+    }
+
+    /* Only secure channel has use for certificates */
+    if (srv->conf.certs > 0 && srv->iface->credentials == NULL)
+    {
+        LOGERR("Certificates are not supported by the channel");
+
+        return -ENOSYS;
+    }
+
+    for (size_t i = 0; i < srv->conf.certs; i++)
+    {
+        result = srv->iface->credentials(srv->ctx, srv->conf.cert[i], srv->conf.key[i]);
+        if (result < 0)
+        {
+            return result;
+        }
+    }
+
+    /* Keep address to be able to create sibling listeners */
+    srv->addr = addr;
+    srv->port = port;
+
     return srv->iface->init(srv->ctx, addr, port);
 }
 
-static void server_conn_close(struct conn_s *conn)
+int server_attach(struct server_s *srv, struct server_s *listener)
 {
+    if (srv == NULL || listener == NULL || srv == listener)
+    {
+        LOGERR("Invalid argument");
 
-    if (conn->iface->close != NULL)
+        return -EINVAL;
+    }
+
+    if (listener->conf.mode != srv->conf.mode)
     {
-        conn->iface->close(conn->ctx);
+        LOGERR("Listener shall have the same mode as the server");
+
+        return -EINVAL;
     }
 
-    free(conn);
+    while (srv->next != NULL)
+    {
+        srv = srv->next;
+    }
+
+    srv->next = listener;
+
+    return 0;
 }
 
-static void *server_conn_handler(void *data)
+struct conn_s *server_conn_create(struct server_s *srv, struct conn_iface_s *iface, void *connctx,
+                                  server_listen_handler_f handler)
 {
-    struct conn_s *conn = (struct conn_s *)data;
-    size_t len = 0;
-    char buf[CONFIG_INPUT_BUFF_LEN] = {0}; /** @todo: data chunking */
-    int keepalive = 0;
+    struct conn_s *conn = NULL;
 
+    conn = calloc(1, sizeof(struct conn_s));
     if (conn == NULL)
     {
-        LOGERR("Connection object is NULL");
+        LOGERR("Fail to allocate memory for new connection");
 
-        pthread_exit(NULL);
+        return NULL;
     }
 
-    if (conn->iface->recv == NULL)
+    conn->srv = srv;
+    conn->ctx = connctx;
+    conn->handler = handler;
+    conn->iface = iface;
+
+    /* Channel that has a handshake needs it before any data */
+    conn->handshake = iface->handshake != NULL ? SERVER_HANDSHAKE_WANT_READ : 0;
+    conn->asyncfd = -1;
+
+    return conn;
+}
+
+void server_conn_close(struct conn_s *conn)
+{
+
+    if (conn->iface->close != NULL)
     {
-        LOGERR("Read interface is not implemented");
+        conn->iface->close(conn->ctx);
+    }
 
-        goto exit;
+    for (size_t i = 0; i < conn->outq.filenum; i++)
+    {
+        close(conn->outq.files[i].fd);
     }
 
-    /* Recive data */
-    do
+    free(conn->outq.files);
+    free(conn->outq.buf);
+    free(conn);
+}
+
+bool server_conn_pending(struct conn_s *conn)
+{
+    return conn->outq.len > conn->outq.off || conn->outq.filenum > 0;
+}
+
+static int server_outq_append(struct conn_outq_s *outq, const char *buf, size_t len)
+{
+    char *newbuf = NULL;
+    size_t newcap = 0;
+
+    /* Drop already sent data to reuse the buffer space */
+    if (outq->off > 0)
     {
-        len = conn->iface->recv(conn->ctx, buf, sizeof(buf));
-        if (len < 0)
+        memmove(outq->buf, outq->buf + outq->off, outq->len - outq->off);
+        outq->len -= outq->off;
+
+        for (size_t i = 0; i < outq->filenum; i++)
         {
-            LOGERR("Fail to receive data. Result: %s", strerror(errno));
+            outq->files[i].pos -= outq->off;
+        }
 
-            break;
+        outq->off = 0;
+    }
+
+    if (outq->len + len > outq->cap)
+    {
+        newcap = outq->cap > 0 ? outq->cap : CONFIG_OUTPUT_BUFF_LEN;
+        while (newcap < outq->len + len)
+        {
+            newcap *= 2;
         }
 
-        /* Handle received data */
-        keepalive = conn->handler(conn, buf, len);
-    } while (keepalive > 0);
+        newbuf = realloc(outq->buf, newcap);
+        if (newbuf == NULL)
+        {
+            LOGERR("Fail to allocate memory for output queue");
 
-exit:
-    server_conn_close(conn);
+            return -ENOMEM;
+        }
 
-    /* Exit the thread */
-    pthread_exit(NULL);
+        outq->buf = newbuf;
+        outq->cap = newcap;
+    }
 
-    return NULL;
+    memcpy(outq->buf + outq->len, buf, len);
+    outq->len += len;
+
+    return 0;
 }
 
-int server_listen(struct server_s *srv, server_listen_handler_f handler)
+/* File is sent after everything queued before, and is not copied to the buffer.
+    Caller closes its descriptor, so the queue keeps its own one */
+static int server_outq_file_add(struct conn_outq_s *outq, int fd, off_t offset, size_t len)
 {
-    void *connctx = NULL;
-    struct conn_s *conn = NULL;
-    struct conn_iface_s *conn_iface = NULL;
-    int result = 0;
-    pthread_t thread = 0;
+    struct conn_outfile_s *files = NULL;
+    size_t filecap = 0;
+    int filefd = -1;
 
-    /* Check if arguments are valid */
-    if (srv == NULL || handler == NULL)
+    if (outq->filenum == outq->filecap)
     {
-        LOGERR("Invalid argument");
+        filecap = outq->filecap > 0 ? outq->filecap * 2 : 4;
 
-        return -EINVAL;
-    }
+        files = realloc(outq->files, filecap * sizeof(*files));
+        if (files == NULL)
+        {
+            LOGERR("Fail to allocate memory for output queue");
 
-    /* Check if required interface is available */
-    if (srv->iface->accept == NULL ||
-        srv->iface->conn_iface == NULL)
-    {
-        LOGERR("Required interfaces are not implemented");
+            return -ENOMEM;
+        }
 
-        return -ENOSYS;
+        outq->files = files;
+        outq->filecap = filecap;
     }
 
-    /* Try to get connection interface in advance */
-    conn_iface = srv->iface->conn_iface();
-    if (conn_iface == NULL)
+    filefd = dup(fd);
+    if (filefd < 0)
     {
-        LOGERR("Fail to get connectio interface");
+        LOGERR("Fail to duplicate file descriptor. Result: %s", strerror(errno));
 
-        return -ENOSYS;
+        return -errno;
     }
 
-    while (1)
+    outq->files[outq->filenum].pos = outq->len;
+    outq->files[outq->filenum].fd = filefd;
+    outq->files[outq->filenum].off = offset;
+    outq->files[outq->filenum].len = len;
+    outq->filenum++;
+
+    return 0;
+}
+
+static void server_outq_file_drop(struct conn_outq_s *outq)
+{
+    close(outq->files[0].fd);
+
+    outq->filenum--;
+    memmove(outq->files, outq->files + 1, outq->filenum * sizeof(*outq->files));
+}
+
+int server_conn_flush(struct conn_s *conn)
+{
+    struct conn_outq_s *outq = &conn->outq;
+    struct conn_outfile_s *file = NULL;
+    size_t pending = 0;
+    size_t end = 0;
+    int sendlen = 0;
+
+    while (outq->off < outq->len || outq->filenum > 0)
     {
-        /* Wait for new connection */
-        connctx = srv->iface->accept(srv->ctx);
-        if (connctx == NULL)
+        /* Data queued before the next file goes first */
+        end = outq->filenum > 0 ? outq->files[0].pos : outq->len;
+
+        if (outq->off < end)
         {
-            LOGERR("Connection fail");
+            sendlen = conn->iface->send(conn->ctx, outq->buf + outq->off, end - outq->off);
+            if (sendlen == -EAGAIN && conn->nonblock == true)
+            {
+                break;
+            }
+
+            if (sendlen < 0)
+            {
+                LOGERR("Fail to flush output queue. Result: %d", sendlen);
+
+                return sendlen;
+            }
+
+            outq->off += sendlen;
 
             continue;
         }
 
-        /* Create new connection data */
-        conn = malloc(sizeof(struct conn_s));
-        if (conn == NULL)
+        file = &outq->files[0];
+
+        sendlen = conn->iface->sendfile(conn->ctx, file->fd, file->off, file->len);
+        if (sendlen == -EAGAIN && conn->nonblock == true)
         {
-            LOGERR("Fail to allocate memory for new connection");
+            break;
+        }
 
-            free(connctx);
+        if (sendlen < 0)
+        {
+            LOGERR("Fail to flush pending file. Result: %d", sendlen);
 
-            continue;
+            return sendlen;
         }
 
-        conn->ctx = connctx;
-        conn->handler = handler;
-        conn->iface = conn_iface;
-
-        /* Create separate thread for connection */
-        result = pthread_create(&thread, NULL, server_conn_handler, conn);
-        if (result < 0)
+        /* File is truncated meanwhile, while its length is sent in header already.
+            The rest of the queue would be taken for its body, so connection fails */
+        if (sendlen == 0)
         {
-            LOGERR("Fail to create new connection thread. Result %d", result);
+            LOGERR("Pending file is truncated");
 
-            /* Close connection */
-            server_conn_close(conn);
+            return -ENODATA;
+        }
 
-            continue;
+        file->off += sendlen;
+        file->len -= sendlen;
+
+        if (file->len == 0)
+        {
+            server_outq_file_drop(outq);
         }
     }
 
-    return 0;
+    /* Whole queue is sent, so rewind it */
+    if (outq->off == outq->len && outq->filenum == 0)
+    {
+        outq->off = 0;
+        outq->len = 0;
+    }
+
+    pending = outq->len - outq->off;
+    for (size_t i = 0; i < outq->filenum; i++)
+    {
+        pending += outq->files[i].len;
+    }
+
+    return pending;
 }
 
-int server_send(struct conn_s *conn, void *buf, size_t len)
+int server_conn_handshake(struct conn_s *conn)
 {
-    if (conn->iface->send == NULL)
+    int result = 0;
+
+    if (conn->handshake == 0)
     {
-        LOGERR("Write interface is not implemented");
+        return 0;
+    }
 
-        return -ENOSYS;
+    result = conn->iface->handshake(conn->ctx);
+    if (result < 0)
+    {
+        LOGERR("Fail to establish connection. Result: %d", result);
+
+        return result;
     }
 
-    int sendlen = conn->iface->send(conn->ctx, buf, len);
-    if (sendlen < 0)
+    conn->handshake = result;
+
+    return result;
+}
+
+static int server_conn_uncork(struct conn_s *conn)
+{
+    int result = 0;
+
+    if (conn->corked == false)
     {
-        LOGERR("Fail to send. Result: %s", strerror(errno));
+        return 0;
+    }
 
-        return -errno;
+    conn->corked = false;
+
+    /* Blocking channel sends everything here or fails once send timeout
+        expires, non-blocking one leaves the rest in output queue for event loop */
+    result = server_conn_flush(conn);
+
+    return result < 0 ? result : 0;
+}
+
+int server_conn_process(struct conn_s *conn)
+{
+    int result = 0;
+    int flushresult = 0;
+
+    /* Requests pipelined behind a file that is not sent yet wait in input
+        buffer, so output queue does not collect descriptors without bound */
+    while (conn->inlen > 0 && conn->outq.filenum == 0)
+    {
+        result = conn->handler(conn, conn->inbuf, conn->inlen);
+
+        /* Request is not complete yet or connection shall be closed */
+        if (result <= 0)
+        {
+            break;
+        }
+
+        if ((size_t)result > conn->inlen)
+        {
+            result = conn->inlen;
+        }
+
+        conn->requests++;
+
+        /* Keep unconsumed data at the beginning of buffer */
+        conn->inlen -= result;
+        memmove(conn->inbuf, conn->inbuf + result, conn->inlen);
+
+        /* More requests are pipelined behind this one, so their responses
+            are collected in output queue and sent at once */
+        if (conn->inlen > 0)
+        {
+            conn->corked = true;
+        }
     }
 
-    return sendlen;
+    /* Responses are sent even if connection is going to be closed */
+    flushresult = server_conn_uncork(conn);
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    if (flushresult < 0)
+    {
+        return flushresult;
+    }
+
+    if (conn->inlen == sizeof(conn->inbuf) && conn->outq.filenum == 0)
+    {
+        LOGERR("Input buffer is full, but request is not complete");
+
+        return -ENOBUFS;
+    }
+
+    return 0;
 }
 
-int server_close(struct server_s *srv)
+static void server_conn_serve(struct conn_s *conn)
 {
-    /** @todo: close all open threads ? */
+    int len = 0;
+
+    if (conn == NULL)
+    {
+        LOGERR("Connection object is NULL");
+
+        return;
+    }
+
+    if (conn->iface->recv == NULL)
+    {
+        LOGERR("Read interface is not implemented");
+
+        goto exit;
+    }
 
-    if (srv->iface->deinit != NULL)
+    /* Handshake runs in connection thread, not in the accepting one */
+    if (server_conn_handshake(conn) != 0)
     {
-        srv->iface->deinit(srv->ctx);
+        goto exit;
     }
 
-    free(srv);
+    /* Recive data */
+    do
+    {
+        len = conn->iface->recv(conn->ctx, conn->inbuf + conn->inlen,
+                                sizeof(conn->inbuf) - conn->inlen);
+        if (len <= 0)
+        {
+            LOGERR("Fail to receive data. Result: %d", len);
+
+            break;
+        }
+
+        conn->inlen += len;
+    } while (server_conn_process(conn) == 0);
+
+exit:
+    server_conn_close(conn);
+}
+
+static void *server_conn_handler(void *data)
+{
+    server_conn_serve((struct conn_s *)data);
+
+    /* Exit the thread */
+    pthread_exit(NULL);
+
+    return NULL;
+}
+
+static void server_pool_work(void *item)
+{
+    server_conn_serve((struct conn_s *)item);
+}
+
+/**
+ * @brief The structure represents acceptor of one listener in thread and pool modes
+ **/
+struct server_acceptor_s
+{
+    struct server_s *srv;            /// listener
+    struct conn_iface_s *conn_iface; /// connection interface of the listener
+    server_listen_handler_f handler; /// upper layer data handler
+    struct pool_s *pool;             /// worker pool shared by all listeners, NULL in thread mode
+};
+
+static void *server_accept_loop(void *data)
+{
+    struct server_acceptor_s *acceptor = (struct server_acceptor_s *)data;
+    struct server_s *srv = acceptor->srv;
+    struct conn_iface_s *conn_iface = acceptor->conn_iface;
+    struct pool_s *pool = acceptor->pool;
+    server_listen_handler_f handler = acceptor->handler;
+    void *connctx = NULL;
+    struct conn_s *conn = NULL;
+    pthread_attr_t attr;
+    int result = 0;
+    pthread_t thread = 0;
+
+    /* Connection threads are never joined, so let them release resources on exit */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1)
+    {
+        /* Wait for new connection */
+        connctx = srv->iface->accept(srv->ctx);
+        if (connctx == NULL)
+        {
+            LOGERR("Connection fail");
+
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&srv->accepted, 1, memory_order_relaxed);
+
+        /* Create new connection data */
+        conn = server_conn_create(srv, conn_iface, connctx, handler);
+        if (conn == NULL)
+        {
+            free(connctx);
+
+            continue;
+        }
+
+        /* Hand off connection to the worker pool */
+        if (pool != NULL)
+        {
+            result = pool_push(pool, conn);
+            if (result < 0)
+            {
+                LOGERR("Fail to queue new connection. Result %d", result);
+
+                server_conn_close(conn);
+            }
+
+            continue;
+        }
+
+        /* Create separate thread for connection */
+        result = pthread_create(&thread, &attr, server_conn_handler, conn);
+        if (result != 0)
+        {
+            LOGERR("Fail to create new connection thread. Result %d", result);
+
+            /* Close connection */
+            server_conn_close(conn);
+
+            continue;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return NULL;
+}
+
+static int server_listen_thread(struct server_s *srv, server_listen_handler_f handler)
+{
+    struct server_acceptor_s *acceptors = NULL;
+    struct server_s *listener = NULL;
+    struct pool_s *pool = NULL;
+    pthread_t thread = 0;
+    size_t num = 0;
+    int result = 0;
+
+    for (listener = srv; listener != NULL; listener = listener->next)
+    {
+        /* Check if required interface is available */
+        if (listener->iface->accept == NULL ||
+            listener->iface->conn_iface == NULL)
+        {
+            LOGERR("Required interfaces are not implemented");
+
+            return -ENOSYS;
+        }
+
+        /* Try to get connection interface in advance */
+        if (listener->iface->conn_iface() == NULL)
+        {
+            LOGERR("Fail to get connectio interface");
+
+            return -ENOSYS;
+        }
+
+        num++;
+    }
+
+    acceptors = calloc(num, sizeof(struct server_acceptor_s));
+    if (acceptors == NULL)
+    {
+        LOGERR("Fail to allocate memory for acceptors");
+
+        return -ENOMEM;
+    }
+
+    if (srv->conf.mode == SERVER_MODE_POOL)
+    {
+        /* Fixed set of workers fed by the queue, connections of all listeners share it */
+        pool = pool_create(srv->conf.workers, srv->conf.queue_depth, server_pool_work);
+        if (pool == NULL)
+        {
+            LOGERR("Fail to create worker pool");
+
+            free(acceptors);
+
+            return -ENOMEM;
+        }
+
+        stats_register(pool_stats_report, pool);
+    }
+
+    listener = srv;
+    for (size_t i = 0; i < num; i++, listener = listener->next)
+    {
+        acceptors[i].srv = listener;
+        acceptors[i].conn_iface = listener->iface->conn_iface();
+        acceptors[i].handler = handler;
+        acceptors[i].pool = pool;
+    }
+
+    /* Every listener blocks in its own accept, the first one in caller thread */
+    for (size_t i = 1; i < num; i++)
+    {
+        result = pthread_create(&thread, NULL, server_accept_loop, &acceptors[i]);
+        if (result != 0)
+        {
+            LOGERR("Fail to create acceptor thread. Result %d", result);
+
+            return -result;
+        }
+
+        pthread_detach(thread);
+    }
+
+    server_accept_loop(&acceptors[0]);
+
+    return 0;
+}
+
+struct server_reuseport_s
+{
+    struct server_s *srv;
+    server_listen_handler_f handler;
+    struct server_reuseport_group_s *group;
+    pthread_t thread;
+    int cpu;
+};
+
+/* Listener threads wait until all of them are created. Negative state
+    cancels the start, so the threads exit before their loops run */
+struct server_reuseport_group_s
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int state;
+    size_t num;
+    struct server_reuseport_s *listeners;
+};
+
+/* Single report for all listeners, so their number is not limited by stats */
+static void server_stats_report(void *arg)
+{
+    struct server_reuseport_group_s *group = (struct server_reuseport_group_s *)arg;
+    struct server_s *srv = NULL;
+
+    for (size_t i = 0; i < group->num; i++)
+    {
+        for (srv = group->listeners[i].srv; srv != NULL; srv = srv->next)
+        {
+            LOGINF("listener %lu (port %d) accepted %lu", i, srv->port,
+                   atomic_load(&srv->accepted));
+        }
+    }
+}
+
+static struct server_s *server_sibling_create(struct server_s *srv, size_t num)
+{
+    struct server_s *sibling = NULL;
+    int result = 0;
+
+    sibling = server_create(srv->backend);
+    if (sibling == NULL)
+    {
+        return NULL;
+    }
+
+    server_configure(sibling, &srv->conf);
+
+    result = server_init(sibling, srv->addr, srv->port);
+    if (result < 0)
+    {
+        LOGERR("Fail to init listener %lu of port %d. Result %d", num, srv->port, result);
+
+        server_close(sibling);
+
+        return NULL;
+    }
+
+    return sibling;
+}
+
+static void *server_reuseport_thread(void *data)
+{
+    struct server_reuseport_s *listener = (struct server_reuseport_s *)data;
+    struct server_reuseport_group_s *group = listener->group;
+    cpu_set_t cpuset;
+    int result = 0;
+
+    pthread_mutex_lock(&group->lock);
+
+    while (group->state == 0)
+    {
+        pthread_cond_wait(&group->cond, &group->lock);
+    }
+
+    result = group->state;
+
+    pthread_mutex_unlock(&group->lock);
+
+    if (result < 0)
+    {
+        return NULL;
+    }
+
+    if (listener->cpu >= 0)
+    {
+        CPU_ZERO(&cpuset);
+        CPU_SET(listener->cpu, &cpuset);
+
+        result = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (result != 0)
+        {
+            LOGERR("Fail to pin listener to CPU %d. Result %d", listener->cpu, result);
+        }
+    }
+
+    result = evloop_run(listener->srv, listener->handler);
+
+    LOGERR("Listener loop exited. Result %d", result);
+
+    return NULL;
+}
+
+static void server_reuseport_release(struct server_reuseport_group_s *group)
+{
+    stats_unregister(server_stats_report, group);
+
+    /* The first listener is owned by caller */
+    for (size_t i = 1; i < group->num && group->listeners[i].srv != NULL; i++)
+    {
+        server_close(group->listeners[i].srv);
+    }
+
+    free(group->listeners);
+    free(group);
+}
+
+static int server_listen_reuseport(struct server_s *srv, server_listen_handler_f handler)
+{
+    struct server_reuseport_s *listeners = NULL;
+    struct server_s *attached = NULL;
+    struct server_s *sibling = NULL;
+    struct server_reuseport_group_s *group = NULL;
+    size_t num = srv->conf.workers;
+    size_t started = 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int result = 0;
+
+    if (cpus <= 0)
+    {
+        cpus = 1;
+    }
+
+    if (num == 0)
+    {
+        num = cpus;
+    }
+
+    listeners = calloc(num, sizeof(struct server_reuseport_s));
+    group = calloc(1, sizeof(struct server_reuseport_group_s));
+    if (listeners == NULL || group == NULL)
+    {
+        LOGERR("Fail to allocate memory for listeners");
+
+        free(listeners);
+        free(group);
+
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->cond, NULL);
+    group->num = num;
+    group->listeners = listeners;
+
+    /* The first listener is the server itself, others are its siblings bound
+        to the same address. Kernel spreads incoming connections between them.
+        Every sibling gets siblings of attached listeners, so each loop serves
+        all ports */
+    for (size_t i = 0; i < num; i++)
+    {
+        if (i == 0)
+        {
+            listeners[i].srv = srv;
+        }
+        else
+        {
+            listeners[i].srv = server_sibling_create(srv, i);
+            if (listeners[i].srv == NULL)
+            {
+                result = -ENOMEM;
+
+                break;
+            }
+
+            for (attached = srv->next; attached != NULL && result == 0; attached = attached->next)
+            {
+                sibling = server_sibling_create(attached, i);
+                result = sibling != NULL ? server_attach(listeners[i].srv, sibling) : -ENOMEM;
+            }
+
+            if (result < 0)
+            {
+                break;
+            }
+        }
+
+        listeners[i].handler = handler;
+        listeners[i].group = group;
+        listeners[i].cpu = srv->conf.pin == true ? (int)(i % cpus) : -1;
+    }
+
+    if (result < 0)
+    {
+        /* Listeners are not started yet, so it is safe to release them */
+        server_reuseport_release(group);
+
+        return result;
+    }
+
+    /* Counters are reported once all listeners exist, so failed start
+        does not leave report of released ones */
+    if (stats_register(server_stats_report, group) < 0)
+    {
+        LOGERR("Accepts of listeners are not reported");
+    }
+
+    /* Create threads of siblings, the first one runs in caller thread */
+    for (; started < num; started++)
+    {
+        result = pthread_create(&listeners[started].thread, NULL, server_reuseport_thread,
+                                &listeners[started]);
+        if (result != 0)
+        {
+            LOGERR("Fail to create listener thread. Result %d", result);
+
+            result = -result;
+
+            break;
+        }
+    }
+
+    /* Let loops run or cancel created threads if not all of them are started */
+    pthread_mutex_lock(&group->lock);
+
+    group->state = result < 0 ? result : 1;
+
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+
+    if (result < 0)
+    {
+        for (size_t i = 1; i < started; i++)
+        {
+            pthread_join(listeners[i].thread, NULL);
+        }
+
+        server_reuseport_release(group);
+
+        return result;
+    }
+
+    for (size_t i = 1; i < num; i++)
+    {
+        pthread_detach(listeners[i].thread);
+    }
+
+    /* The first listener does not wait, group is started already */
+    server_reuseport_thread(&listeners[0]);
+
+    return -EIO;
+}
+
+int server_listen(struct server_s *srv, server_listen_handler_f handler)
+{
+    /* Check if arguments are valid */
+    if (srv == NULL || handler == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    switch (srv->conf.mode)
+    {
+        case SERVER_MODE_THREAD:
+        case SERVER_MODE_POOL:
+            return server_listen_thread(srv, handler);
+
+        case SERVER_MODE_EPOLL:
+            return evloop_run(srv, handler);
+
+        case SERVER_MODE_REUSEPORT:
+            return server_listen_reuseport(srv, handler);
+
+        default:
+            LOGERR("Unknown server mode %d", srv->conf.mode);
+    }
+
+    return -EINVAL;
+}
+
+int server_send(struct conn_s *conn, void *buf, size_t len)
+{
+    int sendlen = 0;
+
+    if (conn->iface->send == NULL)
+    {
+        LOGERR("Write interface is not implemented");
+
+        return -ENOSYS;
+    }
+
+    /* Keep order of data if something is already waiting in output queue */
+    if (conn->corked == true || server_conn_pending(conn) == true)
+    {
+        sendlen = server_outq_append(&conn->outq, buf, len);
+
+        return sendlen < 0 ? sendlen : (int)len;
+    }
+
+    sendlen = conn->iface->send(conn->ctx, buf, len);
+    if (sendlen == -EAGAIN && conn->nonblock == true)
+    {
+        sendlen = 0;
+    }
+
+    if (sendlen < 0)
+    {
+        LOGERR("Fail to send. Result: %d", sendlen);
+
+        return sendlen;
+    }
+
+    /* Non-blocking channel is not ready to accept the rest, so queue it
+        to be flushed by the event loop later */
+    if ((size_t)sendlen < len && conn->nonblock == true)
+    {
+        if (server_outq_append(&conn->outq, (char *)buf + sendlen, len - sendlen) < 0)
+        {
+            return -ENOMEM;
+        }
+
+        sendlen = len;
+    }
+
+    return sendlen;
+}
+
+int server_sendv(struct conn_s *conn, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    size_t skip = 0;
+    int sendlen = 0;
+    int i = 0;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    /* Lower layer can not send vectors, so send buffers one by one */
+    if (conn->iface->sendv == NULL)
+    {
+        for (i = 0; i < iovcnt; i++)
+        {
+            sendlen = server_send(conn, iov[i].iov_base, iov[i].iov_len);
+            if (sendlen < 0)
+            {
+                return sendlen;
+            }
+        }
+
+        return total;
+    }
+
+    /* Keep order of data if something is already waiting in output queue */
+    if (conn->corked == true || server_conn_pending(conn) == true)
+    {
+        sendlen = 0;
+    }
+    else
+    {
+        sendlen = conn->iface->sendv(conn->ctx, iov, iovcnt);
+        if (sendlen == -EAGAIN && conn->nonblock == true)
+        {
+            sendlen = 0;
+        }
+
+        if (sendlen < 0)
+        {
+            LOGERR("Fail to send. Result: %d", sendlen);
+
+            return sendlen;
+        }
+    }
+
+    /* Whatever is not sent is passed further by regular send, which
+        queues it for non-blocking channel or sends the rest otherwise */
+    skip = sendlen;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+
+            continue;
+        }
+
+        sendlen = server_send(conn, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        if (sendlen < 0)
+        {
+            return sendlen;
+        }
+
+        skip = 0;
+    }
+
+    return total;
+}
+
+static int server_sendfile_copy(struct conn_s *conn, int fd, off_t offset, size_t len)
+{
+    char buf[CONFIG_OUTPUT_BUFF_LEN];
+    ssize_t readlen = 0;
+    size_t sent = 0;
+    int sendlen = 0;
+
+    while (sent < len)
+    {
+        readlen = pread(fd, buf, sizeof(buf) < len - sent ? sizeof(buf) : len - sent,
+                        offset + sent);
+        if (readlen < 0)
+        {
+            LOGERR("Fail to read file. Result: %s", strerror(errno));
+
+            return -errno;
+        }
+
+        if (readlen == 0)
+        {
+            break;
+        }
+
+        sendlen = server_send(conn, buf, readlen);
+        if (sendlen < 0)
+        {
+            return sendlen;
+        }
+
+        sent += readlen;
+    }
+
+    return sent;
+}
+
+int server_sendfile(struct conn_s *conn, int fd, off_t offset, size_t len)
+{
+    size_t sent = 0;
+    int sendlen = 0;
+
+    /* Lower layer can not send files, so read and send it chunk by chunk */
+    if (conn->iface->sendfile == NULL)
+    {
+        return server_sendfile_copy(conn, fd, offset, len);
+    }
+
+    /* Collected responses go first, file is not copied to output queue */
+    if (conn->corked == true)
+    {
+        sendlen = server_conn_flush(conn);
+        if (sendlen < 0)
+        {
+            return sendlen;
+        }
+    }
+
+    while (sent < len)
+    {
+        if (server_conn_pending(conn) == true)
+        {
+            sendlen = -EAGAIN;
+        }
+        else
+        {
+            sendlen = conn->iface->sendfile(conn->ctx, fd, offset + sent, len - sent);
+        }
+
+        /* Non-blocking channel is not ready, so queue the rest of file
+            to be flushed by the event loop later */
+        if (sendlen == -EAGAIN && conn->nonblock == true)
+        {
+            sendlen = server_outq_file_add(&conn->outq, fd, offset + sent, len - sent);
+
+            return sendlen < 0 ? sendlen : (int)len;
+        }
+
+        if (sendlen < 0)
+        {
+            LOGERR("Fail to send file. Result: %d", sendlen);
+
+            return sendlen;
+        }
+
+        /* File is truncated meanwhile */
+        if (sendlen == 0)
+        {
+            break;
+        }
+
+        sent += sendlen;
+    }
+
+    return sent;
+}
+
+int server_close(struct server_s *srv)
+{
+    struct server_s *next = NULL;
+
+    /** @todo: close all open threads ? */
+
+    while (srv != NULL)
+    {
+        next = srv->next;
+
+        if (srv->iface->deinit != NULL)
+        {
+            srv->iface->deinit(srv->ctx);
+        }
+
+        free(srv);
+
+        srv = next;
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -13,21 +13,45 @@
 #define SERVER_H_
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "timer.h"
 
 /**
  * @brief Function handler type that uses to handle incoming data 
  * on top protocol layers such as HTTP, etc.
  * 
+ * Buffer contains all data received on the connection that was not consumed
+ * by previous calls, so a request may be delivered in any number of pieces.
+ * 
  * @param conn[in] - connection descriptor
  * @param buf[in] - buffer with incoming data
  * @param len[in] - lengh of incoming data
  * 
- * @retval shall return 1 to keep connection open after handling the request
- * or 0 othervise
+ * @retval shall return number of consumed bytes to keep connection open after 
+ * handling the request, 0 if more data is required to complete the request
+ * or negative value to close connection
  **/
 typedef int (*server_listen_handler_f)(void *connctx, char *buf, size_t len);
 
+/** Value returned by handler to close connection once the response is sent */
+#define SERVER_HANDLER_CLOSE (-1)
+
+/** Value returned by handshake to be called again once channel is readable */
+#define SERVER_HANDSHAKE_WANT_READ 1
+
+/** Value returned by handshake to be called again once channel is writable */
+#define SERVER_HANDSHAKE_WANT_WRITE 2
+
+/** Value returned by handshake to be called again once background operation completes (see async_fd) */
+#define SERVER_HANDSHAKE_WANT_ASYNC 3
+
 /**
  * @brief The structure represents connection interface for lower layers like socket/TLS
  * 
@@ -56,6 +80,93 @@ struct conn_iface_s
      **/
     int (*send)(void *connctx, char *buf, size_t len);
 
+    /**
+     * @brief Interface to send several buffers via connection channel at once
+     * 
+     * Implementation may send less than requested, the same way as send does
+     * 
+     * @param connctx[in] - connection context
+     * @param iov[in] - array of buffers to send
+     * @param iovcnt[in] - number of buffers in the array
+     * 
+     * @retval number of sent bytes in case of success, negative value otherwise
+     **/
+    int (*sendv)(void *connctx, const struct iovec *iov, int iovcnt);
+
+    /**
+     * @brief Interface to send part of a file via connection channel
+     * 
+     * Implementation may send less than requested, the same way as send does
+     * 
+     * @param connctx[in] - connection context
+     * @param fd[in] - descriptor of file to send
+     * @param offset[in] - offset in the file to send from
+     * @param len[in] - number of bytes to send
+     * 
+     * @retval number of sent bytes in case of success, negative value otherwise
+     **/
+    int (*sendfile)(void *connctx, int fd, off_t offset, size_t len);
+
+    /**
+     * @brief Interface to get file descriptor of connection channel
+     * 
+     * @param connctx[in] - connection context
+     * 
+     * @retval file descriptor in case of success, negative value otherwise
+     **/
+    int (*fd)(void *connctx);
+
+    /**
+     * @brief Interface to switch connection channel to non-blocking mode
+     * 
+     * After the call recv and send interfaces shall return -EAGAIN
+     * instead of blocking if the operation can not be completed immediately
+     * 
+     * @param connctx[in] - connection context
+     * 
+     * @retval 0 in case of success, negative value otherwise
+     **/
+    int (*nonblock)(void *connctx);
+
+    /**
+     * @brief Interface to establish connection channel after it is accepted (e.g. TLS handshake)
+     * 
+     * Blocking channel completes it in one call. Non-blocking one returns
+     * as soon as it has to wait for the peer and continues on next call
+     * 
+     * @param connctx[in] - connection context
+     * 
+     * @retval 0 once channel is established, SERVER_HANDSHAKE_WANT_READ,
+     * SERVER_HANDSHAKE_WANT_WRITE or SERVER_HANDSHAKE_WANT_ASYNC if it shall be called again,
+     * negative value in case of error
+     **/
+    int (*handshake)(void *connctx);
+
+    /**
+     * @brief Interface to get descriptor that becomes readable once background
+     * operation of non-blocking channel (e.g. private key signature) completes
+     * 
+     * The descriptor stays valid until connection is closed
+     * 
+     * @param connctx[in] - connection context
+     * 
+     * @retval file descriptor, negative value if channel has no such operations
+     **/
+    int (*async_fd)(void *connctx);
+
+    /**
+     * @brief Interface to check if request arrived, even partially, as early
+     * data (e.g. TLS 1.3 0-RTT), which an attacker is able to replay
+     * 
+     * Requests are passed in order they are received
+     * 
+     * @param connctx[in] - connection context
+     * @param len[in] - length of request
+     * 
+     * @retval true if request shall be served only if it is idempotent
+     **/
+    bool (*early)(void *connctx, size_t len);
+
     /**
      * @brief Interface to close connection channel
      * 
@@ -90,6 +201,63 @@ struct server_iface_s
      **/
     void *(*accept)(void *server);
 
+    /**
+     * @brief Interface to get file descriptor of listening channel
+     * 
+     * @param server[in] - server context
+     * 
+     * @retval file descriptor in case of success, negative value otherwise
+     **/
+    int (*fd)(void *server);
+
+    /**
+     * @brief Interface to switch listening channel to non-blocking mode
+     * 
+     * After the call accept interface shall return NULL with errno set to EAGAIN
+     * if there is no pending connection
+     * 
+     * @param server[in] - server context
+     * 
+     * @retval 0 in case of success, negative value otherwise
+     **/
+    int (*nonblock)(void *server);
+
+    /**
+     * @brief Interface to allow several listeners to bind the same address and port
+     * 
+     * Shall be called before init. Kernel spreads incoming connections between
+     * all listeners bound with the option (SO_REUSEPORT)
+     * 
+     * @param server[in] - server context
+     **/
+    void (*reuseport)(void *server);
+
+    /**
+     * @brief Interface to limit time blocking connection waits in recv and send
+     * 
+     * Applies to connections accepted after the call. Connections handled by
+     * event loop are limited by its timers instead
+     * 
+     * @param server[in] - server context
+     * @param recv[in] - receive timeout in seconds, 0 means no limit
+     * @param send[in] - send timeout in seconds, 0 means no limit
+     **/
+    void (*timeout)(void *server, unsigned int recv, unsigned int send);
+
+    /**
+     * @brief Interface to add certificate chain and private key presented to clients
+     * 
+     * Shall be called before init. Several pairs (e.g. ECDSA and RSA ones) may be
+     * added, the one that suits the client is selected during handshake
+     * 
+     * @param server[in] - server context
+     * @param cert[in] - path to file with certificate chain
+     * @param key[in] - path to file with private key of the certificate
+     * 
+     * @retval 0 in case of success, negative value otherwise
+     **/
+    int (*credentials)(void *server, const char *cert, const char *key);
+
     /**
      * @brief Interface to deinit close and free a server
      * 
@@ -109,6 +277,44 @@ struct server_iface_s
     struct conn_iface_s *(*conn_iface)(void);
 };
 
+/**
+ * @brief Lower layer implementations the server could be created with
+ **/
+enum server_backend_e
+{
+    SERVER_BACKEND_SOC,   /// regular sockets
+    SERVER_BACKEND_TLS,   /// TLS over sockets
+    SERVER_BACKEND_URING, /// regular sockets driven by io_uring
+};
+
+/**
+ * @brief Connection handling models supported by the server
+ **/
+enum server_mode_e
+{
+    SERVER_MODE_THREAD, /// separate blocking thread per connection
+    SERVER_MODE_EPOLL,  /// single thread non-blocking epoll reactor
+    SERVER_MODE_POOL,   /// fixed pool of blocking worker threads fed by acceptor
+    SERVER_MODE_REUSEPORT, /// event loop per thread, each with own SO_REUSEPORT listener
+};
+
+/**
+ * @brief The structure represents server runtime configuration
+ **/
+struct server_conf_s
+{
+    enum server_mode_e mode; /// connection handling model
+    size_t workers;          /// number of worker threads, 0 means number of CPUs
+    size_t queue_depth;      /// maximum number of accepted connections waiting for worker
+    bool pin;                /// pin listener threads to CPUs
+    unsigned int keepalive;      /// idle time between requests in seconds, 0 disables keep-alive
+    unsigned int header_timeout; /// time to receive request header in seconds
+    unsigned int write_timeout;  /// time to send next piece of response in seconds
+    const char *cert[CONFIG_TLS_MAX_CERTS]; /// files of certificate chains of secure channel
+    const char *key[CONFIG_TLS_MAX_CERTS];  /// files of private keys of the certificates
+    size_t certs;                /// number of certificate and key pairs, 0 means built-in test one
+};
+
 /**
  * @brief The structure represents server context
  **/
@@ -116,6 +322,39 @@ struct server_s
 { 
     struct server_iface_s *iface; /// pointer to lower layer implementation server interace
     void *ctx;                    /// pointer to lower layer implementation server context data
+    struct server_conf_s conf;    /// runtime configuration
+    enum server_backend_e backend; /// kind of lower layer implementation
+    char *addr;                   /// address the server is bound to
+    int port;                     /// port the server is bound to
+    atomic_ulong accepted;        /// number of accepted connections
+    struct server_s *next;        /// next listener served by the same threads, NULL if none
+};
+
+/**
+ * @brief The structure represents part of file pending in output queue.
+ * It is sent right after the data queued before it, without copying to the buffer
+ **/
+struct conn_outfile_s
+{
+    size_t pos; /// position in the buffer the file is sent at
+    int fd;     /// descriptor owned by the queue
+    off_t off;  /// offset of the first pending byte in the file
+    size_t len; /// number of pending bytes in the file
+};
+
+/**
+ * @brief The structure represents output data that was not accepted by
+ * non-blocking connection channel yet and waits to be flushed
+ **/
+struct conn_outq_s
+{
+    char *buf;  /// pending data
+    size_t len; /// length of pending data
+    size_t off; /// offset of first byte that was not sent yet
+    size_t cap; /// capacity of the buffer
+    struct conn_outfile_s *files; /// pending files in order they are sent
+    size_t filenum;               /// number of pending files
+    size_t filecap;               /// capacity of the files array
 };
 
 /**
@@ -123,24 +362,50 @@ struct server_s
  **/
 struct conn_s
 {
+    struct server_s *srv;            /// server the connection is accepted by
     struct conn_iface_s *iface;      /// pointer to lower layer connection interface
     server_listen_handler_f handler; /// pointer higher layer data handler
     void *ctx;                       /// pointer to lower later connection context data
+    bool nonblock;                   /// connection channel is in non-blocking mode
+    bool closing;                    /// connection shall be closed once output is flushed
+    bool corked;                     /// output is collected in output queue to be sent at once
+    int handshake;                   /// state of pending handshake, 0 once channel is established
+    unsigned int events;             /// events the connection is subscribed for in event loop
+    int asyncfd;                     /// descriptor of background operation watched by event loop, or -1
+    struct timer_s timer;            /// deadline of connection in event loop
+    unsigned int deadline;           /// kind of deadline the timer is armed for
+    struct conn_outq_s outq;         /// output queue of non-blocking connection
+    char inbuf[CONFIG_INPUT_BUFF_LEN];  /// received data that was not consumed by handler yet
+    size_t inlen;                       /// length of data in input buffer
+    unsigned long requests;             /// number of requests handled on the connection
+    _Alignas(max_align_t) unsigned char proto[CONFIG_PROTO_CTX_LEN]; /// upper layer protocol state
 };
 
 /**
  * @brief Creates new server object
  * 
- * New server object will be created based on is_secure option.
- * if is secure == true, the server will use TLS implementation,
- * otherwise regular sockets will be used.
+ * New server object will be created based on backend option.
+ * The server may use TLS implementation, regular sockets or
+ * regular sockets driven by io_uring.
  * 
- * @param is_secure[in] - choose which kind of server will be created,
- * secure(TLS) or nonsecure(sockets)
+ * @param backend[in] - choose which kind of server will be created
  * 
  * @retval pointer to server object(server context) or NULL in case of error
  **/
-struct server_s *server_create(bool is_secure);
+struct server_s *server_create(enum server_backend_e backend);
+
+/**
+ * @brief Set server runtime configuration
+ * 
+ * Shall be called before server_listen, otherwise default configuration
+ * (thread per connection) is used
+ * 
+ * @param srv[in]  - server object/context
+ * @param conf[in] - configuration to apply
+ * 
+ * @retval 0 in case o success, negative value otherwise
+ **/
+int server_configure(struct server_s *srv, const struct server_conf_s *conf);
 
 /**
  * @brief Init server object/context
@@ -153,11 +418,31 @@ struct server_s *server_create(bool is_secure);
  **/
 int server_init(struct server_s *srv, char *addr, int port);
 
+/**
+ * @brief Attach listener to be served together with the server
+ * 
+ * Listener may have other backend (e.g. TLS next to plain sockets), while it
+ * shares threads of the server: acceptors and worker pool in **thread** and
+ * **pool** modes, event loops in **epoll** and **reuseport** modes. Its own
+ * configuration applies to its connections, so it shall be configured with
+ * the same mode and initialized before the call. Attached listener is closed
+ * together with the server.
+ * 
+ * @param srv[in]      - server object/context
+ * @param listener[in] - listener to attach
+ * 
+ * @retval 0 in case o success, negative value otherwise
+ **/
+int server_attach(struct server_s *srv, struct server_s *listener);
+
 /**
  * @brief Listen for new connections
  * 
  * The function listen for new connections in infinite loop. 
- * If new connection occures, it creates separate thread to handle incoming data
+ * If new connection occures, it is handled according to configured mode:
+ * in separate thread, in one of the pool workers, in the epoll reactor loop
+ * or in the reactor loop of one of SO_REUSEPORT listeners (one per worker).
+ * Attached listeners are served by the same threads
  * 
  * @param srv[in]     - server object/context
  * @param handler[in] - handler function that should handle incoming data on upper layer
@@ -184,10 +469,106 @@ int server_listen(struct server_s *srv, server_listen_handler_f handler);
  **/
 int server_send(struct conn_s *conn, void *buf, size_t len);
 
+/**
+ * @brief Create connection object for accepted connection context
+ * 
+ * @param srv[in]     - server the connection is accepted by
+ * @param iface[in]   - lower layer connection interface
+ * @param connctx[in] - lower layer connection context
+ * @param handler[in] - upper layer data handler
+ * 
+ * @retval pointer to connection object or NULL in case of error
+ **/
+struct conn_s *server_conn_create(struct server_s *srv, struct conn_iface_s *iface, void *connctx,
+                                  server_listen_handler_f handler);
+
+/**
+ * @brief Pass data collected in connection input buffer to upper layer handler
+ * 
+ * Handler is called while it consumes data, so several requests received
+ * at once are handled one by one. Responses to pipelined requests are
+ * collected and sent together. Unconsumed tail is kept for next call.
+ * 
+ * @param conn[in] - connection context
+ * 
+ * @retval 0 if connection shall remain open,
+ * negative value if connection shall be closed
+ **/
+int server_conn_process(struct conn_s *conn);
+
+/**
+ * @brief Advance handshake of connection channel if it is not established yet
+ * 
+ * @param conn[in] - connection context
+ * 
+ * @retval 0 if channel is established, SERVER_HANDSHAKE_WANT_READ or
+ * SERVER_HANDSHAKE_WANT_WRITE if handshake waits for the peer,
+ * negative errno value in case of error
+ **/
+int server_conn_handshake(struct conn_s *conn);
+
+/**
+ * @brief Flush output queue of non-blocking connection
+ * 
+ * @param conn[in] - connection context
+ * 
+ * @retval number of bytes that are still pending in case of success,
+ * negative errno value in case of error
+ **/
+int server_conn_flush(struct conn_s *conn);
+
+/**
+ * @brief Close connection and free connection object
+ * 
+ * @param conn[in] - connection context
+ **/
+void server_conn_close(struct conn_s *conn);
+
+/**
+ * @brief Send several buffers to client at once
+ * 
+ * Uses vectored send interface of lower layer if it is implemented,
+ * otherwise buffers are sent one by one
+ * 
+ * @param conn[in] - connection context
+ * @param iov[in] - array of buffers to send
+ * @param iovcnt[in] - number of buffers in the array
+ * 
+ * @retval num of sent bytes if everything is ok,
+ * negative errno value in case of error
+ **/
+int server_sendv(struct conn_s *conn, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Send part of file to client
+ * 
+ * Uses file sending interface of lower layer if it is implemented,
+ * otherwise the file is read and sent with regular send interface.
+ * The file is not closed by the function.
+ * 
+ * @param conn[in] - connection context
+ * @param fd[in] - descriptor of file to send
+ * @param offset[in] - offset in the file to send from
+ * @param len[in] - number of bytes to send
+ * 
+ * @retval num of sent bytes if everything is ok,
+ * negative errno value in case of error
+ **/
+int server_sendfile(struct conn_s *conn, int fd, off_t offset, size_t len);
+
+/**
+ * @brief Check if output of non-blocking connection waits to be flushed
+ * 
+ * @param conn[in] - connection context
+ * 
+ * @retval true if something is pending, false otherwise
+ **/
+bool server_conn_pending(struct conn_s *conn);
+
 /**
  * @brief Close server
  * 
- * Deinit close and free server resources
+ * Deinit close and free server resources, listeners attached to it as well
  * 
  * @param srv[in] - server object/context
  * 
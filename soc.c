@@ -2,12 +2,16 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "server.h"
 #include "config.h"
@@ -18,6 +22,9 @@
 struct servctx_s
 {
     int sockfd;
+    bool reuseport;
+    struct timeval rcvtimeo;
+    struct timeval sndtimeo;
 };
 
 struct connctx_s
@@ -56,6 +63,15 @@ static int soc_init(void *ctx, char *addr, int port)
         return -errno;
     }
 
+    /* Let sibling listeners bind the same address */
+    if(servctx->reuseport == true &&
+       setsockopt(servctx->sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        LOGERR("Fail to set socket reuseport option. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
     /* Set address */
     sockaddr.sin_family = AF_INET;
     sockaddr.sin_port = htons(port);
@@ -90,7 +106,6 @@ static int soc_init(void *ctx, char *addr, int port)
 static void *soc_accept(void *ctx)
 {
     struct servctx_s *servctx = (struct servctx_s *) ctx;
-    struct timeval tv = { .tv_sec = CONFIG_KEEPALIVE_TIMEOUT_SEC, .tv_usec = 0 };
     int conn = 0;
 
     if(ctx == NULL)
@@ -102,6 +117,12 @@ static void *soc_accept(void *ctx)
 
     /* Wait for new connection */
     conn = accept(servctx->sockfd, NULL, NULL);
+    if(conn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        /* Non-blocking listener has no pending connections */
+        return NULL;
+    }
+
     if(conn < 0)
     {
         LOGERR("Connection fail. Result: %s", strerror(errno));
@@ -111,11 +132,22 @@ static void *soc_accept(void *ctx)
 
     LOGINF("New connection %d", conn);
 
-    /* Set connection timout for recv call */
-    if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    /* Set connection timouts for recv and send calls */
+    if(setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &servctx->rcvtimeo, sizeof(servctx->rcvtimeo)) < 0)
     {
         LOGERR("Fail to set connection rcvtimeo option. Result: %s", strerror(errno));
 
+        close(conn);
+
+        return NULL;
+    }
+
+    if(setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &servctx->sndtimeo, sizeof(servctx->sndtimeo)) < 0)
+    {
+        LOGERR("Fail to set connection sndtimeo option. Result: %s", strerror(errno));
+
+        close(conn);
+
         return NULL;
     }
 
@@ -133,6 +165,145 @@ static void *soc_accept(void *ctx)
     return connctx;
 }
 
+static int soc_sendv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    struct msghdr msg = {0};
+    ssize_t sendlen = 0;
+
+    if(ctx == NULL || iov == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* All the buffers leave in one syscall */
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    sendlen = sendmsg(connctx->connfd, &msg, MSG_NOSIGNAL);
+    if(sendlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -EAGAIN;
+    }
+
+    if(sendlen < 0)
+    {
+        LOGERR("Fail to send. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    return sendlen;
+}
+
+static int soc_sendfile(void *ctx, int fd, off_t offset, size_t len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    ssize_t sendlen = 0;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* Data goes from page cache to socket directly, without copy to user space */
+    sendlen = sendfile(connctx->connfd, fd, &offset, len);
+    if(sendlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -EAGAIN;
+    }
+
+    if(sendlen < 0)
+    {
+        LOGERR("Fail to send file. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    return sendlen;
+}
+
+static int soc_nonblock_set(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0)
+    {
+        LOGERR("Fail to get descriptor flags. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        LOGERR("Fail to set non-blocking mode. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int soc_fd(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    return servctx->sockfd;
+}
+
+static int soc_nonblock(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    return soc_nonblock_set(servctx->sockfd);
+}
+
+static void soc_reuseport(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    servctx->reuseport = true;
+}
+
+static void soc_timeout(void *ctx, unsigned int recv, unsigned int send)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    servctx->rcvtimeo.tv_sec = recv;
+    servctx->sndtimeo.tv_sec = send;
+}
+
 static void soc_deinit(void *ctx)
 {
     struct servctx_s *servctx = (struct servctx_s *) ctx;
@@ -167,6 +338,11 @@ static int soc_recv(void *ctx, char *buf, size_t len)
     }
 
     len = recv(connctx->connfd, buf, len, 0);
+    if((ssize_t)len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -EAGAIN;
+    }
+
     if((ssize_t)len < 0)
     {
         LOGERR("Fail to receive data. Result: %s", strerror(errno));
@@ -188,7 +364,12 @@ static int soc_send(void *ctx, char *buf, size_t len)
         return -EINVAL;
     }
 
-    len = send(connctx->connfd, buf, len, 0);
+    len = send(connctx->connfd, buf, len, MSG_NOSIGNAL);
+    if((ssize_t)len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -EAGAIN;
+    }
+
     if((ssize_t)len < 0)
     {
         LOGERR("Fail to send. Result: %s", strerror(errno));
@@ -199,6 +380,34 @@ static int soc_send(void *ctx, char *buf, size_t len)
     return len;
 }
 
+static int soc_conn_fd(void *ctx)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    return connctx->connfd;
+}
+
+static int soc_conn_nonblock(void *ctx)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    return soc_nonblock_set(connctx->connfd);
+}
+
 static void soc_conn_close(void *ctx)
 {
     struct connctx_s *connctx = (struct connctx_s *) ctx;
@@ -222,9 +431,13 @@ static void soc_conn_close(void *ctx)
 
 const static struct conn_iface_s conn_iface =
 {
-    .recv  = soc_recv,
-    .send  = soc_send,
-    .close = soc_conn_close
+    .recv     = soc_recv,
+    .send     = soc_send,
+    .sendv    = soc_sendv,
+    .sendfile = soc_sendfile,
+    .fd       = soc_conn_fd,
+    .nonblock = soc_conn_nonblock,
+    .close    = soc_conn_close
 };
 
 static struct conn_iface_s *soc_conn_iface_get(void)
@@ -236,6 +449,10 @@ const static struct server_iface_s serv_iface =
 {
     .init       = soc_init,
     .accept     = soc_accept,
+    .fd         = soc_fd,
+    .nonblock   = soc_nonblock,
+    .reuseport  = soc_reuseport,
+    .timeout    = soc_timeout,
     .deinit     = soc_deinit,
     .conn_iface = soc_conn_iface_get
 };
@@ -257,5 +474,9 @@ void *soc_serv_ctx_alloc(void)
         return NULL;
     }
 
+    servctx->reuseport = false;
+    servctx->rcvtimeo = (struct timeval){ .tv_sec = 0, .tv_usec = 0 };
+    servctx->sndtimeo = (struct timeval){ .tv_sec = 0, .tv_usec = 0 };
+
     return servctx;
 }
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "stats"
+
+struct stats_reporter_s
+{
+    stats_report_f report;
+    void *arg;
+};
+
+static struct stats_reporter_s reporters[CONFIG_STATS_MAX_REPORTERS];
+static size_t reporters_num = 0;
+static pthread_mutex_t reporters_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int report_period = 0;
+
+int stats_register(stats_report_f report, void *arg)
+{
+    int result = 0;
+
+    if (report == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&reporters_lock);
+
+    if (reporters_num < CONFIG_STATS_MAX_REPORTERS)
+    {
+        reporters[reporters_num].report = report;
+        reporters[reporters_num].arg = arg;
+        reporters_num++;
+    }
+    else
+    {
+        LOGERR("Reporter table is full (%d), counters are not reported. "
+               "Increase CONFIG_STATS_MAX_REPORTERS", CONFIG_STATS_MAX_REPORTERS);
+
+        result = -ENOMEM;
+    }
+
+    pthread_mutex_unlock(&reporters_lock);
+
+    return result;
+}
+
+void stats_unregister(stats_report_f report, void *arg)
+{
+    pthread_mutex_lock(&reporters_lock);
+
+    for (size_t i = 0; i < reporters_num; i++)
+    {
+        if (reporters[i].report == report && reporters[i].arg == arg)
+        {
+            /* Keep reporters in registration order */
+            memmove(&reporters[i], &reporters[i + 1], (reporters_num - i - 1) * sizeof(reporters[0]));
+            reporters_num--;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&reporters_lock);
+}
+
+static void *stats_thread(void *data)
+{
+    while (1)
+    {
+        sleep(report_period);
+
+        pthread_mutex_lock(&reporters_lock);
+
+        for (size_t i = 0; i < reporters_num; i++)
+        {
+            reporters[i].report(reporters[i].arg);
+        }
+
+        pthread_mutex_unlock(&reporters_lock);
+
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+int stats_start(unsigned int period)
+{
+    pthread_t thread = 0;
+    int result = 0;
+
+    if (period == 0)
+    {
+        return 0;
+    }
+
+    report_period = period;
+
+    result = pthread_create(&thread, NULL, stats_thread, NULL);
+    if (result != 0)
+    {
+        LOGERR("Fail to create stats thread. Result %d", result);
+
+        return -result;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * @file stats.h
+ * @brief This module periodically reports runtime counters of other modules
+ * 
+ * Modules register their report functions, which are called one by one
+ * from a separate thread with configured period
+ **/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+/**
+ * @brief Function type that reports counters of a module to the log
+ * 
+ * @param arg[in] - argument specified on registration
+ **/
+typedef void (*stats_report_f)(void *arg);
+
+/**
+ * @brief Register report function
+ * 
+ * @param report[in] - function to call every report period
+ * @param arg[in]    - argument to pass to the function
+ * 
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int stats_register(stats_report_f report, void *arg);
+
+/**
+ * @brief Unregister report function. Function is not called after return
+ * 
+ * @param report[in] - function specified on registration
+ * @param arg[in]    - argument specified on registration
+ **/
+void stats_unregister(stats_report_f report, void *arg);
+
+/**
+ * @brief Start periodic reporting
+ * 
+ * @param period[in] - report period in seconds, 0 disables reporting
+ * 
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int stats_start(unsigned int period);
+
+#endif
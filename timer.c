@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timer.h"
+
+#define TIMER_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* Maximum distance to expiry in ticks that wheels are able to hold */
+#define TIMER_MAX_DELTA ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static void timer_list_init(struct timer_s *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void timer_list_add(struct timer_s *head, struct timer_s *timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_list_del(struct timer_s *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void timer_place(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    unsigned int level = 0;
+
+    /* Timer that is already late goes to the slot that is handled next */
+    if (timer->expires < wheel->now)
+    {
+        delta = 0;
+        timer->expires = wheel->now;
+    }
+
+    /* Find the innermost wheel that covers the distance */
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    timer_list_add(&wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK],
+                   timer);
+}
+
+void timer_wheel_init(struct timer_wheel_s *wheel, uint64_t now, unsigned int tick)
+{
+    memset(wheel, 0, sizeof(*wheel));
+
+    wheel->start = now;
+    wheel->tick = tick;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            timer_list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+bool timer_pending(const struct timer_s *timer)
+{
+    return timer->next != NULL;
+}
+
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer)
+{
+    if (timer_pending(timer) == false)
+    {
+        return;
+    }
+
+    timer_list_del(timer);
+    wheel->count--;
+}
+
+void timer_add(struct timer_wheel_s *wheel, struct timer_s *timer, uint64_t timeout)
+{
+    uint64_t delta = (timeout + wheel->tick - 1) / wheel->tick;
+
+    timer_cancel(wheel, timer);
+
+    /* Timer never expires in the current tick, it is handled already */
+    if (delta == 0)
+    {
+        delta = 1;
+    }
+
+    if (delta > TIMER_MAX_DELTA)
+    {
+        delta = TIMER_MAX_DELTA;
+    }
+
+    timer->expires = wheel->now + delta;
+
+    timer_place(wheel, timer);
+    wheel->count++;
+}
+
+static void timer_cascade(struct timer_wheel_s *wheel, unsigned int level, unsigned int slot)
+{
+    struct timer_s list;
+    struct timer_s *head = &wheel->slots[level][slot];
+    struct timer_s *timer = NULL;
+
+    if (head->next == head)
+    {
+        return;
+    }
+
+    /* Detach whole slot, since timers may be placed back to the same one */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timer_list_init(head);
+
+    while (list.next != &list)
+    {
+        timer = list.next;
+        timer_list_del(timer);
+        timer_place(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel_s *wheel, uint64_t now,
+                         timer_expire_f expire, void *arg)
+{
+    struct timer_s *head = NULL;
+    struct timer_s *timer = NULL;
+    uint64_t target = 0;
+    unsigned int level = 0;
+
+    if (now < wheel->start)
+    {
+        return;
+    }
+
+    target = (now - wheel->start) / wheel->tick;
+
+    while (wheel->now < target)
+    {
+        /* Nothing to expire, so just jump */
+        if (wheel->count == 0)
+        {
+            wheel->now = target;
+
+            break;
+        }
+
+        wheel->now++;
+
+        /* Once inner wheel turns around, bring the next slot of outer one closer */
+        for (level = 1;
+             level < TIMER_WHEEL_LEVELS &&
+             (wheel->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) == 0;
+             level++)
+        {
+            timer_cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK);
+        }
+
+        head = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+
+        /* Callback is free to add and cancel other timers */
+        while (head->next != head)
+        {
+            timer = head->next;
+            timer_list_del(timer);
+            wheel->count--;
+
+            expire(timer, arg);
+        }
+    }
+}
+
+int timer_wheel_timeout(const struct timer_wheel_s *wheel, uint64_t now)
+{
+    uint64_t ticks = 0;
+    uint64_t deadline = 0;
+    const struct timer_s *head = NULL;
+
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+
+    /* Look for the nearest timer in the inner wheel, otherwise wake up
+        when it turns around and outer wheel is cascaded */
+    for (ticks = 1; ticks < TIMER_WHEEL_SLOTS; ticks++)
+    {
+        head = &wheel->slots[0][(wheel->now + ticks) & TIMER_SLOT_MASK];
+        if (head->next != head)
+        {
+            break;
+        }
+
+        if (((wheel->now + ticks) & TIMER_SLOT_MASK) == 0)
+        {
+            break;
+        }
+    }
+
+    deadline = wheel->start + (wheel->now + ticks) * wheel->tick;
+
+    return deadline > now ? (int)(deadline - now) : 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file timer.h
+ * @brief This module implements hierarchical timer wheel
+ *
+ * The module do following:
+ *  - keep timers in slots of several wheels, each next wheel covers
+ *    the whole range of previous one with one slot
+ *  - add and cancel timers in constant time
+ *  - expire timers and move timers of outer wheels closer as time goes
+ *
+ * Timers are embedded into objects they belong to, so the wheel does not
+ * allocate memory. The wheel is not thread safe, each thread shall use its own.
+ **/
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Number of bits of time that is covered by one wheel */
+#define TIMER_WHEEL_BITS 6
+
+/** Number of slots in one wheel */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/** Number of wheels */
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * @brief The structure represents timer
+ **/
+struct timer_s
+{
+    struct timer_s *next; /// next timer in the slot, NULL if timer is not armed
+    struct timer_s *prev; /// previous timer in the slot
+    uint64_t expires;     /// tick when timer expires
+};
+
+/**
+ * @brief The structure represents timer wheel
+ **/
+struct timer_wheel_s
+{
+    uint64_t now;       /// current tick
+    uint64_t start;     /// time of tick 0 in milliseconds
+    unsigned int tick;  /// length of tick in milliseconds
+    size_t count;       /// number of armed timers
+    struct timer_s slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /// heads of slot lists
+};
+
+/**
+ * @brief Function type that is called for expired timer
+ *
+ * @param timer[in] - expired timer, it is not armed anymore
+ * @param arg[in] - argument passed to timer_wheel_advance
+ **/
+typedef void (*timer_expire_f)(struct timer_s *timer, void *arg);
+
+/**
+ * @brief Init timer wheel
+ *
+ * @param wheel[in] - timer wheel
+ * @param now[in] - current time in milliseconds
+ * @param tick[in] - length of tick in milliseconds
+ **/
+void timer_wheel_init(struct timer_wheel_s *wheel, uint64_t now, unsigned int tick);
+
+/**
+ * @brief Arm timer, or re-arm it if it is already armed
+ *
+ * @param wheel[in] - timer wheel
+ * @param timer[in] - timer
+ * @param timeout[in] - timeout in milliseconds
+ **/
+void timer_add(struct timer_wheel_s *wheel, struct timer_s *timer, uint64_t timeout);
+
+/**
+ * @brief Disarm timer, does nothing if timer is not armed
+ *
+ * @param wheel[in] - timer wheel
+ * @param timer[in] - timer
+ **/
+void timer_cancel(struct timer_wheel_s *wheel, struct timer_s *timer);
+
+/**
+ * @brief Check if timer is armed
+ *
+ * @param timer[in] - timer
+ *
+ * @retval true if timer is armed, false otherwise
+ **/
+bool timer_pending(const struct timer_s *timer);
+
+/**
+ * @brief Move time of wheel forward and expire timers
+ *
+ * @param wheel[in] - timer wheel
+ * @param now[in] - current time in milliseconds
+ * @param expire[in] - function to call for every expired timer
+ * @param arg[in] - argument to pass to the function
+ **/
+void timer_wheel_advance(struct timer_wheel_s *wheel, uint64_t now,
+                         timer_expire_f expire, void *arg);
+
+/**
+ * @brief Calculate how long it is possible to wait before next call of timer_wheel_advance
+ *
+ * @param wheel[in] - timer wheel
+ * @param now[in] - current time in milliseconds
+ *
+ * @retval time in milliseconds, or -1 if there are no armed timers
+ **/
+int timer_wheel_timeout(const struct timer_wheel_s *wheel, uint64_t now);
+
+#endif
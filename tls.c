@@ -2,293 +2,2164 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
 
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/x509.h"
 #include "mbedtls/ssl.h"
 #include "mbedtls/ssl_cookie.h"
+#include "mbedtls/ssl_ticket.h"
+#include "mbedtls/ssl_cache.h"
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/error.h"
 #include "mbedtls/debug.h"
 #include "mbedtls/timing.h"
+#include "mbedtls/platform_util.h"
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+#include "psa/crypto.h"
+#endif
 
 #include "test/certs.h"
 
 #include "server.h"
 #include "config.h"
+#include "pool.h"
+#include "stats.h"
 #include "log.h"
 
 #define MODULE_NAME "tls"
 
-struct servctx_s
-{
-    mbedtls_net_context listen_fd;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_config conf;
-    mbedtls_x509_crt srvcert;
-    mbedtls_pk_context pkey;
-    mbedtls_ssl_cookie_ctx cookie_ctx;
-};
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/* Private key operations are passed to signing pool if library supports it */
+#if defined(MBEDTLS_SSL_ASYNC_PRIVATE) && CONFIG_TLS_SIGN_WORKERS > 0
+#define TLS_ASYNC 1
+#else
+#define TLS_ASYNC 0
+#endif
+
+/* Early data is accepted on resumed TLS 1.3 sessions if library supports it */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_SSL_EARLY_DATA) && CONFIG_TLS_EARLY_DATA_MAX_SIZE > 0
+#define TLS_EARLY_DATA 1
+#else
+#define TLS_EARLY_DATA 0
+#endif
+
+/* Idle connections are serialized and give their context back if library supports it */
+#if defined(MBEDTLS_SSL_CONTEXT_SERIALIZATION)
+#define TLS_SLEEP 1
+#else
+#define TLS_SLEEP 0
+#endif
+
+/* Approximate memory held by set up context: the structure and both record buffers */
+#define TLS_CONTEXT_MEM (sizeof(mbedtls_ssl_context) + MBEDTLS_SSL_IN_CONTENT_LEN + MBEDTLS_SSL_OUT_CONTENT_LEN)
+
+/* Number of slots of replay register a ticket may occupy */
+#define TLS_REPLAY_PROBES 8
+
+/* By the end of TLS 1.2 handshake server has protected exactly one record (Finished) */
+#define TLS_KTLS_REC_SEQ 1
+
+struct servctx_s
+{
+    mbedtls_net_context listen_fd;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt srvcert[CONFIG_TLS_MAX_CERTS];
+    mbedtls_pk_context pkey[CONFIG_TLS_MAX_CERTS];
+    const char *certfile[CONFIG_TLS_MAX_CERTS];
+    const char *keyfile[CONFIG_TLS_MAX_CERTS];
+    size_t certs;
+    mbedtls_ssl_cookie_ctx cookie_ctx;
+    mbedtls_ssl_context *pool[CONFIG_TLS_CONTEXT_POOL_SIZE]; /// contexts that are set up and not in use
+    size_t pooled;
+    pthread_mutex_t pool_lock;
+    bool reuseport;
+    struct timeval rcvtimeo;
+    struct timeval sndtimeo;
+};
+
+/**
+ * @brief Private key operation of a connection performed by signing pool
+ *
+ * Shared by connection and signing worker, released by the last of them,
+ * so connection may be closed while operation is in progress
+ **/
+struct tls_async_s
+{
+    atomic_int refs;
+    int efd;                       /// becomes readable once operation is done
+    mbedtls_pk_context *pkey;      /// key of the certificate selected by handshake
+    bool sign;                     /// signature, decryption otherwise
+    mbedtls_md_type_t md_alg;      /// hash algorithm of signature
+    unsigned char input[MBEDTLS_PK_SIGNATURE_MAX_SIZE];  /// hash to sign or data to decrypt
+    size_t input_len;
+    unsigned char output[MBEDTLS_PK_SIGNATURE_MAX_SIZE]; /// signature or decrypted data
+    size_t output_len;
+    int result;
+    atomic_bool done;
+};
+
+struct connctx_s
+{
+    mbedtls_net_context client_fd;
+    mbedtls_timing_delay_context timer;
+    mbedtls_ssl_context *ssl;          /// NULL while connection sleeps
+    struct servctx_s *servctx;
+    bool nonblock;
+    size_t record_small;               /// payload of record that fits one TCP segment
+    size_t record_large;               /// maximum payload of record
+    size_t record_boost;               /// amount of data left to send in small records
+    size_t record_pending;             /// length of record that is not flushed yet, 0 if none
+    uint64_t record_last;              /// time of the last write in milliseconds
+    bool responded;                    /// something is written since the last read
+#if TLS_ASYNC
+    struct tls_async_s *async;         /// private key operation, allocated on first use
+#endif
+#if TLS_SLEEP
+    unsigned char *saved;              /// serialized context of sleeping connection
+    size_t saved_len;
+#endif
+#if TLS_EARLY_DATA
+    unsigned char *early;              /// early data received by handshake, NULL once it is read
+    size_t early_len;                  /// length of early data
+    size_t early_pos;                  /// position of the next byte of early data to read
+    size_t early_left;                 /// amount of early data not taken by requests yet
+#endif
+#if CONFIG_TLS_KTLS
+    bool ktls;                         /// records are encrypted by kernel
+    bool secret_valid;                 /// master secret is exported by handshake
+    mbedtls_tls_prf_types prf;         /// PRF to expand master secret with
+    unsigned char secret[48];          /// TLS 1.2 master secret
+    unsigned char randbytes[64];       /// server and client randoms
+#endif
+};
+
+static char *tls_error(int error)
+{
+    static char error_buf[100];
+
+    mbedtls_strerror(error, error_buf, 100);
+
+    return error_buf;
+}
+
+/**
+ * @brief Ticket that carried early data within replay window
+ **/
+struct tls_replay_s
+{
+    uint64_t hash;                     /// hash of encrypted ticket
+    uint64_t expires;                  /// time in milliseconds the slot is free again
+};
+
+/**
+ * @brief Session resumption state shared by all TLS listeners of the process,
+ * so a client resumes no matter which listener (or reuseport sibling) it hits
+ **/
+struct tls_session_s
+{
+    mbedtls_ssl_ticket_context ticket;
+    pthread_mutex_t ticket_lock;
+#if CONFIG_TLS_SESSION_CACHE_SIZE > 0
+    mbedtls_ssl_cache_context cache[CONFIG_TLS_SESSION_CACHE_SHARDS];
+    pthread_mutex_t cache_lock[CONFIG_TLS_SESSION_CACHE_SHARDS];
+#endif
+#if TLS_EARLY_DATA
+    struct tls_replay_s replay[CONFIG_TLS_EARLY_DATA_REPLAY_SLOTS];
+    pthread_mutex_t replay_lock;
+#endif
+    atomic_uint_fast64_t handshakes;
+    atomic_uint_fast64_t ticket_hits;
+    atomic_uint_fast64_t ticket_misses;
+    atomic_uint_fast64_t cache_hits;
+    atomic_uint_fast64_t cache_misses;
+    atomic_uint_fast64_t ktls_offloaded;
+    atomic_uint_fast64_t ktls_fallback;
+    atomic_uint_fast64_t sign_async;
+    atomic_uint_fast64_t sign_inline;
+    atomic_uint_fast64_t records;
+    atomic_uint_fast64_t records_small;
+    atomic_uint_fast64_t responses;
+    atomic_uint_fast64_t early_accepted;
+    atomic_uint_fast64_t early_replayed;
+    atomic_uint_fast64_t connections;
+    atomic_uint_fast64_t contexts;
+    atomic_uint_fast64_t contexts_pooled;
+    atomic_uint_fast64_t sleeping;
+    atomic_uint_fast64_t sleeping_bytes;
+    int result;
+};
+
+static mbedtls_entropy_context entropy;
+static pthread_mutex_t entropy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t entropy_once = PTHREAD_ONCE_INIT;
+static pthread_key_t drbg_key;
+static __thread mbedtls_ctr_drbg_context *drbg = NULL;
+
+static struct tls_session_s session;
+static pthread_once_t session_once = PTHREAD_ONCE_INIT;
+
+static void tls_drbg_free(void *data)
+{
+    mbedtls_ctr_drbg_free((mbedtls_ctr_drbg_context *)data);
+    free(data);
+}
+
+static void tls_entropy_init(void)
+{
+    mbedtls_entropy_init(&entropy);
+
+    /* Generator of a connection thread is released once the thread exits */
+    pthread_key_create(&drbg_key, tls_drbg_free);
+}
+
+static int tls_entropy(void *ctx, unsigned char *buf, size_t len)
+{
+    int result = 0;
+
+    /* Entropy pool is shared, but it is touched on (re)seeding only */
+    pthread_mutex_lock(&entropy_lock);
+    result = mbedtls_entropy_func(&entropy, buf, len);
+    pthread_mutex_unlock(&entropy_lock);
+
+    return result;
+}
+
+/**
+ * @brief Random number generator of TLS layer
+ *
+ * Every thread owns its CTR-DRBG, seeded from the shared entropy source on the
+ * first use, so handshakes running in parallel do not contend for one generator.
+ * Generator reseeds itself every CONFIG_TLS_DRBG_RESEED_INTERVAL requests.
+ **/
+static int tls_random(void *ctx, unsigned char *buf, size_t len)
+{
+    char pers[32] = {0};
+    int result = 0;
+
+    if(drbg == NULL)
+    {
+        pthread_once(&entropy_once, tls_entropy_init);
+
+        drbg = malloc(sizeof(mbedtls_ctr_drbg_context));
+        if(drbg == NULL)
+        {
+            LOGERR("Fail to allocate memory for random number generator");
+
+            return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+        }
+
+        mbedtls_ctr_drbg_init(drbg);
+
+        /* Thread identity makes generators differ even with the same entropy */
+        snprintf(pers, sizeof(pers), "tls_drbg_%lu", (unsigned long)pthread_self());
+
+        result = mbedtls_ctr_drbg_seed(drbg, tls_entropy, NULL, (const unsigned char *)pers, strlen(pers));
+        if(result < 0)
+        {
+            LOGERR("Fail to seed random number generator. Result: %s", tls_error(result));
+
+            tls_drbg_free(drbg);
+            drbg = NULL;
+
+            return result;
+        }
+
+        mbedtls_ctr_drbg_set_reseed_interval(drbg, CONFIG_TLS_DRBG_RESEED_INTERVAL);
+        pthread_setspecific(drbg_key, drbg);
+    }
+
+    return mbedtls_ctr_drbg_random(drbg, buf, len);
+}
+
+static uint64_t tls_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int tls_ticket_write(void *ctx, const mbedtls_ssl_session *ssn, unsigned char *start,
+                            const unsigned char *end, size_t *tlen, uint32_t *lifetime)
+{
+    int result = 0;
+
+    /* Keys may be rotated here, so the context is not shared without lock */
+    pthread_mutex_lock(&session.ticket_lock);
+    result = mbedtls_ssl_ticket_write(ctx, ssn, start, end, tlen, lifetime);
+    pthread_mutex_unlock(&session.ticket_lock);
+
+    return result;
+}
+
+#if TLS_EARLY_DATA
+static uint64_t tls_replay_hash(const unsigned char *buf, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ buf[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Remember ticket that is about to carry early data
+ *
+ * Library rejects tickets whose age differs from the one claimed by client
+ * by more than MBEDTLS_SSL_TLS1_3_TICKET_AGE_TOLERANCE, so a ClientHello
+ * replayed later than the window is not resumed at all. Within the window
+ * every ticket carries early data only once.
+ *
+ * @retval true if early data of this ticket shall be rejected
+ **/
+static bool tls_replay_seen(uint64_t hash)
+{
+    uint64_t now = tls_now();
+    struct tls_replay_s *entry = NULL;
+    struct tls_replay_s *free = NULL;
+    bool seen = false;
+
+    pthread_mutex_lock(&session.replay_lock);
+
+    for(size_t i = 0; i < TLS_REPLAY_PROBES && seen == false; i++)
+    {
+        entry = &session.replay[(hash + i) % CONFIG_TLS_EARLY_DATA_REPLAY_SLOTS];
+        if(entry->expires <= now)
+        {
+            free = free == NULL ? entry : free;
+        }
+        else if(entry->hash == hash)
+        {
+            seen = true;
+        }
+    }
+
+    /* Ticket that can not be remembered is treated as replayed */
+    if(seen == false && free == NULL)
+    {
+        seen = true;
+    }
+    else if(seen == false)
+    {
+        free->hash = hash;
+        free->expires = now + CONFIG_TLS_EARLY_DATA_REPLAY_WINDOW_SEC * 1000;
+    }
+
+    pthread_mutex_unlock(&session.replay_lock);
+
+    return seen;
+}
+#endif
+
+static int tls_ticket_parse(void *ctx, mbedtls_ssl_session *ssn, unsigned char *buf, size_t len)
+{
+    int result = 0;
+#if TLS_EARLY_DATA
+    /* Ticket is decrypted in place, so it is hashed beforehand */
+    uint64_t hash = tls_replay_hash(buf, len);
+#endif
+
+    pthread_mutex_lock(&session.ticket_lock);
+    result = mbedtls_ssl_ticket_parse(ctx, ssn, buf, len);
+    pthread_mutex_unlock(&session.ticket_lock);
+
+#if TLS_EARLY_DATA
+    /* Session is still resumed, client just sends the data again after handshake */
+    if(result == 0 && (ssn->MBEDTLS_PRIVATE(ticket_flags) & MBEDTLS_SSL_TLS1_3_TICKET_ALLOW_EARLY_DATA) != 0 &&
+       tls_replay_seen(hash) == true)
+    {
+        ssn->MBEDTLS_PRIVATE(ticket_flags) &= ~MBEDTLS_SSL_TLS1_3_TICKET_ALLOW_EARLY_DATA;
+
+        atomic_fetch_add_explicit(&session.early_replayed, 1, memory_order_relaxed);
+    }
+#endif
+
+    if(result == 0)
+    {
+        atomic_fetch_add_explicit(&session.ticket_hits, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&session.ticket_misses, 1, memory_order_relaxed);
+    }
+
+    return result;
+}
+
+#if CONFIG_TLS_SESSION_CACHE_SIZE > 0
+static size_t tls_cache_shard(const unsigned char *id, size_t len)
+{
+    size_t hash = 0;
+
+    /* Session ID is random, so a few bytes of it spread sessions well */
+    for(size_t i = 0; i < len && i < sizeof(hash); i++)
+    {
+        hash = (hash << 8) | id[i];
+    }
+
+    return hash % CONFIG_TLS_SESSION_CACHE_SHARDS;
+}
+
+static int tls_cache_get(void *ctx, unsigned char const *id, size_t len, mbedtls_ssl_session *ssn)
+{
+    size_t shard = tls_cache_shard(id, len);
+    int result = 0;
+
+    pthread_mutex_lock(&session.cache_lock[shard]);
+    result = mbedtls_ssl_cache_get(&session.cache[shard], id, len, ssn);
+    pthread_mutex_unlock(&session.cache_lock[shard]);
+
+    if(result == 0)
+    {
+        atomic_fetch_add_explicit(&session.cache_hits, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&session.cache_misses, 1, memory_order_relaxed);
+    }
+
+    return result;
+}
+
+static int tls_cache_set(void *ctx, unsigned char const *id, size_t len, const mbedtls_ssl_session *ssn)
+{
+    size_t shard = tls_cache_shard(id, len);
+    int result = 0;
+
+    pthread_mutex_lock(&session.cache_lock[shard]);
+    result = mbedtls_ssl_cache_set(&session.cache[shard], id, len, ssn);
+    pthread_mutex_unlock(&session.cache_lock[shard]);
+
+    return result;
+}
+#endif
+
+static void tls_session_stats_report(void *arg)
+{
+    uint64_t handshakes = atomic_load(&session.handshakes);
+    uint64_t resumed = atomic_load(&session.ticket_hits) + atomic_load(&session.cache_hits);
+    uint64_t records = atomic_load(&session.records);
+    uint64_t responses = atomic_load(&session.responses);
+    uint64_t connections = atomic_load(&session.connections);
+    uint64_t contexts = atomic_load(&session.contexts);
+    uint64_t pooled = atomic_load(&session.contexts_pooled);
+    uint64_t memory = 0;
+
+    /* Pool may be counted ahead of contexts for a moment */
+    pooled = pooled < contexts ? pooled : contexts;
+    memory = (contexts - pooled) * TLS_CONTEXT_MEM + atomic_load(&session.sleeping_bytes) +
+             connections * sizeof(struct connctx_s);
+
+    LOGINF("handshakes %lu, resumed %lu (%lu%%), tickets %lu/%lu, cache %lu/%lu (hits/misses), "
+           "kTLS %lu/%lu (offloaded/fallback), private key %lu/%lu (async/inline), "
+           "records %lu (%lu small), %lu.%02lu per response, early data %lu/%lu (accepted/replayed), "
+           "connections %lu (%lu sleeping), contexts %lu (%lu pooled), "
+           "memory %lu KB (%lu bytes per connection), pooled %lu KB",
+           handshakes, resumed, handshakes > 0 ? resumed * 100 / handshakes : 0,
+           atomic_load(&session.ticket_hits), atomic_load(&session.ticket_misses),
+           atomic_load(&session.cache_hits), atomic_load(&session.cache_misses),
+           atomic_load(&session.ktls_offloaded), atomic_load(&session.ktls_fallback),
+           atomic_load(&session.sign_async), atomic_load(&session.sign_inline),
+           records, atomic_load(&session.records_small),
+           responses > 0 ? records / responses : 0, responses > 0 ? records * 100 / responses % 100 : 0,
+           atomic_load(&session.early_accepted), atomic_load(&session.early_replayed),
+           connections, atomic_load(&session.sleeping), contexts, pooled,
+           memory / 1024, connections > 0 ? memory / connections : 0, pooled * TLS_CONTEXT_MEM / 1024);
+}
+
+static void tls_session_init(void)
+{
+    int result = 0;
+
+    mbedtls_ssl_ticket_init(&session.ticket);
+    pthread_mutex_init(&session.ticket_lock, NULL);
+
+    /* Ticket context renews its key every lifetime and keeps the previous
+        one, so tickets issued just before rotation are still accepted */
+    result = mbedtls_ssl_ticket_setup(&session.ticket, tls_random, NULL,
+                                      MBEDTLS_CIPHER_AES_256_GCM, CONFIG_TLS_TICKET_LIFETIME_SEC);
+    if(result < 0)
+    {
+        LOGERR("Fail to setup session tickets. Result: %s", tls_error(result));
+
+        session.result = result;
+
+        return;
+    }
+
+#if CONFIG_TLS_SESSION_CACHE_SIZE > 0
+    for(size_t i = 0; i < CONFIG_TLS_SESSION_CACHE_SHARDS; i++)
+    {
+        mbedtls_ssl_cache_init(&session.cache[i]);
+        mbedtls_ssl_cache_set_timeout(&session.cache[i], CONFIG_TLS_SESSION_CACHE_TIMEOUT_SEC);
+        mbedtls_ssl_cache_set_max_entries(&session.cache[i],
+            (CONFIG_TLS_SESSION_CACHE_SIZE + CONFIG_TLS_SESSION_CACHE_SHARDS - 1) / CONFIG_TLS_SESSION_CACHE_SHARDS);
+        pthread_mutex_init(&session.cache_lock[i], NULL);
+    }
+#endif
+
+#if TLS_EARLY_DATA
+    pthread_mutex_init(&session.replay_lock, NULL);
+#endif
+
+    stats_register(tls_session_stats_report, NULL);
+}
+
+static int tls_session_conf(mbedtls_ssl_config *conf)
+{
+    pthread_once(&session_once, tls_session_init);
+
+    if(session.result < 0)
+    {
+        return session.result;
+    }
+
+    mbedtls_ssl_conf_session_tickets_cb(conf, tls_ticket_write, tls_ticket_parse, &session.ticket);
+
+#if CONFIG_TLS_SESSION_CACHE_SIZE > 0
+    mbedtls_ssl_conf_session_cache(conf, &session, tls_cache_get, tls_cache_set);
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* Resumption keeps forward secrecy, PSK is always combined with ECDHE */
+    mbedtls_ssl_conf_tls13_key_exchange_modes(conf, MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_EPHEMERAL |
+                                                    MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_EPHEMERAL);
+#endif
+
+#if TLS_EARLY_DATA
+    mbedtls_ssl_conf_early_data(conf, MBEDTLS_SSL_EARLY_DATA_ENABLED);
+    mbedtls_ssl_conf_max_early_data_size(conf, CONFIG_TLS_EARLY_DATA_MAX_SIZE);
+#endif
+
+    return 0;
+}
+
+#if TLS_EARLY_DATA
+static int tls_early_read(struct connctx_s *connctx)
+{
+    int result = 0;
+
+    if(connctx->early == NULL)
+    {
+        connctx->early = malloc(CONFIG_TLS_EARLY_DATA_MAX_SIZE);
+        if(connctx->early == NULL)
+        {
+            LOGERR("Fail to allocate memory for early data");
+
+            return -ENOMEM;
+        }
+
+        atomic_fetch_add_explicit(&session.early_accepted, 1, memory_order_relaxed);
+    }
+
+    /* Library does not accept more early data than the buffer holds */
+    result = mbedtls_ssl_read_early_data(connctx->ssl, connctx->early + connctx->early_len,
+                                         CONFIG_TLS_EARLY_DATA_MAX_SIZE - connctx->early_len);
+    if(result < 0)
+    {
+        LOGERR("Fail to read early data. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    connctx->early_len += result;
+    connctx->early_left = connctx->early_len;
+
+    return 0;
+}
+
+static int tls_early_recv(struct connctx_s *connctx, char *buf, size_t len)
+{
+    if(len > connctx->early_len - connctx->early_pos)
+    {
+        len = connctx->early_len - connctx->early_pos;
+    }
+
+    memcpy(buf, connctx->early + connctx->early_pos, len);
+    connctx->early_pos += len;
+
+    if(connctx->early_pos == connctx->early_len)
+    {
+        free(connctx->early);
+        connctx->early = NULL;
+    }
+
+    connctx->responded = false;
+
+    return len;
+}
+#endif
+
+/* The first write since the last read starts response to the request */
+static void tls_responded(struct connctx_s *connctx)
+{
+    if(connctx->responded == false)
+    {
+        connctx->responded = true;
+
+        atomic_fetch_add_explicit(&session.responses, 1, memory_order_relaxed);
+    }
+}
+
+#if CONFIG_TLS_KTLS
+static void tls_export_keys(void *ctx, mbedtls_ssl_key_export_type type,
+                            const unsigned char *secret, size_t secret_len,
+                            const unsigned char client_random[32],
+                            const unsigned char server_random[32],
+                            mbedtls_tls_prf_types prf)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(type != MBEDTLS_SSL_KEY_EXPORT_TLS12_MASTER_SECRET || secret_len != sizeof(connctx->secret))
+    {
+        return;
+    }
+
+    /* Key expansion takes server random first */
+    memcpy(connctx->secret, secret, secret_len);
+    memcpy(connctx->randbytes, server_random, 32);
+    memcpy(connctx->randbytes + 32, client_random, 32);
+    connctx->prf = prf;
+    connctx->secret_valid = true;
+}
+
+static int tls_ktls_setup(struct connctx_s *connctx)
+{
+    union
+    {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    unsigned char keyblk[2 * 32 + 2 * 12];
+    unsigned char rec_seq[8] = {0, 0, 0, 0, 0, 0, 0, TLS_KTLS_REC_SEQ};
+    const char *suite = mbedtls_ssl_get_ciphersuite(connctx->ssl);
+    unsigned char *key = NULL;
+    unsigned char *iv = NULL;
+    size_t keylen = 0;
+    size_t ivlen = 0;
+    size_t infolen = 0;
+    int result = 0;
+
+    if(connctx->secret_valid == false ||
+       mbedtls_ssl_get_version_number(connctx->ssl) != MBEDTLS_SSL_VERSION_TLS1_2)
+    {
+        return -ENOTSUP;
+    }
+
+    memset(&info, 0, sizeof(info));
+
+    if(strstr(suite, "AES-128-GCM") != NULL)
+    {
+        keylen = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+        ivlen = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        infolen = sizeof(info.gcm128);
+    }
+    else if(strstr(suite, "AES-256-GCM") != NULL)
+    {
+        keylen = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+        ivlen = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        infolen = sizeof(info.gcm256);
+    }
+    else if(strstr(suite, "CHACHA20-POLY1305") != NULL)
+    {
+        keylen = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+        ivlen = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        infolen = sizeof(info.chacha);
+    }
+    else
+    {
+        return -ENOTSUP;
+    }
+
+    info.gcm128.info.version = TLS_1_2_VERSION;
+
+    /* AEAD key block: client key, server key, client IV, server IV */
+    result = mbedtls_ssl_tls_prf(connctx->prf, connctx->secret, sizeof(connctx->secret), "key expansion",
+                                 connctx->randbytes, sizeof(connctx->randbytes), keyblk, 2 * keylen + 2 * ivlen);
+    if(result < 0)
+    {
+        LOGERR("Fail to expand keys. Result: %s", tls_error(result));
+
+        return -EPROTO;
+    }
+
+    key = keyblk + keylen;
+    iv = keyblk + 2 * keylen + ivlen;
+
+    if(info.gcm128.info.cipher_type == TLS_CIPHER_CHACHA20_POLY1305)
+    {
+        memcpy(info.chacha.key, key, keylen);
+        memcpy(info.chacha.iv, iv, ivlen);
+        memcpy(info.chacha.rec_seq, rec_seq, sizeof(rec_seq));
+    }
+    else if(info.gcm128.info.cipher_type == TLS_CIPHER_AES_GCM_256)
+    {
+        /* Explicit nonce of mbedtls records is the sequence number, kernel goes on with it */
+        memcpy(info.gcm256.key, key, keylen);
+        memcpy(info.gcm256.salt, iv, ivlen);
+        memcpy(info.gcm256.iv, rec_seq, sizeof(rec_seq));
+        memcpy(info.gcm256.rec_seq, rec_seq, sizeof(rec_seq));
+    }
+    else
+    {
+        memcpy(info.gcm128.key, key, keylen);
+        memcpy(info.gcm128.salt, iv, ivlen);
+        memcpy(info.gcm128.iv, rec_seq, sizeof(rec_seq));
+        memcpy(info.gcm128.rec_seq, rec_seq, sizeof(rec_seq));
+    }
+
+    result = 0;
+
+    if(setsockopt(connctx->client_fd.fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 ||
+       setsockopt(connctx->client_fd.fd, SOL_TLS, TLS_TX, &info, infolen) < 0)
+    {
+        result = -errno;
+    }
+
+    mbedtls_platform_zeroize(keyblk, sizeof(keyblk));
+    mbedtls_platform_zeroize(&info, sizeof(info));
+
+    return result;
+}
+
+static void tls_ktls_enable(struct connctx_s *connctx)
+{
+    int result = tls_ktls_setup(connctx);
+
+    /* Secret is not needed anymore either way */
+    mbedtls_platform_zeroize(connctx->secret, sizeof(connctx->secret));
+    connctx->secret_valid = false;
+
+    if(result < 0)
+    {
+        LOGINF("Connection %d stays with user space records. Result: %s",
+               connctx->client_fd.fd, strerror(-result));
+
+        atomic_fetch_add_explicit(&session.ktls_fallback, 1, memory_order_relaxed);
+
+        return;
+    }
+
+    connctx->ktls = true;
+
+    atomic_fetch_add_explicit(&session.ktls_offloaded, 1, memory_order_relaxed);
+}
+
+static int tls_ktls_result(ssize_t len, const char *what)
+{
+    if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return -EAGAIN;
+    }
+
+    if(len < 0)
+    {
+        LOGERR("Fail to %s. Result: %s", what, strerror(errno));
+
+        return -errno;
+    }
+
+    return len;
+}
+
+/* Records written by kernel count as response as well, so offloaded
+    connection goes to sleep once it is idle */
+static int tls_ktls_sent(struct connctx_s *connctx, int result)
+{
+    if(result > 0)
+    {
+        tls_responded(connctx);
+    }
+
+    return result;
+}
+
+static int tls_ktls_send(struct connctx_s *connctx, const char *buf, size_t len)
+{
+    return tls_ktls_sent(connctx, tls_ktls_result(send(connctx->client_fd.fd, buf, len, MSG_NOSIGNAL),
+                                                  "send"));
+}
+
+static int tls_ktls_sendv(struct connctx_s *connctx, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+
+    /* Kernel packs buffers into records itself */
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return tls_ktls_sent(connctx, tls_ktls_result(sendmsg(connctx->client_fd.fd, &msg, MSG_NOSIGNAL),
+                                                  "send"));
+}
+
+static int tls_ktls_sendfile(struct connctx_s *connctx, int fd, off_t offset, size_t len)
+{
+    /* Kernel encrypts pages on the way to socket, no copy to user space */
+    return tls_ktls_sent(connctx, tls_ktls_result(sendfile(connctx->client_fd.fd, fd, &offset, len),
+                                                  "send file"));
+}
+
+static void tls_ktls_close_notify(struct connctx_s *connctx)
+{
+    unsigned char alert[2] = {MBEDTLS_SSL_ALERT_LEVEL_WARNING, MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY};
+    char control[CMSG_SPACE(sizeof(unsigned char))] = {0};
+    struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg = NULL;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    /* Kernel owns record sequence now, so alert goes through it as well */
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = MBEDTLS_SSL_MSG_ALERT;
+
+    /* Best effort, the same as for user space records */
+    sendmsg(connctx->client_fd.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#endif
+
+#if TLS_ASYNC
+static struct pool_s *signpool = NULL;
+static pthread_once_t signpool_once = PTHREAD_ONCE_INIT;
+
+static void tls_async_put(struct tls_async_s *async)
+{
+    if(atomic_fetch_sub(&async->refs, 1) > 1)
+    {
+        return;
+    }
+
+    close(async->efd);
+    mbedtls_platform_zeroize(async, sizeof(struct tls_async_s));
+    free(async);
+}
+
+static void tls_async_work(void *item)
+{
+    struct tls_async_s *async = (struct tls_async_s *) item;
+
+    /* Workers have their own random generators, as any other thread */
+    if(async->sign == true)
+    {
+        async->result = mbedtls_pk_sign(async->pkey, async->md_alg, async->input, async->input_len,
+                                        async->output, sizeof(async->output), &async->output_len,
+                                        tls_random, NULL);
+    }
+    else
+    {
+        async->result = mbedtls_pk_decrypt(async->pkey, async->input, async->input_len,
+                                           async->output, &async->output_len, sizeof(async->output),
+                                           tls_random, NULL);
+    }
+
+    atomic_store_explicit(&async->done, true, memory_order_release);
+
+    if(write(async->efd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+    {
+        LOGERR("Fail to notify about private key operation. Result: %s", strerror(errno));
+    }
+
+    tls_async_put(async);
+}
+
+static void tls_signpool_init(void)
+{
+    signpool = pool_create(CONFIG_TLS_SIGN_WORKERS, CONFIG_TLS_SIGN_QUEUE_DEPTH, tls_async_work);
+    if(signpool == NULL)
+    {
+        LOGERR("Fail to create signing pool, private key operations are done inline");
+
+        return;
+    }
+
+    stats_register(pool_stats_report, signpool);
+}
+
+static int tls_async_start(mbedtls_ssl_context *ssl, mbedtls_x509_crt *cert, bool sign,
+                           mbedtls_md_type_t md_alg, const unsigned char *input, size_t input_len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) mbedtls_ssl_get_user_data_p(ssl);
+    struct tls_async_s *async = connctx->async;
+    size_t i = 0;
+
+    /* Blocking connection has nothing else to do meanwhile, so it is not worth it */
+    if(signpool == NULL || connctx->nonblock == false || input_len > sizeof(async->input))
+    {
+        atomic_fetch_add_explicit(&session.sign_inline, 1, memory_order_relaxed);
+
+        return MBEDTLS_ERR_SSL_HW_ACCEL_FALLTHROUGH;
+    }
+
+    while(i < connctx->servctx->certs && &connctx->servctx->srvcert[i] != cert)
+    {
+        i++;
+    }
+
+    if(i == connctx->servctx->certs)
+    {
+        return MBEDTLS_ERR_SSL_HW_ACCEL_FALLTHROUGH;
+    }
+
+    if(async == NULL)
+    {
+        async = calloc(1, sizeof(struct tls_async_s));
+        if(async == NULL)
+        {
+            return MBEDTLS_ERR_SSL_HW_ACCEL_FALLTHROUGH;
+        }
+
+        async->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(async->efd < 0)
+        {
+            LOGERR("Fail to create event descriptor. Result: %s", strerror(errno));
+
+            free(async);
+
+            return MBEDTLS_ERR_SSL_HW_ACCEL_FALLTHROUGH;
+        }
+
+        atomic_init(&async->refs, 1);
+        connctx->async = async;
+    }
+
+    async->pkey = &connctx->servctx->pkey[i];
+    async->sign = sign;
+    async->md_alg = md_alg;
+    async->input_len = input_len;
+    async->output_len = 0;
+    memcpy(async->input, input, input_len);
+    atomic_store(&async->done, false);
+
+    /* Worker holds its own reference until it is done */
+    atomic_fetch_add(&async->refs, 1);
+
+    if(pool_trypush(signpool, async) < 0)
+    {
+        atomic_fetch_sub(&async->refs, 1);
+        atomic_fetch_add_explicit(&session.sign_inline, 1, memory_order_relaxed);
+
+        /* Queue is full, so library does it by itself */
+        return MBEDTLS_ERR_SSL_HW_ACCEL_FALLTHROUGH;
+    }
+
+    atomic_fetch_add_explicit(&session.sign_async, 1, memory_order_relaxed);
+
+    mbedtls_ssl_set_async_operation_data(ssl, async);
+
+    return MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS;
+}
+
+static int tls_async_sign(mbedtls_ssl_context *ssl, mbedtls_x509_crt *cert, mbedtls_md_type_t md_alg,
+                          const unsigned char *hash, size_t hash_len)
+{
+    return tls_async_start(ssl, cert, true, md_alg, hash, hash_len);
+}
+
+static int tls_async_decrypt(mbedtls_ssl_context *ssl, mbedtls_x509_crt *cert,
+                             const unsigned char *input, size_t input_len)
+{
+    return tls_async_start(ssl, cert, false, MBEDTLS_MD_NONE, input, input_len);
+}
+
+static int tls_async_resume(mbedtls_ssl_context *ssl, unsigned char *output, size_t *output_len,
+                            size_t output_size)
+{
+    struct tls_async_s *async = (struct tls_async_s *) mbedtls_ssl_get_async_operation_data(ssl);
+    uint64_t count = 0;
+
+    if(atomic_load_explicit(&async->done, memory_order_acquire) == false)
+    {
+        return MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS;
+    }
+
+    /* Descriptor is level triggered, so drain it before the next operation */
+    if(read(async->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        LOGERR("Fail to read event descriptor. Result: %s", strerror(errno));
+    }
+
+    mbedtls_ssl_set_async_operation_data(ssl, NULL);
+
+    if(async->result < 0)
+    {
+        return async->result;
+    }
+
+    if(async->output_len > output_size)
+    {
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(output, async->output, async->output_len);
+    *output_len = async->output_len;
+
+    return 0;
+}
+
+static void tls_async_cancel(mbedtls_ssl_context *ssl)
+{
+    /* Worker finishes the operation anyway, result is dropped with the connection */
+    mbedtls_ssl_set_async_operation_data(ssl, NULL);
+}
+
+static void tls_async_conf(mbedtls_ssl_config *conf)
+{
+    pthread_once(&signpool_once, tls_signpool_init);
+
+    mbedtls_ssl_conf_async_private_cb(conf, tls_async_sign, tls_async_decrypt,
+                                      tls_async_resume, tls_async_cancel, NULL);
+}
+#endif
+
+static void tls_record_init(struct connctx_s *connctx)
+{
+    int mss = 0;
+    int expansion = mbedtls_ssl_get_record_expansion(connctx->ssl);
+    int payload = mbedtls_ssl_get_max_out_record_payload(connctx->ssl);
+
+    connctx->record_large = payload > 0 ? payload : CONFIG_TLS_RECORD_BUFF_LEN;
+
+    /* Small record with its header, nonce and tag fits one segment, so
+        client is able to decrypt it as soon as the segment arrives */
+    if(getsockopt(connctx->client_fd.fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &(socklen_t){sizeof(mss)}) < 0 ||
+       expansion < 0 || mss <= expansion)
+    {
+        mss = CONFIG_TLS_RECORD_SMALL_LEN;
+        expansion = 0;
+    }
+
+    connctx->record_small = (size_t)(mss - expansion) < connctx->record_large ?
+                            (size_t)(mss - expansion) : connctx->record_large;
+    connctx->record_boost = CONFIG_TLS_RECORD_BOOST_LEN;
+    connctx->record_pending = 0;
+    connctx->record_last = tls_now();
+    connctx->responded = false;
+}
+
+/**
+ * @brief Choose length of the next record
+ *
+ * The first CONFIG_TLS_RECORD_BOOST_LEN bytes after handshake or idle period
+ * go in records of one TCP segment to reduce time to first byte, while
+ * congestion window is small anyway. The rest goes in records of maximum
+ * size to reduce framing overhead.
+ **/
+static size_t tls_record_len(struct connctx_s *connctx, size_t len)
+{
+    uint64_t now = 0;
+    size_t limit = 0;
+
+    /* Library expects the same record to be passed again until it is flushed */
+    if(connctx->record_pending > 0)
+    {
+        return connctx->record_pending;
+    }
+
+    now = tls_now();
+    if(now - connctx->record_last > CONFIG_TLS_RECORD_IDLE_MS)
+    {
+        connctx->record_boost = CONFIG_TLS_RECORD_BOOST_LEN;
+    }
+
+    connctx->record_last = now;
+
+    limit = connctx->record_boost > 0 ? connctx->record_small : connctx->record_large;
+
+    return len < limit ? len : limit;
+}
+
+static void tls_record_sent(struct connctx_s *connctx, size_t len)
+{
+    tls_responded(connctx);
+
+    if(connctx->record_boost > 0)
+    {
+        connctx->record_boost -= len < connctx->record_boost ? len : connctx->record_boost;
+
+        atomic_fetch_add_explicit(&session.records_small, 1, memory_order_relaxed);
+    }
+
+    connctx->record_pending = 0;
+
+    atomic_fetch_add_explicit(&session.records, 1, memory_order_relaxed);
+}
+
+static mbedtls_ssl_context *tls_ctx_get(struct servctx_s *servctx)
+{
+    int result = 0;
+    mbedtls_ssl_context *ssl = NULL;
+
+    pthread_mutex_lock(&servctx->pool_lock);
+    if(servctx->pooled > 0)
+    {
+        ssl = servctx->pool[--servctx->pooled];
+    }
+    pthread_mutex_unlock(&servctx->pool_lock);
+
+    if(ssl != NULL)
+    {
+        atomic_fetch_sub_explicit(&session.contexts_pooled, 1, memory_order_relaxed);
+
+        return ssl;
+    }
+
+    ssl = malloc(sizeof(mbedtls_ssl_context));
+    if(ssl == NULL)
+    {
+        LOGERR("Fail to allocate memory for SSL context");
+
+        return NULL;
+    }
+
+    mbedtls_ssl_init(ssl);
+
+    result = mbedtls_ssl_setup(ssl, &servctx->conf);
+    if(result < 0)
+    {
+        LOGERR("Fail to setup SSL. Result: %s", tls_error(result));
+
+        mbedtls_ssl_free(ssl);
+        free(ssl);
+
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&session.contexts, 1, memory_order_relaxed);
+
+    return ssl;
+}
+
+static void tls_ctx_put(struct servctx_s *servctx, mbedtls_ssl_context *ssl)
+{
+    bool pooled = false;
+
+    /* Contexts refer to config of their listener, so each listener keeps its own
+        pool. Limit is shared by all of them, otherwise every reuseport sibling
+        would keep the whole pool after a spike */
+    if(atomic_fetch_add_explicit(&session.contexts_pooled, 1, memory_order_relaxed) <
+       CONFIG_TLS_CONTEXT_POOL_SIZE)
+    {
+        /* Reset keeps record buffers, so the next user does not allocate them */
+        if(mbedtls_ssl_session_reset(ssl) == 0)
+        {
+            pthread_mutex_lock(&servctx->pool_lock);
+            if(servctx->pooled < CONFIG_TLS_CONTEXT_POOL_SIZE)
+            {
+                servctx->pool[servctx->pooled++] = ssl;
+                pooled = true;
+            }
+            pthread_mutex_unlock(&servctx->pool_lock);
+        }
+    }
+
+    if(pooled == true)
+    {
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&session.contexts_pooled, 1, memory_order_relaxed);
+
+    mbedtls_ssl_free(ssl);
+    free(ssl);
+
+    atomic_fetch_sub_explicit(&session.contexts, 1, memory_order_relaxed);
+}
+
+static void tls_ctx_bind(struct connctx_s *connctx)
+{
+    mbedtls_ssl_set_timer_cb(connctx->ssl, &connctx->timer, mbedtls_timing_set_delay,
+                                                            mbedtls_timing_get_delay);
+
+    /* Plain receive function honors socket timeout, while the one with
+        timeout would wait in select without any limit */
+    mbedtls_ssl_set_bio(connctx->ssl, &connctx->client_fd, mbedtls_net_send,
+                                                           mbedtls_net_recv,
+                                                           NULL);
+
+    /* Callbacks of private key operations find connection by it */
+    mbedtls_ssl_set_user_data_p(connctx->ssl, connctx);
+}
+
+#if TLS_SLEEP
+/**
+ * @brief Release context of idle connection
+ *
+ * Connection state is serialized into a few hundred bytes and the context
+ * with its record buffers goes back to the pool. Library serializes only
+ * TLS 1.2 connections with nothing buffered, others stay awake.
+ **/
+static void tls_sleep(struct connctx_s *connctx)
+{
+    int result = 0;
+    size_t len = 0;
+
+    result = mbedtls_ssl_context_save(connctx->ssl, NULL, 0, &len);
+    if(result != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL)
+    {
+        return;
+    }
+
+    connctx->saved = malloc(len);
+    if(connctx->saved == NULL)
+    {
+        return;
+    }
+
+    result = mbedtls_ssl_context_save(connctx->ssl, connctx->saved, len, &connctx->saved_len);
+    if(result < 0)
+    {
+        LOGERR("Fail to save connection %d. Result: %s", connctx->client_fd.fd, tls_error(result));
+
+        free(connctx->saved);
+        connctx->saved = NULL;
+
+        return;
+    }
+
+    tls_ctx_put(connctx->servctx, connctx->ssl);
+    connctx->ssl = NULL;
+
+    atomic_fetch_add_explicit(&session.sleeping, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&session.sleeping_bytes, connctx->saved_len, memory_order_relaxed);
+}
+
+static int tls_wake(struct connctx_s *connctx)
+{
+    int result = 0;
+
+    if(connctx->ssl != NULL)
+    {
+        return 0;
+    }
+
+    connctx->ssl = tls_ctx_get(connctx->servctx);
+    if(connctx->ssl == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    tls_ctx_bind(connctx);
+
+    result = mbedtls_ssl_context_load(connctx->ssl, connctx->saved, connctx->saved_len);
+
+    atomic_fetch_sub_explicit(&session.sleeping, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&session.sleeping_bytes, connctx->saved_len, memory_order_relaxed);
+
+    /* Saved state holds keys of the connection */
+    mbedtls_platform_zeroize(connctx->saved, connctx->saved_len);
+    free(connctx->saved);
+    connctx->saved = NULL;
+
+    if(result < 0)
+    {
+        LOGERR("Fail to restore connection %d. Result: %s", connctx->client_fd.fd, tls_error(result));
+
+        return -EPROTO;
+    }
+
+    return 0;
+}
+#endif
+
+static int tls_bind_reuseport(struct servctx_s *servctx, char *addr, const char *portstr)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *list = NULL;
+    int result = 0;
+    int fd = -1;
+
+    /* mbedtls_net_bind does not allow to set socket options before bind,
+        so the listening socket is created here in the same way */
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+
+    result = getaddrinfo(addr, portstr, &hints, &list);
+    if(result != 0)
+    {
+        LOGERR("Fail to resolve address. Result: %s", gai_strerror(result));
+
+        return -EINVAL;
+    }
+
+    result = -EADDRNOTAVAIL;
+
+    for(struct addrinfo *cur = list; cur != NULL; cur = cur->ai_next)
+    {
+        fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+        if(fd < 0)
+        {
+            result = -errno;
+
+            continue;
+        }
+
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 ||
+           setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0 ||
+           bind(fd, cur->ai_addr, cur->ai_addrlen) < 0 ||
+           listen(fd, SOMAXCONN) < 0)
+        {
+            result = -errno;
+
+            close(fd);
+
+            continue;
+        }
+
+        servctx->listen_fd.fd = fd;
+        result = 0;
+
+        break;
+    }
+
+    freeaddrinfo(list);
+
+    if(result < 0)
+    {
+        LOGERR("Fail to bind reuseport listener. Result: %s", strerror(-result));
+    }
+
+    return result;
+}
+
+static int tls_cert_test_load(struct servctx_s *servctx)
+{
+    int result = 0;
+
+    /* Embedded test certificate, it is used unless real one is given */
+    result = mbedtls_x509_crt_parse(&servctx->srvcert[0], (const unsigned char *)mbedtls_test_srv_crt,
+                                    mbedtls_test_srv_crt_len);
+    if(result < 0)
+    {
+        LOGERR("Fail to get server certificate. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    result = mbedtls_x509_crt_parse(&servctx->srvcert[0], (const unsigned char *) mbedtls_test_cas_pem,
+                                    mbedtls_test_cas_pem_len);
+    if(result < 0)
+    {
+        LOGERR("Fail to get CA certificate. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    result = mbedtls_pk_parse_key(&servctx->pkey[0], (const unsigned char *) mbedtls_test_srv_key,
+                    mbedtls_test_srv_key_len, NULL, 0, tls_random, NULL);
+    if(result < 0)
+    {
+        LOGERR("Fail to get server key. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    servctx->certs = 1;
+
+    return 0;
+}
+
+static int tls_cert_load(struct servctx_s *servctx, size_t i)
+{
+    int result = 0;
+
+    /* Positive result is number of certificates of the chain that failed to parse */
+    result = mbedtls_x509_crt_parse_file(&servctx->srvcert[i], servctx->certfile[i]);
+    if(result != 0)
+    {
+        LOGERR("Fail to get certificate %s. Result: %s", servctx->certfile[i],
+               result < 0 ? tls_error(result) : "broken chain");
+
+        return result < 0 ? result : -EINVAL;
+    }
+
+    result = mbedtls_pk_parse_keyfile(&servctx->pkey[i], servctx->keyfile[i], NULL, tls_random, NULL);
+    if(result < 0)
+    {
+        LOGERR("Fail to get key %s. Result: %s", servctx->keyfile[i], tls_error(result));
+
+        return result;
+    }
+
+    result = mbedtls_pk_check_pair(&servctx->srvcert[i].pk, &servctx->pkey[i], tls_random, NULL);
+    if(result < 0)
+    {
+        LOGERR("Key %s does not match certificate %s", servctx->keyfile[i], servctx->certfile[i]);
+
+        return result;
+    }
+
+    LOGINF("Certificate %s with %s key", servctx->certfile[i], mbedtls_pk_get_name(&servctx->pkey[i]));
+
+    return 0;
+}
+
+static int tls_init(void *ctx, char *addr, int port)
+{
+    int result = 0;
+    char portstr[8] = {0};
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL || addr == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* TLS 1.3 key schedule is done by PSA crypto only */
+    if(psa_crypto_init() != PSA_SUCCESS)
+    {
+        LOGERR("Fail to init crypto");
+
+        return -EIO;
+    }
+#endif
+
+    mbedtls_net_init(&servctx->listen_fd);
+    mbedtls_ssl_config_init(&servctx->conf);
+    mbedtls_ssl_cookie_init(&servctx->cookie_ctx);
+
+    for(size_t i = 0; i < CONFIG_TLS_MAX_CERTS; i++)
+    {
+        mbedtls_x509_crt_init(&servctx->srvcert[i]);
+        mbedtls_pk_init(&servctx->pkey[i]);
+    }
+
+    if(servctx->certs == 0)
+    {
+        result = tls_cert_test_load(servctx);
+    }
+    else
+    {
+        for(size_t i = 0; i < servctx->certs && result == 0; i++)
+        {
+            result = tls_cert_load(servctx, i);
+        }
+    }
+
+    if(result < 0)
+    {
+        return result;
+    }
+
+    sprintf(portstr, "%d", port);
+    if(servctx->reuseport == true)
+    {
+        result = tls_bind_reuseport(servctx, addr, portstr);
+        if(result < 0)
+        {
+            LOGERR("Fail to bind net. Result: %s", strerror(-result));
+
+            return result;
+        }
+    }
+    else
+    {
+        result = mbedtls_net_bind(&servctx->listen_fd, addr, portstr, MBEDTLS_NET_PROTO_TCP);
+        if(result < 0)
+        {
+            LOGERR("Fail to bind net. Result: %s", tls_error(result));
+
+            return result;
+        }
+    }
+
+    result = mbedtls_ssl_config_defaults(&servctx->conf, MBEDTLS_SSL_IS_SERVER,
+                                                         MBEDTLS_SSL_TRANSPORT_STREAM,
+                                                         MBEDTLS_SSL_PRESET_DEFAULT);
+    if(result < 0)
+    {
+        LOGERR("Fail to set config defaults. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    mbedtls_ssl_conf_rng(&servctx->conf, tls_random, NULL);
+
+    /* Defaults depend on library build, both versions are negotiated explicitly */
+    mbedtls_ssl_conf_min_tls_version(&servctx->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    mbedtls_ssl_conf_max_tls_version(&servctx->conf, MBEDTLS_SSL_VERSION_TLS1_3);
+#else
+    mbedtls_ssl_conf_max_tls_version(&servctx->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#endif
+
+    mbedtls_ssl_conf_ca_chain(&servctx->conf, servctx->srvcert[0].next, NULL);
+
+    /* Handshake takes the first certificate that suits ciphersuite and
+        signature algorithms of the client, so ECDSA and RSA may coexist */
+    for(size_t i = 0; i < servctx->certs; i++)
+    {
+        result = mbedtls_ssl_conf_own_cert(&servctx->conf, &servctx->srvcert[i], &servctx->pkey[i]);
+        if(result < 0 )
+        {
+            LOGERR("Fail to set own certificate. Result: %s", tls_error(result));
+
+            return result;
+        }
+    }
+
+    result = mbedtls_ssl_cookie_setup(&servctx->cookie_ctx, tls_random, NULL);
+    if(result < 0)
+    {
+        LOGERR("Fail to setup cookie. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+    mbedtls_ssl_conf_dtls_cookies(&servctx->conf, mbedtls_ssl_cookie_write, 
+                                                  mbedtls_ssl_cookie_check,
+                                                  &servctx->cookie_ctx);
+
+    result = tls_session_conf(&servctx->conf);
+    if(result < 0)
+    {
+        LOGERR("Fail to setup session resumption. Result: %s", tls_error(result));
+
+        return result;
+    }
+
+#if TLS_ASYNC
+    tls_async_conf(&servctx->conf);
+#endif
+
+    return 0;
+}
+
+static void *tls_accept(void *ctx)
+{
+    int result = 0;
+    mbedtls_net_context client_fd;
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+    struct connctx_s *connctx = NULL;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return NULL;
+    }
+
+    mbedtls_net_init(&client_fd);
+
+    result = mbedtls_net_accept(&servctx->listen_fd, &client_fd, NULL, 0, NULL);
+    if(result == MBEDTLS_ERR_SSL_WANT_READ)
+    {
+        /* Non-blocking listener has no pending connections */
+        errno = EAGAIN;
+
+        return NULL;
+    }
+
+    if(result < 0)
+    {
+        LOGERR("Fail to accept. Result: %s", tls_error(result));
+
+        return NULL;
+    }
+
+    LOGINF("New connection %d", client_fd.fd);
+
+    /* Socket timeouts limit handshake of blocking connection as well */
+    if(setsockopt(client_fd.fd, SOL_SOCKET, SO_RCVTIMEO, &servctx->rcvtimeo, sizeof(servctx->rcvtimeo)) < 0 ||
+       setsockopt(client_fd.fd, SOL_SOCKET, SO_SNDTIMEO, &servctx->sndtimeo, sizeof(servctx->sndtimeo)) < 0)
+    {
+        LOGERR("Fail to set connection timeouts. Result: %s", strerror(errno));
+
+        mbedtls_net_free(&client_fd);
+
+        return NULL;
+    }
+
+    connctx = malloc(sizeof(struct connctx_s));
+    if(connctx == NULL)
+    {
+        LOGERR("Fail to allocate memory for connection context object");
+
+        mbedtls_net_free(&client_fd);
+
+        return NULL;
+    }
+
+    memcpy(&connctx->client_fd, &client_fd, sizeof(client_fd));
+    connctx->servctx = servctx;
+    connctx->nonblock = false;
+#if TLS_ASYNC
+    connctx->async = NULL;
+#endif
+#if TLS_SLEEP
+    connctx->saved = NULL;
+    connctx->saved_len = 0;
+#endif
+#if TLS_EARLY_DATA
+    connctx->early = NULL;
+    connctx->early_len = 0;
+    connctx->early_pos = 0;
+    connctx->early_left = 0;
+#endif
+
+    connctx->ssl = tls_ctx_get(servctx);
+    if(connctx->ssl == NULL)
+    {
+        mbedtls_net_free(&connctx->client_fd);
+        free(connctx);
+
+        return NULL;
+    }
+
+    tls_ctx_bind(connctx);
 
-struct connctx_s
-{
-    mbedtls_net_context client_fd;
-    mbedtls_timing_delay_context timer;
-    mbedtls_ssl_context ssl;
-};
+#if CONFIG_TLS_KTLS
+    connctx->ktls = false;
+    connctx->secret_valid = false;
 
-static char *tls_error(int error)
-{
-    static char error_buf[100];
+    mbedtls_ssl_set_export_keys_cb(connctx->ssl, tls_export_keys, connctx);
+#endif
 
-    mbedtls_strerror(error, error_buf, 100);
+    atomic_fetch_add_explicit(&session.connections, 1, memory_order_relaxed);
 
-    return error_buf;
+    /* Handshake is driven later by connection owner, so slow client
+        does not hold accepting of other connections */
+    return connctx;
 }
 
-static int tls_init(void *ctx, char *addr, int port)
+static int tls_handshake(void *ctx)
 {
     int result = 0;
-    const char *pers = "ssl_server";
-    char portstr[8] = {0};
-    struct servctx_s *servctx = (struct servctx_s *) ctx;
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
 
-    if(ctx == NULL || addr == NULL)
+    if(ctx == NULL)
     {
         LOGERR("Invalid argument");
 
         return -EINVAL;
     }
 
-    mbedtls_net_init(&servctx->listen_fd);
-    mbedtls_ssl_config_init(&servctx->conf);
-    mbedtls_x509_crt_init(&servctx->srvcert);
-    mbedtls_pk_init(&servctx->pkey);
-    mbedtls_entropy_init(&servctx->entropy);
-    mbedtls_ctr_drbg_init(&servctx->ctr_drbg);
-    mbedtls_ssl_cookie_init(&servctx->cookie_ctx);
+    do
+    {
+        result = mbedtls_ssl_handshake(connctx->ssl);
+#if TLS_EARLY_DATA
+        /* Handshake goes on right away, the rest of client flight may be buffered already */
+        if(result == MBEDTLS_ERR_SSL_RECEIVED_EARLY_DATA && tls_early_read(connctx) < 0)
+        {
+            break;
+        }
+#endif
+        if(connctx->nonblock == true)
+        {
+            if(result == MBEDTLS_ERR_SSL_WANT_READ)
+            {
+                return SERVER_HANDSHAKE_WANT_READ;
+            }
+
+            if(result == MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                return SERVER_HANDSHAKE_WANT_WRITE;
+            }
+
+            if(result == MBEDTLS_ERR_SSL_ASYNC_IN_PROGRESS)
+            {
+                return SERVER_HANDSHAKE_WANT_ASYNC;
+            }
+        }
+    }while(result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE ||
+           result == MBEDTLS_ERR_SSL_RECEIVED_EARLY_DATA);
 
-    result =  mbedtls_ctr_drbg_seed(&servctx->ctr_drbg, mbedtls_entropy_func, &servctx->entropy,
-                                   (const unsigned char *)pers, strlen(pers));
     if(result < 0)
     {
-        LOGERR("Fail to seed random number generator. Result: %s", tls_error(result));
+        LOGERR("Fail to handshake. Result: %s", tls_error(result));
 
-        return result;
+        return -EPROTO;
     }
 
-    /*
-    * This demonstration program uses embedded test certificates.
-    * Instead, you may want to use mbedtls_x509_crt_parse_file() to read the
-    * server and CA certificates, as well as mbedtls_pk_parse_keyfile().
-    */
-    result = mbedtls_x509_crt_parse(&servctx->srvcert, (const unsigned char *)mbedtls_test_srv_crt,
-                                    mbedtls_test_srv_crt_len);
-    if(result < 0)
+    atomic_fetch_add_explicit(&session.handshakes, 1, memory_order_relaxed);
+
+    tls_record_init(connctx);
+
+#if CONFIG_TLS_KTLS
+    /* Application data is sent by kernel from now on if it is able to */
+    tls_ktls_enable(connctx);
+#endif
+
+    return 0;
+}
+
+static int tls_fd(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
     {
-        LOGERR("Fail to get server certificate. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return result;
+        return -EINVAL;
     }
 
-    result = mbedtls_x509_crt_parse(&servctx->srvcert, (const unsigned char *) mbedtls_test_cas_pem,
-                                    mbedtls_test_cas_pem_len);
-    if(result < 0)
+    return servctx->listen_fd.fd;
+}
+
+static int tls_nonblock(void *ctx)
+{
+    int result = 0;
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
     {
-        LOGERR("Fail to get CA certificate. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return result;
+        return -EINVAL;
     }
 
-    result = mbedtls_pk_parse_key(&servctx->pkey, (const unsigned char *) mbedtls_test_srv_key,
-                    mbedtls_test_srv_key_len, NULL, 0, mbedtls_ctr_drbg_random, &servctx->ctr_drbg);
+    result = mbedtls_net_set_nonblock(&servctx->listen_fd);
     if(result < 0)
     {
-        LOGERR("Fail to get server key. Result: %s", tls_error(result));
+        LOGERR("Fail to set non-blocking mode. Result: %s", tls_error(result));
 
         return result;
     }
 
-    sprintf(portstr, "%d", port);
-    result = mbedtls_net_bind(&servctx->listen_fd, addr, portstr, MBEDTLS_NET_PROTO_TCP);
-    if(result < 0)
+    return 0;
+}
+
+static void tls_reuseport(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
     {
-        LOGERR("Fail to bind net. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return result;
+        return;
     }
 
-    result = mbedtls_ssl_config_defaults(&servctx->conf, MBEDTLS_SSL_IS_SERVER,
-                                                         MBEDTLS_SSL_TRANSPORT_STREAM,
-                                                         MBEDTLS_SSL_PRESET_DEFAULT);
-    if(result < 0)
+    servctx->reuseport = true;
+}
+
+static void tls_timeout(void *ctx, unsigned int recv, unsigned int send)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
     {
-        LOGERR("Fail to set config defaults. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return result;
+        return;
     }
 
-    mbedtls_ssl_conf_rng(&servctx->conf, mbedtls_ctr_drbg_random, &servctx->ctr_drbg);
-    mbedtls_ssl_conf_read_timeout(&servctx->conf, CONFIG_KEEPALIVE_TIMEOUT_SEC * 1000);
+    servctx->rcvtimeo.tv_sec = recv;
+    servctx->sndtimeo.tv_sec = send;
+}
+
+static int tls_credentials(void *ctx, const char *cert, const char *key)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
 
-    mbedtls_ssl_conf_ca_chain(&servctx->conf, servctx->srvcert.next, NULL);
-    result = mbedtls_ssl_conf_own_cert(&servctx->conf, &servctx->srvcert, &servctx->pkey);
-    if(result < 0 )
+    if(ctx == NULL || cert == NULL || key == NULL)
     {
-        LOGERR("Fail to set own certificate. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return result;
+        return -EINVAL;
     }
 
-    result = mbedtls_ssl_cookie_setup(&servctx->cookie_ctx, mbedtls_ctr_drbg_random, 
-                                      &servctx->ctr_drbg);
-    if(result < 0)
+    if(servctx->certs == CONFIG_TLS_MAX_CERTS)
     {
-        LOGERR("Fail to setup cookie. Result: %s", tls_error(result));
+        LOGERR("Too many certificates");
 
-        return result;
+        return -ENOSPC;
     }
 
-    mbedtls_ssl_conf_dtls_cookies(&servctx->conf, mbedtls_ssl_cookie_write, 
-                                                  mbedtls_ssl_cookie_check,
-                                                  &servctx->cookie_ctx);
+    /* Files are loaded on init */
+    servctx->certfile[servctx->certs] = cert;
+    servctx->keyfile[servctx->certs] = key;
+    servctx->certs++;
 
     return 0;
 }
 
-static void *tls_accept(void *ctx)
+static void tls_deinit(void *ctx)
 {
-    int result = 0;
-    mbedtls_net_context client_fd;
     struct servctx_s *servctx = (struct servctx_s *) ctx;
-    struct connctx_s *connctx = NULL;
 
     if(ctx == NULL)
     {
         LOGERR("Invalid argument");
 
-        return NULL;
+        return;
     }
 
-    mbedtls_net_init(&client_fd);
+    mbedtls_net_free(&servctx->listen_fd);
+    for(size_t i = 0; i < CONFIG_TLS_MAX_CERTS; i++)
+    {
+        mbedtls_x509_crt_free(&servctx->srvcert[i]);
+        mbedtls_pk_free(&servctx->pkey[i]);
+    }
+    /* Contexts refer to config, so they go first */
+    for(size_t i = 0; i < servctx->pooled; i++)
+    {
+        mbedtls_ssl_free(servctx->pool[i]);
+        free(servctx->pool[i]);
+    }
 
-    result = mbedtls_net_accept(&servctx->listen_fd, &client_fd, NULL, 0, NULL);
-    if(result < 0)
+    atomic_fetch_sub_explicit(&session.contexts, servctx->pooled, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&session.contexts_pooled, servctx->pooled, memory_order_relaxed);
+    servctx->pooled = 0;
+    pthread_mutex_destroy(&servctx->pool_lock);
+
+    mbedtls_ssl_config_free(&servctx->conf);
+    mbedtls_ssl_cookie_free(&servctx->cookie_ctx);
+
+    free(servctx);
+}
+
+static int tls_recv(void *ctx, char *buf, size_t len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(ctx == NULL || buf == NULL)
     {
-        LOGERR("Fail to accept. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        return NULL;
+        return -EINVAL;
     }
 
-    LOGINF("New connection %d", client_fd.fd);
+#if TLS_EARLY_DATA
+    /* Early data goes first, it precedes anything sent after handshake */
+    if(connctx->early != NULL)
+    {
+        return tls_early_recv(connctx, buf, len);
+    }
+#endif
 
-    connctx = malloc(sizeof(struct connctx_s));
-    if(connctx == NULL)
+#if TLS_SLEEP
+    if(tls_wake(connctx) < 0)
     {
-        LOGERR("Fail to allocate memory for connection context object");
+        return -EPROTO;
+    }
+#endif
 
-        return NULL;
+    do
+    {
+        len = mbedtls_ssl_read(connctx->ssl, (unsigned char *)buf, len);
+        if((int)len == MBEDTLS_ERR_SSL_WANT_READ || (int)len == MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            if(connctx->nonblock == true)
+            {
+#if TLS_SLEEP
+                /* Response is sent and the next request is not there yet,
+                    so connection is idle until socket becomes readable */
+                if((int)len == MBEDTLS_ERR_SSL_WANT_READ && connctx->responded == true)
+                {
+                    tls_sleep(connctx);
+                }
+#endif
+                return -EAGAIN;
+            }
+        }
+    }while((int)len == MBEDTLS_ERR_SSL_WANT_READ || (int)len == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    /* Next write starts response to the new request */
+    if((int)len > 0)
+    {
+        connctx->responded = false;
     }
 
-    memcpy(&connctx->client_fd, &client_fd, sizeof(client_fd));
+    return len;
+}
 
-    mbedtls_ssl_init(&connctx->ssl);
+static int tls_send(void *ctx, char *buf, size_t len)
+{
+    int result = 0;
+    size_t sent = 0;
+    size_t chunk = 0;
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
 
-    result = mbedtls_ssl_setup(&connctx->ssl, &servctx->conf);
-    if(result < 0)
+    if(ctx == NULL || buf == NULL)
     {
-        LOGERR("Fail to setup SSL");
-
-        free(connctx);
+        LOGERR("Invalid argument");
 
-        return NULL;
+        return -EINVAL;
     }
 
-    mbedtls_ssl_set_timer_cb(&connctx->ssl, &connctx->timer, mbedtls_timing_set_delay,
-                                                             mbedtls_timing_get_delay);
+#if CONFIG_TLS_KTLS
+    if(connctx->ktls == true)
+    {
+        return tls_ktls_send(connctx, buf, len);
+    }
+#endif
 
-    mbedtls_ssl_set_bio(&connctx->ssl, &connctx->client_fd, mbedtls_net_send,
-                                                            mbedtls_net_recv,
-                                                            mbedtls_net_recv_timeout);
+#if TLS_SLEEP
+    if(tls_wake(connctx) < 0)
+    {
+        return -EPROTO;
+    }
+#endif
 
-    do
+    /* Every write produces one record, so data is cut to records of chosen length */
+    while(sent < len)
     {
-        result = mbedtls_ssl_handshake(&connctx->ssl);
-    }while(result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE);
+        chunk = tls_record_len(connctx, len - sent);
+
+        do
+        {
+            result = mbedtls_ssl_write(connctx->ssl, (unsigned char *)buf + sent, chunk);
+            if(result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                if(connctx->nonblock == true)
+                {
+                    connctx->record_pending = chunk;
+
+                    return sent > 0 ? (int)sent : -EAGAIN;
+                }
+            }
+        }while(result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+        if(result < 0)
+        {
+            return sent > 0 ? (int)sent : result;
+        }
+
+        tls_record_sent(connctx, result);
+        sent += result;
+    }
 
-    if(result < 0)
+    return sent;
+}
+
+static int tls_sendv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+    static __thread unsigned char buf[CONFIG_TLS_RECORD_BUFF_LEN];
+    size_t packed = 0;
+    size_t sent = 0;
+    size_t off = 0;
+    size_t len = 0;
+    int result = 0;
+    int i = 0;
+
+    if(ctx == NULL || iov == NULL)
     {
-        LOGERR("Fail to handshake. Result: %s", tls_error(result));
+        LOGERR("Invalid argument");
 
-        free(connctx);
+        return -EINVAL;
+    }
 
-        return NULL;
+#if CONFIG_TLS_KTLS
+    if(((struct connctx_s *) ctx)->ktls == true)
+    {
+        return tls_ktls_sendv(ctx, iov, iovcnt);
     }
+#endif
 
-    return connctx;
+    /* Pieces are packed together, so they fill records completely instead
+        of producing a separate record (and TCP segment) per piece */
+    while(i < iovcnt)
+    {
+        packed = 0;
+
+        while(i < iovcnt && packed < sizeof(buf))
+        {
+            len = iov[i].iov_len - off;
+            len = len < sizeof(buf) - packed ? len : sizeof(buf) - packed;
+
+            memcpy(buf + packed, (char *)iov[i].iov_base + off, len);
+            packed += len;
+            off += len;
+
+            if(off == iov[i].iov_len)
+            {
+                off = 0;
+                i++;
+            }
+        }
+
+        for(size_t written = 0; written < packed; written += result)
+        {
+            result = tls_send(ctx, (char *)buf + written, packed - written);
+            if(result == -EAGAIN && sent + written > 0)
+            {
+                /* The rest is passed again by caller */
+                return sent + written;
+            }
+
+            if(result < 0)
+            {
+                return result;
+            }
+        }
+
+        sent += packed;
+    }
+
+    return sent;
 }
 
-static void tls_deinit(void *ctx)
+static int tls_sendfile(void *ctx, int fd, off_t offset, size_t len)
 {
-    struct servctx_s *servctx = (struct servctx_s *) ctx;
+    static __thread unsigned char buf[CONFIG_TLS_RECORD_BUFF_LEN];
+    ssize_t readlen = 0;
+    size_t sent = 0;
+    int result = 0;
 
     if(ctx == NULL)
     {
         LOGERR("Invalid argument");
 
-        return;
+        return -EINVAL;
     }
 
-    mbedtls_net_free(&servctx->listen_fd);
-    mbedtls_x509_crt_free(&servctx->srvcert);
-    mbedtls_pk_free(&servctx->pkey);
-    mbedtls_ssl_config_free(&servctx->conf);
-    mbedtls_ssl_cookie_free(&servctx->cookie_ctx);
-    mbedtls_ctr_drbg_free(&servctx->ctr_drbg);
-    mbedtls_entropy_free(&servctx->entropy);
+#if CONFIG_TLS_KTLS
+    if(((struct connctx_s *) ctx)->ktls == true)
+    {
+        return tls_ktls_sendfile(ctx, fd, offset, len);
+    }
+#endif
 
-    free(servctx);
+    /* Records are encrypted in user space, so file is copied through
+        a buffer that is large enough to fill a whole record */
+    readlen = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+    if(readlen < 0)
+    {
+        LOGERR("Fail to read file. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    while(sent < (size_t)readlen)
+    {
+        result = tls_send(ctx, (char *)buf + sent, readlen - sent);
+        if(result == -EAGAIN && sent > 0)
+        {
+            /* The rest is read again on next call */
+            break;
+        }
+
+        if(result < 0)
+        {
+            return result;
+        }
+
+        sent += result;
+    }
+
+    return sent;
 }
 
-static int tls_recv(void *ctx, char *buf, size_t len)
+static int tls_conn_fd(void *ctx)
 {
     struct connctx_s *connctx = (struct connctx_s *) ctx;
 
-    if(ctx == NULL || buf == NULL)
+    if(ctx == NULL)
     {
         LOGERR("Invalid argument");
 
         return -EINVAL;
     }
 
-    do
+    return connctx->client_fd.fd;
+}
+
+static int tls_conn_nonblock(void *ctx)
+{
+    int result = 0;
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    result = mbedtls_net_set_nonblock(&connctx->client_fd);
+    if(result < 0)
     {
-        len = mbedtls_ssl_read(&connctx->ssl, (unsigned char *)buf, len);
-    }while(len == MBEDTLS_ERR_SSL_WANT_READ || len == MBEDTLS_ERR_SSL_WANT_WRITE);
+        LOGERR("Fail to set non-blocking mode. Result: %s", tls_error(result));
 
-    return len;
+        return result;
+    }
+
+    connctx->nonblock = true;
+
+    return 0;
 }
 
-static int tls_send(void *ctx, char *buf, size_t len)
+#if TLS_EARLY_DATA
+static bool tls_conn_early(void *ctx, size_t len)
 {
     struct connctx_s *connctx = (struct connctx_s *) ctx;
+    bool early = false;
 
-    if(ctx == NULL || buf == NULL)
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return false;
+    }
+
+    early = connctx->early_left > 0;
+    connctx->early_left -= len < connctx->early_left ? len : connctx->early_left;
+
+    return early;
+}
+#endif
+
+#if TLS_ASYNC
+static int tls_conn_async_fd(void *ctx)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+
+    if(ctx == NULL)
     {
         LOGERR("Invalid argument");
 
         return -EINVAL;
     }
 
-    do
+    if(connctx->async == NULL)
     {
-        len = mbedtls_ssl_write(&connctx->ssl, (unsigned char *)buf, len);
-    }while(len == MBEDTLS_ERR_SSL_WANT_READ || len == MBEDTLS_ERR_SSL_WANT_WRITE);
+        return -ENOENT;
+    }
 
-    return len;
+    return connctx->async->efd;
 }
+#endif
 
 static void tls_conn_close(void *ctx)
 {
@@ -304,23 +2175,81 @@ static void tls_conn_close(void *ctx)
 
     LOGINF("Connection %d close", connctx->client_fd.fd);
 
-    /* No error checking, the connection might be closed already */
-    do
+    /* No error checking, the connection might be closed already.
+       Non-blocking channel is not waited for, notify is just best effort then */
+#if CONFIG_TLS_KTLS
+    if(connctx->ktls == true)
+    {
+        tls_ktls_close_notify(connctx);
+    }
+    else
+#endif
+#if TLS_SLEEP
+    /* Sleeping connection is woken just to say goodbye */
+    if(tls_wake(connctx) == 0)
+#endif
     {
-        result = mbedtls_ssl_close_notify(&connctx->ssl);
-    }while(result == MBEDTLS_ERR_SSL_WANT_WRITE );
+        do
+        {
+            result = mbedtls_ssl_close_notify(connctx->ssl);
+        }while(result == MBEDTLS_ERR_SSL_WANT_WRITE && connctx->nonblock == false);
+    }
+
+#if CONFIG_TLS_KTLS
+    mbedtls_platform_zeroize(connctx->secret, sizeof(connctx->secret));
+#endif
 
     mbedtls_net_free(&connctx->client_fd);
-    mbedtls_ssl_free(&connctx->ssl);
+
+    /* Context is kept for the next connection */
+    if(connctx->ssl != NULL)
+    {
+        tls_ctx_put(connctx->servctx, connctx->ssl);
+    }
+
+#if TLS_SLEEP
+    if(connctx->saved != NULL)
+    {
+        mbedtls_platform_zeroize(connctx->saved, connctx->saved_len);
+        free(connctx->saved);
+
+        atomic_fetch_sub_explicit(&session.sleeping, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&session.sleeping_bytes, connctx->saved_len, memory_order_relaxed);
+    }
+#endif
+
+#if TLS_ASYNC
+    if(connctx->async != NULL)
+    {
+        tls_async_put(connctx->async);
+    }
+#endif
+
+#if TLS_EARLY_DATA
+    free(connctx->early);
+#endif
+
+    atomic_fetch_sub_explicit(&session.connections, 1, memory_order_relaxed);
 
     free(connctx);
 }
 
 const static struct conn_iface_s conn_iface =
 {
-    .recv  = tls_recv,
-    .send  = tls_send,
-    .close = tls_conn_close
+    .recv     = tls_recv,
+    .send     = tls_send,
+    .sendv    = tls_sendv,
+    .sendfile = tls_sendfile,
+    .fd       = tls_conn_fd,
+    .nonblock = tls_conn_nonblock,
+    .handshake = tls_handshake,
+#if TLS_ASYNC
+    .async_fd = tls_conn_async_fd,
+#endif
+#if TLS_EARLY_DATA
+    .early    = tls_conn_early,
+#endif
+    .close    = tls_conn_close
 };
 
 static struct conn_iface_s *tls_conn_iface_get(void)
@@ -332,6 +2261,11 @@ const static struct server_iface_s serv_iface =
 {
     .init       = tls_init,
     .accept     = tls_accept,
+    .fd         = tls_fd,
+    .nonblock   = tls_nonblock,
+    .reuseport  = tls_reuseport,
+    .timeout    = tls_timeout,
+    .credentials = tls_credentials,
     .deinit     = tls_deinit,
     .conn_iface = tls_conn_iface_get
 };
@@ -353,5 +2287,12 @@ void *tls_serv_ctx_alloc(void)
         return NULL;
     }
 
+    servctx->reuseport = false;
+    servctx->certs = 0;
+    servctx->pooled = 0;
+    pthread_mutex_init(&servctx->pool_lock, NULL);
+    servctx->rcvtimeo = (struct timeval){ .tv_sec = 0, .tv_usec = 0 };
+    servctx->sndtimeo = (struct timeval){ .tv_sec = 0, .tv_usec = 0 };
+
     return servctx;
 }
\ No newline at end of file
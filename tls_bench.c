@@ -0,0 +1,303 @@
+/**
+ * @file tls_bench.c
+ * @brief Benchmark of TLS handshake rate for different certificate types
+ *
+ * Runs full handshakes between client and server contexts connected by
+ * memory pipes with ECDSA P-256 and RSA-2048 test certificates and reports
+ * handshakes per second. Time spent by server side is reported separately,
+ * since it is what limits handshake rate of the server.
+ **/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/error.h"
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+#include "psa/crypto.h"
+#endif
+
+#include "test/certs.h"
+
+#define BENCH_HANDSHAKES 200
+
+/* Large enough for the whole flight of handshake messages */
+#define BENCH_PIPE_LEN 32768
+
+struct bench_pipe_s
+{
+    unsigned char buf[BENCH_PIPE_LEN];
+    size_t len;
+};
+
+struct bench_end_s
+{
+    struct bench_pipe_s *rx;
+    struct bench_pipe_s *tx;
+};
+
+struct bench_cert_s
+{
+    const char *name;
+    const unsigned char *crt;
+    size_t crt_len;
+    const unsigned char *key;
+    size_t key_len;
+};
+
+static int bench_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct bench_pipe_s *pipe = ((struct bench_end_s *)ctx)->tx;
+
+    if (len > sizeof(pipe->buf) - pipe->len)
+    {
+        len = sizeof(pipe->buf) - pipe->len;
+    }
+
+    if (len == 0)
+    {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+
+    memcpy(pipe->buf + pipe->len, buf, len);
+    pipe->len += len;
+
+    return len;
+}
+
+static int bench_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    struct bench_pipe_s *pipe = ((struct bench_end_s *)ctx)->rx;
+
+    if (pipe->len == 0)
+    {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    if (len > pipe->len)
+    {
+        len = pipe->len;
+    }
+
+    memcpy(buf, pipe->buf, len);
+    memmove(pipe->buf, pipe->buf + len, pipe->len - len);
+    pipe->len -= len;
+
+    return len;
+}
+
+static double bench_elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Step handshake of one side, returns 1 once it is done, 0 if it waits for peer */
+static int bench_step(mbedtls_ssl_context *ssl, int *done)
+{
+    int result = 0;
+
+    if (*done == 1)
+    {
+        return 1;
+    }
+
+    result = mbedtls_ssl_handshake(ssl);
+    if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        return 0;
+    }
+
+    if (result < 0)
+    {
+        return result;
+    }
+
+    *done = 1;
+
+    return 1;
+}
+
+static int bench_run(const struct bench_cert_s *cert, mbedtls_ctr_drbg_context *drbg)
+{
+    static struct bench_pipe_s to_server;
+    static struct bench_pipe_s to_client;
+    struct bench_end_s server_end = { .rx = &to_server, .tx = &to_client };
+    struct bench_end_s client_end = { .rx = &to_client, .tx = &to_server };
+    mbedtls_ssl_config srvconf;
+    mbedtls_ssl_config cliconf;
+    mbedtls_ssl_context srv;
+    mbedtls_ssl_context cli;
+    mbedtls_x509_crt crt;
+    mbedtls_pk_context pkey;
+    struct timespec start;
+    struct timespec end;
+    struct timespec step;
+    double total = 0;
+    double server = 0;
+    char error[100];
+    int srvdone = 0;
+    int clidone = 0;
+    int srvres = 0;
+    int clires = 0;
+    int result = 0;
+    int i = 0;
+
+    mbedtls_ssl_config_init(&srvconf);
+    mbedtls_ssl_config_init(&cliconf);
+    mbedtls_ssl_init(&srv);
+    mbedtls_ssl_init(&cli);
+    mbedtls_x509_crt_init(&crt);
+    mbedtls_pk_init(&pkey);
+
+    result = mbedtls_x509_crt_parse(&crt, cert->crt, cert->crt_len);
+    if (result == 0)
+    {
+        result = mbedtls_pk_parse_key(&pkey, cert->key, cert->key_len, NULL, 0,
+                                      mbedtls_ctr_drbg_random, drbg);
+    }
+
+    if (result == 0)
+    {
+        result = mbedtls_ssl_config_defaults(&srvconf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                             MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+
+    if (result == 0)
+    {
+        result = mbedtls_ssl_config_defaults(&cliconf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                             MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+
+    if (result == 0)
+    {
+        mbedtls_ssl_conf_rng(&srvconf, mbedtls_ctr_drbg_random, drbg);
+        mbedtls_ssl_conf_rng(&cliconf, mbedtls_ctr_drbg_random, drbg);
+
+        /* Certificate chain is not verified, it is not what server pays for */
+        mbedtls_ssl_conf_authmode(&cliconf, MBEDTLS_SSL_VERIFY_NONE);
+
+        result = mbedtls_ssl_conf_own_cert(&srvconf, &crt, &pkey);
+    }
+
+    if (result == 0)
+    {
+        result = mbedtls_ssl_setup(&srv, &srvconf);
+    }
+
+    if (result == 0)
+    {
+        result = mbedtls_ssl_setup(&cli, &cliconf);
+    }
+
+    if (result < 0)
+    {
+        mbedtls_strerror(result, error, sizeof(error));
+        printf("%s setup failed: %s\n", cert->name, error);
+
+        goto exit;
+    }
+
+    mbedtls_ssl_set_bio(&srv, &server_end, bench_send, bench_recv, NULL);
+    mbedtls_ssl_set_bio(&cli, &client_end, bench_send, bench_recv, NULL);
+
+    for (i = 0; i < BENCH_HANDSHAKES; i++)
+    {
+        /* No session is kept between iterations, so every handshake is full */
+        mbedtls_ssl_session_reset(&srv);
+        mbedtls_ssl_session_reset(&cli);
+        to_server.len = 0;
+        to_client.len = 0;
+        srvdone = 0;
+        clidone = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        do
+        {
+            clires = bench_step(&cli, &clidone);
+
+            clock_gettime(CLOCK_MONOTONIC, &step);
+            srvres = bench_step(&srv, &srvdone);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            server += bench_elapsed(&step, &end);
+        } while (clires >= 0 && srvres >= 0 && (clidone == 0 || srvdone == 0));
+
+        total += bench_elapsed(&start, &end);
+
+        if (clires < 0 || srvres < 0)
+        {
+            result = clires < 0 ? clires : srvres;
+
+            mbedtls_strerror(result, error, sizeof(error));
+            printf("%s handshake failed: %s\n", cert->name, error);
+
+            goto exit;
+        }
+    }
+
+    printf("%-12s %-24s %8.0f handshakes/s, server %8.1f us/handshake (%6.0f/s per core)\n",
+           cert->name, mbedtls_ssl_get_ciphersuite(&srv), BENCH_HANDSHAKES * 1e9 / total,
+           server / BENCH_HANDSHAKES / 1e3, BENCH_HANDSHAKES * 1e9 / server);
+
+exit:
+    mbedtls_ssl_free(&srv);
+    mbedtls_ssl_free(&cli);
+    mbedtls_ssl_config_free(&srvconf);
+    mbedtls_ssl_config_free(&cliconf);
+    mbedtls_x509_crt_free(&crt);
+    mbedtls_pk_free(&pkey);
+
+    return result;
+}
+
+int main(void)
+{
+    const struct bench_cert_s certs[] =
+    {
+        {
+            "ecdsa-p256",
+            (const unsigned char *)mbedtls_test_srv_crt_ec, mbedtls_test_srv_crt_ec_len,
+            (const unsigned char *)mbedtls_test_srv_key_ec, mbedtls_test_srv_key_ec_len
+        },
+        {
+            "rsa-2048",
+            (const unsigned char *)mbedtls_test_srv_crt_rsa, mbedtls_test_srv_crt_rsa_len,
+            (const unsigned char *)mbedtls_test_srv_key_rsa, mbedtls_test_srv_key_rsa_len
+        },
+    };
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    int result = 0;
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if (psa_crypto_init() != PSA_SUCCESS)
+    {
+        printf("Fail to init crypto\n");
+
+        return 1;
+    }
+#endif
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+
+    result = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                   (const unsigned char *)"tls_bench", strlen("tls_bench"));
+
+    for (size_t i = 0; i < sizeof(certs) / sizeof(certs[0]) && result == 0; i++)
+    {
+        result = bench_run(&certs[i], &drbg);
+    }
+
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+
+    return result == 0 ? 0 : 1;
+}
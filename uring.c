@@ -0,0 +1,1397 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <linux/io_uring.h>
+
+#include "server.h"
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "uring"
+
+/* Operation tag is kept in low bits of user data, the rest is object pointer */
+#define URING_TAG_MASK   0x7ULL
+#define URING_TAG_ACCEPT 0x1ULL
+#define URING_TAG_RECV   0x2ULL
+#define URING_TAG_SEND   0x3ULL
+#define URING_TAG_CANCEL 0x4ULL
+#define URING_TAG_READ   0x5ULL
+
+/* Provided buffers group of every ring */
+#define URING_BUF_GROUP 0
+
+/**
+ * Ring of a thread. Every thread that does I/O owns its own ring,
+ * so there is no locking on submission and completion.
+ **/
+struct uring_s
+{
+    int fd;
+    void *sqptr;
+    void *cqptr;
+    size_t sqlen;
+    size_t cqlen;
+
+    /* Submission queue */
+    unsigned *sqhead;
+    unsigned *sqtail;
+    unsigned *sqarray;
+    unsigned sqmask;
+    unsigned sqentries;
+    struct io_uring_sqe *sqes;
+    unsigned tosubmit;
+
+    /* Completion queue */
+    unsigned *cqhead;
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+
+    /* Provided buffers for receiving */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    size_t brlen;
+    unsigned brmask;
+
+    bool extarg; /// waiting for completions may be limited by timeout
+};
+
+struct uring_accepted_s
+{
+    int *fds;     /// connections taken from kernel, it grows rather than drops them
+    unsigned cap;
+    unsigned head;
+    unsigned tail;
+};
+
+struct servctx_s
+{
+    int sockfd;
+    unsigned int rcvtimeo; /// receive timeout of connections in seconds, 0 means no limit
+    unsigned int sndtimeo; /// send timeout of connections in seconds, 0 means no limit
+    bool reuseport;
+    bool armed;
+    bool multishot;
+    bool canceling; /// accept is paused, connections are left in kernel backlog
+    struct uring_accepted_s accepted;
+};
+
+struct uring_recvd_s
+{
+    int res;
+    unsigned short bid;
+};
+
+struct uring_obuf_s
+{
+    char *buf;
+    size_t len;
+    size_t off;
+    size_t cap;
+};
+
+struct connctx_s
+{
+    int connfd;
+    struct uring_s *ring;
+    unsigned int rcvtimeo;
+    unsigned int sndtimeo;
+
+    /* Receiving */
+    bool armed;
+    bool multishot;
+    struct uring_recvd_s recvd[CONFIG_URING_BUFS + 2];
+    unsigned rhead;
+    unsigned rtail;
+    int curbid;
+    size_t curoff;
+    size_t curlen;
+
+    /* Sending. One buffer is filled while other one is in flight */
+    struct uring_obuf_s obuf[2];
+    int fill;
+    bool inflight;
+    int senderr;
+
+    /* Reading of file */
+    bool reading;
+    int readres;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_ulong uring_enters;
+static atomic_ulong uring_completions;
+
+static int uring_sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_sys_register(int fd, unsigned opcode, void *arg, unsigned num)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, num);
+}
+
+static void uring_free(void *data)
+{
+    struct uring_s *ring = (struct uring_s *)data;
+
+    if(ring == NULL)
+    {
+        return;
+    }
+
+    if(ring->br != NULL)
+    {
+        munmap(ring->br, ring->brlen);
+    }
+
+    free(ring->bufs);
+
+    if(ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqentries * sizeof(struct io_uring_sqe));
+    }
+
+    if(ring->cqptr != NULL && ring->cqptr != ring->sqptr)
+    {
+        munmap(ring->cqptr, ring->cqlen);
+    }
+
+    if(ring->sqptr != NULL)
+    {
+        munmap(ring->sqptr, ring->sqlen);
+    }
+
+    if(ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+
+    free(ring);
+}
+
+static void uring_buf_recycle(struct uring_s *ring, unsigned short bid)
+{
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & ring->brmask];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * CONFIG_INPUT_BUFF_LEN);
+    buf->len = CONFIG_INPUT_BUFF_LEN;
+    buf->bid = bid;
+
+    atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, tail + 1,
+                          memory_order_release);
+}
+
+static int uring_bufs_setup(struct uring_s *ring)
+{
+    struct io_uring_buf_reg reg = {0};
+
+    ring->brlen = CONFIG_URING_BUFS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->brlen, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ring->br == MAP_FAILED)
+    {
+        ring->br = NULL;
+
+        LOGERR("Fail to map buffer ring. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    ring->bufs = malloc((size_t)CONFIG_URING_BUFS * CONFIG_INPUT_BUFF_LEN);
+    if(ring->bufs == NULL)
+    {
+        LOGERR("Fail to allocate memory for provided buffers");
+
+        return -ENOMEM;
+    }
+
+    ring->brmask = CONFIG_URING_BUFS - 1;
+    ring->br->tail = 0;
+
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = CONFIG_URING_BUFS;
+    reg.bgid = URING_BUF_GROUP;
+
+    if(uring_sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOGERR("Fail to register buffer ring. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    for(unsigned short i = 0; i < CONFIG_URING_BUFS; i++)
+    {
+        uring_buf_recycle(ring, i);
+    }
+
+    return 0;
+}
+
+static struct uring_s *uring_create(void)
+{
+    struct io_uring_params p = {0};
+    struct uring_s *ring = NULL;
+
+    ring = calloc(1, sizeof(struct uring_s));
+    if(ring == NULL)
+    {
+        LOGERR("Fail to allocate memory for ring");
+
+        return NULL;
+    }
+
+    /* The ring is used by one thread only, let kernel know it if supported */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = uring_sys_setup(CONFIG_URING_ENTRIES, &p);
+    if(ring->fd < 0 && errno == EINVAL)
+    {
+        memset(&p, 0, sizeof(p));
+        ring->fd = uring_sys_setup(CONFIG_URING_ENTRIES, &p);
+    }
+
+    if(ring->fd < 0)
+    {
+        LOGERR("Fail to setup ring. Result: %s", strerror(errno));
+
+        goto error;
+    }
+
+    ring->extarg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+
+    ring->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cqlen > ring->sqlen)
+        {
+            ring->sqlen = ring->cqlen;
+        }
+
+        ring->cqlen = ring->sqlen;
+    }
+
+    ring->sqptr = mmap(NULL, ring->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqptr == MAP_FAILED)
+    {
+        ring->sqptr = NULL;
+
+        LOGERR("Fail to map submission queue. Result: %s", strerror(errno));
+
+        goto error;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cqptr = ring->sqptr;
+    }
+    else
+    {
+        ring->cqptr = mmap(NULL, ring->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cqptr == MAP_FAILED)
+        {
+            ring->cqptr = NULL;
+
+            LOGERR("Fail to map completion queue. Result: %s", strerror(errno));
+
+            goto error;
+        }
+    }
+
+    ring->sqentries = p.sq_entries;
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+
+        LOGERR("Fail to map submission entries. Result: %s", strerror(errno));
+
+        goto error;
+    }
+
+    ring->sqhead = (unsigned *)((char *)ring->sqptr + p.sq_off.head);
+    ring->sqtail = (unsigned *)((char *)ring->sqptr + p.sq_off.tail);
+    ring->sqmask = *(unsigned *)((char *)ring->sqptr + p.sq_off.ring_mask);
+    ring->sqarray = (unsigned *)((char *)ring->sqptr + p.sq_off.array);
+
+    ring->cqhead = (unsigned *)((char *)ring->cqptr + p.cq_off.head);
+    ring->cqtail = (unsigned *)((char *)ring->cqptr + p.cq_off.tail);
+    ring->cqmask = *(unsigned *)((char *)ring->cqptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cqptr + p.cq_off.cqes);
+
+    if(uring_bufs_setup(ring) < 0)
+    {
+        goto error;
+    }
+
+    return ring;
+
+error:
+    uring_free(ring);
+
+    return NULL;
+}
+
+static void uring_key_create(void)
+{
+    pthread_key_create(&uring_key, uring_free);
+}
+
+static struct uring_s *uring_get(void)
+{
+    struct uring_s *ring = NULL;
+
+    pthread_once(&uring_key_once, uring_key_create);
+
+    ring = pthread_getspecific(uring_key);
+    if(ring == NULL)
+    {
+        ring = uring_create();
+        if(ring != NULL)
+        {
+            pthread_setspecific(uring_key, ring);
+        }
+    }
+
+    return ring;
+}
+
+static int uring_enter(struct uring_s *ring, unsigned wait)
+{
+    int result = 0;
+
+    do
+    {
+        result = uring_sys_enter(ring->fd, ring->tosubmit, wait,
+                                 wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while(result < 0 && errno == EINTR);
+
+    atomic_fetch_add_explicit(&uring_enters, 1, memory_order_relaxed);
+
+    if(result < 0)
+    {
+        LOGERR("Fail to enter ring. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    ring->tosubmit -= result;
+
+    return 0;
+}
+
+static struct io_uring_sqe *uring_sqe_get(struct uring_s *ring)
+{
+    unsigned tail = *ring->sqtail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sqhead, memory_order_acquire);
+    struct io_uring_sqe *sqe = NULL;
+
+    /* Queue is full, so push what is there to the kernel */
+    if(tail - head >= ring->sqentries)
+    {
+        if(uring_enter(ring, 0) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[tail & ring->sqmask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    ring->sqarray[tail & ring->sqmask] = tail & ring->sqmask;
+    atomic_store_explicit((_Atomic unsigned *)ring->sqtail, tail + 1, memory_order_release);
+    ring->tosubmit++;
+
+    return sqe;
+}
+
+static void uring_complete(struct uring_s *ring, struct io_uring_cqe *cqe);
+
+static void uring_reap(struct uring_s *ring)
+{
+    unsigned head = *ring->cqhead;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cqtail, memory_order_acquire);
+
+    while(head != tail)
+    {
+        uring_complete(ring, &ring->cqes[head & ring->cqmask]);
+        head++;
+
+        atomic_fetch_add_explicit(&uring_completions, 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit((_Atomic unsigned *)ring->cqhead, head, memory_order_release);
+}
+
+static int uring_wait(struct uring_s *ring)
+{
+    int result = uring_enter(ring, 1);
+    if(result < 0)
+    {
+        return result;
+    }
+
+    uring_reap(ring);
+
+    return 0;
+}
+
+/**
+ * @brief Wait for completions like uring_wait, but no longer than timeout
+ *
+ * Receive and send on ring do not honor socket timeouts, so connection
+ * limits are applied while waiting for their completions.
+ *
+ * @param ring[in] - ring of the thread
+ * @param timeout[in] - time to wait in seconds, 0 means no limit
+ *
+ * @retval 0 if something is completed, -ETIMEDOUT if nothing is completed
+ * in time, negative errno value otherwise
+ **/
+static int uring_wait_timeout(struct uring_s *ring, unsigned int timeout)
+{
+    struct __kernel_timespec ts = { .tv_sec = timeout };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    int result = 0;
+
+    if(timeout == 0 || ring->extarg == false)
+    {
+        return uring_wait(ring);
+    }
+
+    /* Submissions go first, so failed wait does not hide their count */
+    if(ring->tosubmit > 0)
+    {
+        result = uring_enter(ring, 0);
+        if(result < 0)
+        {
+            return result;
+        }
+    }
+
+    do
+    {
+        result = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } while(result < 0 && errno == EINTR);
+
+    atomic_fetch_add_explicit(&uring_enters, 1, memory_order_relaxed);
+
+    if(result < 0 && errno == ETIME)
+    {
+        return -ETIMEDOUT;
+    }
+
+    if(result < 0)
+    {
+        LOGERR("Fail to enter ring. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    uring_reap(ring);
+
+    return 0;
+}
+
+/* Wait until output in flight is sent. Client that does not accept it in
+    time fails the connection, send is canceled once connection is closed */
+static int uring_send_wait(struct connctx_s *connctx)
+{
+    int result = 0;
+
+    while(connctx->inflight == true && connctx->senderr == 0)
+    {
+        result = uring_wait_timeout(connctx->ring, connctx->sndtimeo);
+        if(result == -ETIMEDOUT)
+        {
+            LOGERR("Connection %d timed out waiting for client to read", connctx->connfd);
+
+            connctx->senderr = result;
+        }
+
+        if(result < 0)
+        {
+            return result;
+        }
+    }
+
+    return connctx->senderr;
+}
+
+static int uring_accepted_push(struct uring_accepted_s *accepted, int fd)
+{
+    unsigned num = accepted->tail - accepted->head;
+    unsigned cap = 0;
+    int *fds = NULL;
+
+    if(num == accepted->cap)
+    {
+        cap = accepted->cap > 0 ? accepted->cap * 2 : CONFIG_URING_ENTRIES * 2;
+
+        fds = malloc(cap * sizeof(int));
+        if(fds == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        for(unsigned i = 0; i < num; i++)
+        {
+            fds[i] = accepted->fds[(accepted->head + i) % accepted->cap];
+        }
+
+        free(accepted->fds);
+
+        accepted->fds = fds;
+        accepted->cap = cap;
+        accepted->head = 0;
+        accepted->tail = num;
+    }
+
+    accepted->fds[accepted->tail++ % accepted->cap] = fd;
+
+    return 0;
+}
+
+static void uring_accept_complete(struct uring_s *ring, struct servctx_s *servctx,
+                                  struct io_uring_cqe *cqe)
+{
+    struct uring_accepted_s *accepted = &servctx->accepted;
+    struct io_uring_sqe *sqe = NULL;
+
+    if((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        servctx->armed = false;
+        servctx->canceling = false;
+    }
+
+    /* Kernel does not support multishot accept, fall back to single shot */
+    if(cqe->res == -EINVAL && servctx->multishot == true)
+    {
+        servctx->multishot = false;
+
+        return;
+    }
+
+    /* Accept is paused */
+    if(cqe->res == -ECANCELED)
+    {
+        return;
+    }
+
+    if(cqe->res < 0)
+    {
+        LOGERR("Connection fail. Result: %s", strerror(-cqe->res));
+
+        return;
+    }
+
+    if(uring_accepted_push(accepted, cqe->res) < 0)
+    {
+        LOGERR("Fail to allocate memory for accepted connection %d", cqe->res);
+
+        close(cqe->res);
+
+        return;
+    }
+
+    /* Multishot accept drains kernel backlog as fast as clients connect. Once
+        enough connections wait here, it is canceled, so the rest wait in the
+        backlog. Accept is armed again once the queue is empty */
+    if(servctx->armed == true && servctx->canceling == false &&
+       accepted->tail - accepted->head >= CONFIG_URING_ENTRIES)
+    {
+        sqe = uring_sqe_get(ring);
+        if(sqe == NULL)
+        {
+            return;
+        }
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)servctx | URING_TAG_ACCEPT;
+        sqe->user_data = (uint64_t)(uintptr_t)servctx | URING_TAG_CANCEL;
+
+        servctx->canceling = true;
+
+        uring_enter(ring, 0);
+    }
+}
+
+static void uring_recv_complete(struct connctx_s *connctx, struct io_uring_cqe *cqe)
+{
+    struct uring_recvd_s *recvd = NULL;
+
+    if((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        connctx->armed = false;
+    }
+
+    /* Kernel does not support multishot receive, fall back to single shot */
+    if(cqe->res == -EINVAL && connctx->multishot == true)
+    {
+        connctx->multishot = false;
+
+        return;
+    }
+
+    /* Buffers are exhausted, receive is rearmed once some are recycled */
+    if(cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+    {
+        return;
+    }
+
+    recvd = &connctx->recvd[connctx->rtail++ % (CONFIG_URING_BUFS + 2)];
+    recvd->res = cqe->res;
+    recvd->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if((cqe->flags & IORING_CQE_F_BUFFER) == 0)
+    {
+        recvd->bid = USHRT_MAX;
+    }
+}
+
+static void uring_send_prep(struct connctx_s *connctx, struct uring_obuf_s *obuf)
+{
+    struct io_uring_sqe *sqe = uring_sqe_get(connctx->ring);
+
+    if(sqe == NULL)
+    {
+        connctx->senderr = -EBUSY;
+
+        return;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connctx->connfd;
+    sqe->addr = (uint64_t)(uintptr_t)(obuf->buf + obuf->off);
+    sqe->len = obuf->len - obuf->off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)connctx | URING_TAG_SEND;
+
+    connctx->inflight = true;
+}
+
+static void uring_send_complete(struct connctx_s *connctx, struct io_uring_cqe *cqe)
+{
+    struct uring_obuf_s *obuf = &connctx->obuf[connctx->fill ^ 1];
+
+    connctx->inflight = false;
+
+    if(cqe->res < 0)
+    {
+        LOGERR("Fail to send. Result: %s", strerror(-cqe->res));
+
+        connctx->senderr = cqe->res;
+
+        return;
+    }
+
+    /* Short send, push the rest */
+    obuf->off += cqe->res;
+    if(obuf->off < obuf->len)
+    {
+        uring_send_prep(connctx, obuf);
+
+        return;
+    }
+
+    obuf->off = 0;
+    obuf->len = 0;
+}
+
+static void uring_complete(struct uring_s *ring, struct io_uring_cqe *cqe)
+{
+    void *obj = (void *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+
+    switch(cqe->user_data & URING_TAG_MASK)
+    {
+        case URING_TAG_ACCEPT:
+            uring_accept_complete(ring, obj, cqe);
+            break;
+
+        case URING_TAG_RECV:
+            uring_recv_complete(obj, cqe);
+            break;
+
+        case URING_TAG_SEND:
+            uring_send_complete(obj, cqe);
+            break;
+
+        case URING_TAG_READ:
+            ((struct connctx_s *)obj)->readres = cqe->res;
+            ((struct connctx_s *)obj)->reading = false;
+            break;
+
+        default:
+            /* Nothing to do for cancelation */
+            break;
+    }
+}
+
+static void uring_stats_report(void *arg)
+{
+    LOGINF("ring enters %lu, completions %lu", atomic_load(&uring_enters),
+                                                atomic_load(&uring_completions));
+}
+
+static int uring_init(void *ctx, char *addr, int port)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+    struct sockaddr_in sockaddr = {0};
+
+    if(ctx == NULL || addr == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* Check in advance if ring is supported by kernel */
+    if(uring_get() == NULL)
+    {
+        LOGERR("io_uring is not available");
+
+        return -ENOSYS;
+    }
+
+    servctx->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(servctx->sockfd < 0)
+    {
+        LOGERR("Fail to create socket. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    if(setsockopt(servctx->sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
+    {
+        LOGERR("Fail to set socket reuseaddr option. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    if(servctx->reuseport == true &&
+       setsockopt(servctx->sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        LOGERR("Fail to set socket reuseport option. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_port = htons(port);
+    if(inet_aton(addr, (struct in_addr *)&sockaddr.sin_addr.s_addr) == 0)
+    {
+        LOGERR("Fail set address %s", addr);
+
+        return -EINVAL;
+    }
+
+    if(bind(servctx->sockfd, (struct sockaddr *) &sockaddr, sizeof(sockaddr)) < 0)
+    {
+        LOGERR("Fail to bind. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    if(listen(servctx->sockfd, SOMAXCONN) < 0)
+    {
+        LOGERR("Fail to listen. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    stats_register(uring_stats_report, NULL);
+
+    LOGINF("Has been started. Address %s, port %d", addr, port);
+
+    return 0;
+}
+
+static void *uring_accept(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+    struct uring_accepted_s *accepted = &servctx->accepted;
+    struct uring_s *ring = uring_get();
+    struct io_uring_sqe *sqe = NULL;
+    struct connctx_s *connctx = NULL;
+    int conn = -1;
+
+    if(ctx == NULL || ring == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return NULL;
+    }
+
+    /* Connections that came together are completed together as well,
+        so they are taken from the queue without any syscall */
+    while(accepted->head == accepted->tail)
+    {
+        if(servctx->armed == false)
+        {
+            sqe = uring_sqe_get(ring);
+            if(sqe == NULL)
+            {
+                return NULL;
+            }
+
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = servctx->sockfd;
+            sqe->ioprio = servctx->multishot == true ? IORING_ACCEPT_MULTISHOT : 0;
+            sqe->user_data = (uint64_t)(uintptr_t)servctx | URING_TAG_ACCEPT;
+
+            servctx->armed = true;
+        }
+
+        if(uring_wait(ring) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    conn = accepted->fds[accepted->head++ % accepted->cap];
+
+    LOGINF("New connection %d", conn);
+
+    connctx = calloc(1, sizeof(struct connctx_s));
+    if(connctx == NULL)
+    {
+        LOGERR("Fail to allocate memory for connection context");
+
+        close(conn);
+
+        return NULL;
+    }
+
+    connctx->connfd = conn;
+    connctx->rcvtimeo = servctx->rcvtimeo;
+    connctx->sndtimeo = servctx->sndtimeo;
+    connctx->multishot = true;
+    connctx->curbid = -1;
+
+    return connctx;
+}
+
+static void uring_deinit(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    if(close(servctx->sockfd) < 0)
+    {
+        LOGERR("Fail close socket. Result: %s", strerror(errno));
+
+        return;
+    }
+
+    /* Connections that were accepted, but not served yet */
+    while(servctx->accepted.head != servctx->accepted.tail)
+    {
+        close(servctx->accepted.fds[servctx->accepted.head++ % servctx->accepted.cap]);
+    }
+
+    free(servctx->accepted.fds);
+    free(servctx);
+}
+
+static void uring_reuseport(void *ctx)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    servctx->reuseport = true;
+}
+
+static void uring_timeout(void *ctx, unsigned int recv, unsigned int send)
+{
+    struct servctx_s *servctx = (struct servctx_s *) ctx;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    servctx->rcvtimeo = recv;
+    servctx->sndtimeo = send;
+}
+
+static int uring_conn_bind(struct connctx_s *connctx)
+{
+    /* Connection is served by a single thread, so it uses ring of the thread */
+    if(connctx->ring == NULL)
+    {
+        connctx->ring = uring_get();
+        if(connctx->ring == NULL)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static void uring_send_flush(struct connctx_s *connctx)
+{
+    struct uring_obuf_s *obuf = &connctx->obuf[connctx->fill];
+
+    if(obuf->len == 0 || connctx->inflight == true)
+    {
+        return;
+    }
+
+    /* Swap buffers, so the next data is collected while this one is in flight */
+    connctx->fill ^= 1;
+
+    uring_send_prep(connctx, obuf);
+}
+
+static int uring_recv(void *ctx, char *buf, size_t len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    struct uring_recvd_s *recvd = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    size_t copylen = 0;
+    int result = 0;
+
+    if(ctx == NULL || buf == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    result = uring_conn_bind(connctx);
+    if(result < 0)
+    {
+        return result;
+    }
+
+    /* Collected output leaves together with the receive request */
+    uring_send_flush(connctx);
+
+    while(1)
+    {
+        /* Continue with partially consumed buffer */
+        if(connctx->curbid >= 0)
+        {
+            copylen = connctx->curlen - connctx->curoff;
+            copylen = copylen < len ? copylen : len;
+
+            memcpy(buf, connctx->ring->bufs + (size_t)connctx->curbid * CONFIG_INPUT_BUFF_LEN +
+                        connctx->curoff, copylen);
+
+            connctx->curoff += copylen;
+            if(connctx->curoff == connctx->curlen)
+            {
+                uring_buf_recycle(connctx->ring, connctx->curbid);
+                connctx->curbid = -1;
+            }
+
+            return copylen;
+        }
+
+        if(connctx->rhead != connctx->rtail)
+        {
+            recvd = &connctx->recvd[connctx->rhead++ % (CONFIG_URING_BUFS + 2)];
+
+            if(recvd->res <= 0)
+            {
+                return recvd->res;
+            }
+
+            connctx->curbid = recvd->bid;
+            connctx->curoff = 0;
+            connctx->curlen = recvd->res;
+
+            continue;
+        }
+
+        if(connctx->armed == false)
+        {
+            sqe = uring_sqe_get(connctx->ring);
+            if(sqe == NULL)
+            {
+                return -EBUSY;
+            }
+
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = connctx->connfd;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+            sqe->ioprio = connctx->multishot == true ? IORING_RECV_MULTISHOT : 0;
+            sqe->len = connctx->multishot == true ? 0 : len;
+            sqe->user_data = (uint64_t)(uintptr_t)connctx | URING_TAG_RECV;
+
+            connctx->armed = true;
+        }
+
+        /* Idle or slow client does not hold the thread forever */
+        result = uring_wait_timeout(connctx->ring, connctx->rcvtimeo);
+        if(result == -ETIMEDOUT)
+        {
+            LOGINF("Connection %d timed out waiting for request", connctx->connfd);
+        }
+
+        if(result < 0)
+        {
+            return result;
+        }
+    }
+}
+
+static struct uring_obuf_s *uring_obuf_reserve(struct connctx_s *connctx, size_t len)
+{
+    struct uring_obuf_s *obuf = &connctx->obuf[connctx->fill];
+    size_t newcap = 0;
+    char *newbuf = NULL;
+
+    /* Collected enough, push it out and wait if previous batch is still in flight */
+    if(obuf->len >= CONFIG_URING_SEND_BATCH)
+    {
+        if(uring_send_wait(connctx) < 0)
+        {
+            return NULL;
+        }
+
+        uring_send_flush(connctx);
+
+        if(uring_enter(connctx->ring, 0) < 0)
+        {
+            return NULL;
+        }
+
+        obuf = &connctx->obuf[connctx->fill];
+    }
+
+    if(obuf->len + len > obuf->cap)
+    {
+        newcap = obuf->cap > 0 ? obuf->cap : CONFIG_URING_SEND_BATCH;
+        while(newcap < obuf->len + len)
+        {
+            newcap *= 2;
+        }
+
+        newbuf = realloc(obuf->buf, newcap);
+        if(newbuf == NULL)
+        {
+            LOGERR("Fail to allocate memory for output buffer");
+
+            return NULL;
+        }
+
+        obuf->buf = newbuf;
+        obuf->cap = newcap;
+    }
+
+    return obuf;
+}
+
+static int uring_send(void *ctx, char *buf, size_t len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    struct uring_obuf_s *obuf = NULL;
+    int result = 0;
+
+    if(ctx == NULL || buf == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    result = uring_conn_bind(connctx);
+    if(result < 0)
+    {
+        return result;
+    }
+
+    if(connctx->senderr < 0)
+    {
+        return connctx->senderr;
+    }
+
+    obuf = uring_obuf_reserve(connctx, len);
+    if(obuf == NULL)
+    {
+        return connctx->senderr < 0 ? connctx->senderr : -ENOMEM;
+    }
+
+    memcpy(obuf->buf + obuf->len, buf, len);
+    obuf->len += len;
+
+    return len;
+}
+
+static int uring_sendv(void *ctx, const struct iovec *iov, int iovcnt)
+{
+    size_t sent = 0;
+    int result = 0;
+
+    if(ctx == NULL || iov == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    /* Pieces are collected to the same output batch, which leaves in one submission */
+    for(int i = 0; i < iovcnt; i++)
+    {
+        result = uring_send(ctx, iov[i].iov_base, iov[i].iov_len);
+        if(result < 0)
+        {
+            return result;
+        }
+
+        sent += result;
+    }
+
+    return sent;
+}
+
+static int uring_sendfile(void *ctx, int fd, off_t offset, size_t len)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    struct uring_obuf_s *obuf = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    int result = 0;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    result = uring_conn_bind(connctx);
+    if(result < 0)
+    {
+        return result;
+    }
+
+    if(connctx->senderr < 0)
+    {
+        return connctx->senderr;
+    }
+
+    len = len < CONFIG_URING_SEND_BATCH ? len : CONFIG_URING_SEND_BATCH;
+
+    obuf = uring_obuf_reserve(connctx, len);
+    if(obuf == NULL)
+    {
+        return connctx->senderr < 0 ? connctx->senderr : -ENOMEM;
+    }
+
+    /* File is read straight to output buffer. The read is submitted
+        together with the send of previous batch if there is one */
+    sqe = uring_sqe_get(connctx->ring);
+    if(sqe == NULL)
+    {
+        return -EBUSY;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(obuf->buf + obuf->len);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)(uintptr_t)connctx | URING_TAG_READ;
+
+    connctx->reading = true;
+
+    while(connctx->reading == true)
+    {
+        result = uring_wait(connctx->ring);
+        if(result < 0)
+        {
+            return result;
+        }
+    }
+
+    if(connctx->readres < 0)
+    {
+        LOGERR("Fail to read file. Result: %s", strerror(-connctx->readres));
+
+        return connctx->readres;
+    }
+
+    obuf->len += connctx->readres;
+
+    return connctx->readres;
+}
+
+static void uring_conn_close(void *ctx)
+{
+    struct connctx_s *connctx = (struct connctx_s *) ctx;
+    struct io_uring_sqe *sqe = NULL;
+
+    if(ctx == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return;
+    }
+
+    LOGINF("Connection %d closed", connctx->connfd);
+
+    if(connctx->ring != NULL)
+    {
+        /* Push the rest of output and wait until everything is completed */
+        uring_send_flush(connctx);
+
+        while(connctx->inflight == true || connctx->obuf[connctx->fill].len > 0)
+        {
+            if(uring_send_wait(connctx) < 0)
+            {
+                break;
+            }
+
+            uring_send_flush(connctx);
+        }
+
+        /* Send that timed out refers to output buffer, so cancel it
+            and wait for its completion before release */
+        if(connctx->inflight == true)
+        {
+            sqe = uring_sqe_get(connctx->ring);
+            if(sqe != NULL)
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uint64_t)(uintptr_t)connctx | URING_TAG_SEND;
+                sqe->user_data = (uint64_t)(uintptr_t)connctx | URING_TAG_CANCEL;
+            }
+
+            while(connctx->inflight == true && uring_wait(connctx->ring) == 0);
+        }
+
+        /* Multishot receive refers to the connection, so cancel it
+            and wait for its final completion before release */
+        if(connctx->armed == true)
+        {
+            sqe = uring_sqe_get(connctx->ring);
+            if(sqe != NULL)
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uint64_t)(uintptr_t)connctx | URING_TAG_RECV;
+                sqe->user_data = (uint64_t)(uintptr_t)connctx | URING_TAG_CANCEL;
+            }
+
+            while(connctx->armed == true && uring_wait(connctx->ring) == 0);
+        }
+
+        /* Return buffers that were not consumed */
+        if(connctx->curbid >= 0)
+        {
+            uring_buf_recycle(connctx->ring, connctx->curbid);
+        }
+
+        while(connctx->rhead != connctx->rtail)
+        {
+            struct uring_recvd_s *recvd = &connctx->recvd[connctx->rhead++ % (CONFIG_URING_BUFS + 2)];
+
+            if(recvd->res > 0)
+            {
+                uring_buf_recycle(connctx->ring, recvd->bid);
+            }
+        }
+    }
+
+    if(close(connctx->connfd) < 0)
+    {
+        LOGERR("Fail close connection. Result: %s", strerror(errno));
+    }
+
+    free(connctx->obuf[0].buf);
+    free(connctx->obuf[1].buf);
+    free(connctx);
+}
+
+const static struct conn_iface_s conn_iface =
+{
+    .recv     = uring_recv,
+    .send     = uring_send,
+    .sendv    = uring_sendv,
+    .sendfile = uring_sendfile,
+    .close    = uring_conn_close
+};
+
+static struct conn_iface_s *uring_conn_iface_get(void)
+{
+    return (struct conn_iface_s *)&conn_iface;
+}
+
+const static struct server_iface_s serv_iface =
+{
+    .init       = uring_init,
+    .accept     = uring_accept,
+    .reuseport  = uring_reuseport,
+    .timeout    = uring_timeout,
+    .deinit     = uring_deinit,
+    .conn_iface = uring_conn_iface_get
+};
+
+struct server_iface_s *uring_serv_iface_get(void)
+{
+    return (struct server_iface_s *)&serv_iface;
+}
+
+void *uring_serv_ctx_alloc(void)
+{
+    struct servctx_s *servctx = NULL;
+
+    servctx = calloc(1, sizeof(struct servctx_s));
+    if(servctx == NULL)
+    {
+        LOGERR("Fail to allocate memory for server context");
+
+        return NULL;
+    }
+
+    servctx->sockfd = -1;
+    servctx->multishot = true;
+
+    return servctx;
+}
@@ -0,0 +1,20 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "server.h"
+
+/**
+ * @brief Provide access to io_uring server interface
+ * 
+ * @retval Pointer to structure that contains io_uring server interfaces
+ **/
+struct server_iface_s *uring_serv_iface_get(void);
+
+/**
+ * @brief Allocates memory for io_uring server context
+ * 
+ * @retval pointer to allocated server context
+ **/
+void *uring_serv_ctx_alloc(void);
+
+#endif
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+#include "fcache.h"
+#include "rcache.h"
+#include "ncache.h"
+#include "stats.h"
+#include "config.h"
+#include "log.h"
+
+#define MODULE_NAME "watch"
+
+/* Changes of content, metadata and names of files, and new directories */
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_s
+{
+    int fd;
+    const char *root;
+    char **dirs;          /// paths of watched directories indexed by watch descriptor
+    size_t size;          /// number of slots in dirs
+    atomic_bool complete; /// every directory of the tree is watched
+
+    /* Statistic */
+    atomic_size_t watches;
+    atomic_uint_fast64_t events;
+    atomic_uint_fast64_t overflows;
+};
+
+static struct watch_s watch = { .fd = -1 };
+
+static int watch_slot_set(int wd, const char *path)
+{
+    size_t size = watch.size > 0 ? watch.size : 64;
+    char **dirs = NULL;
+    char *dir = NULL;
+
+    while ((size_t)wd >= size)
+    {
+        size *= 2;
+    }
+
+    if (size > watch.size)
+    {
+        dirs = realloc(watch.dirs, size * sizeof(*dirs));
+        if (dirs == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        memset(dirs + watch.size, 0, (size - watch.size) * sizeof(*dirs));
+        watch.dirs = dirs;
+        watch.size = size;
+    }
+
+    dir = strdup(path);
+    if (dir == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    /* Directory may be watched already, it keeps its watch descriptor then */
+    if (watch.dirs[wd] == NULL)
+    {
+        atomic_fetch_add_explicit(&watch.watches, 1, memory_order_relaxed);
+    }
+
+    free(watch.dirs[wd]);
+    watch.dirs[wd] = dir;
+
+    return 0;
+}
+
+static int watch_dir_add(const char *path)
+{
+    char sub[CONFIG_MAX_PATH_SIZE];
+    struct dirent *ent = NULL;
+    struct stat st = {0};
+    DIR *dir = NULL;
+    int result = 0;
+    int wd = 0;
+
+    wd = inotify_add_watch(watch.fd, path, WATCH_MASK);
+    if (wd < 0)
+    {
+        result = -errno;
+
+        if (result == -ENOSPC)
+        {
+            LOGERR("Watch limit is reached (see /proc/sys/fs/inotify/max_user_watches)");
+        }
+        else
+        {
+            LOGERR("Fail to watch %s. Result: %s", path, strerror(errno));
+        }
+
+        return result;
+    }
+
+    result = watch_slot_set(wd, path);
+    if (result < 0)
+    {
+        LOGERR("Fail to keep path of watch");
+
+        return result;
+    }
+
+    /* Directory may be removed already, its parent tells about it */
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN)
+        {
+            continue;
+        }
+
+        /* Files with longer paths are never requested */
+        if (snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name) >= (int)sizeof(sub))
+        {
+            continue;
+        }
+
+        if (ent->d_type == DT_UNKNOWN && (stat(sub, &st) < 0 || S_ISDIR(st.st_mode) == 0))
+        {
+            continue;
+        }
+
+        result = watch_dir_add(sub);
+        if (result < 0)
+        {
+            break;
+        }
+    }
+
+    closedir(dir);
+
+    return result;
+}
+
+/* Directory moved away keeps its watches, so changes out of the tree would be taken
+    for changes of its old paths. Slots are released once kernel reports removal */
+static void watch_dir_remove(const char *path)
+{
+    size_t len = strlen(path);
+
+    for (size_t wd = 0; wd < watch.size; wd++)
+    {
+        if (watch.dirs[wd] == NULL || strncmp(watch.dirs[wd], path, len) != 0)
+        {
+            continue;
+        }
+
+        /* The directory itself or one of its subdirectories */
+        if (watch.dirs[wd][len] == '\0' || watch.dirs[wd][len] == '/')
+        {
+            inotify_rm_watch(watch.fd, wd);
+        }
+    }
+}
+
+static void watch_caches_drop(void)
+{
+    fcache_invalidate_all();
+    rcache_invalidate_all();
+}
+
+/* Part of the tree is not watched, so caches check files on disk again */
+static void watch_fallback(void)
+{
+    if (atomic_exchange(&watch.complete, false) == false)
+    {
+        return;
+    }
+
+    LOGERR("Not every directory is watched, cached files are checked every %u ms", CONFIG_FCACHE_TTL_MS);
+
+    fcache_ttl_set(CONFIG_FCACHE_TTL_MS);
+    rcache_ttl_set(CONFIG_RCACHE_TTL_MS);
+    ncache_ttl_set(CONFIG_NCACHE_TTL_MS);
+
+    /* Files cached with long time to live would stay unchecked,
+        and new files may be not noticed by filter of existing ones */
+    watch_caches_drop();
+    ncache_disable();
+}
+
+static void watch_event_handle(const struct inotify_event *event)
+{
+    char path[CONFIG_MAX_PATH_SIZE];
+
+    atomic_fetch_add_explicit(&watch.events, 1, memory_order_relaxed);
+
+    if ((event->mask & IN_Q_OVERFLOW) != 0)
+    {
+        LOGERR("Events are lost, caches are dropped");
+
+        atomic_fetch_add_explicit(&watch.overflows, 1, memory_order_relaxed);
+
+        watch_caches_drop();
+
+        /* Added files may be missed as well */
+        if (atomic_load(&watch.complete) == true)
+        {
+            ncache_build(watch.root);
+        }
+        else
+        {
+            ncache_disable();
+        }
+
+        return;
+    }
+
+    if (event->wd < 0 || (size_t)event->wd >= watch.size || watch.dirs[event->wd] == NULL)
+    {
+        return;
+    }
+
+    /* Directory is removed, its descriptor may be reused */
+    if ((event->mask & IN_IGNORED) != 0)
+    {
+        free(watch.dirs[event->wd]);
+        watch.dirs[event->wd] = NULL;
+
+        atomic_fetch_sub_explicit(&watch.watches, 1, memory_order_relaxed);
+
+        return;
+    }
+
+    /* Events of directory itself are reported by its parent as well */
+    if (event->len == 0)
+    {
+        return;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", watch.dirs[event->wd], event->name) >= (int)sizeof(path))
+    {
+        return;
+    }
+
+    if ((event->mask & IN_ISDIR) != 0)
+    {
+        /* Files of moved or removed directory were cached by other paths */
+        if ((event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)) != 0)
+        {
+            watch_caches_drop();
+        }
+
+        /* Removed directory is empty, its files are reported one by one.
+            Directory moved within the tree is watched again by its new path */
+        if ((event->mask & IN_MOVED_FROM) != 0)
+        {
+            ncache_remove_tree();
+            watch_dir_remove(path);
+        }
+
+        /* Directory is watched before its files are added, so files created
+            meanwhile are reported by events */
+        if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+        {
+            if (watch_dir_add(path) < 0)
+            {
+                watch_fallback();
+            }
+            else
+            {
+                ncache_add_tree(path);
+            }
+        }
+
+        return;
+    }
+
+    if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0)
+    {
+        ncache_add(path);
+    }
+
+    if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+    {
+        ncache_remove();
+    }
+
+    /* File goes first, response rendered from it meanwhile is not cached then */
+    fcache_invalidate(path);
+    rcache_invalidate(path);
+}
+
+static void *watch_thread(void *data)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event = NULL;
+    ssize_t len = 0;
+
+    while (1)
+    {
+        len = read(watch.fd, buf, sizeof(buf));
+        if (len < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            LOGERR("Fail to read events. Result: %s", strerror(errno));
+
+            break;
+        }
+
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(*event) + event->len)
+        {
+            event = (const struct inotify_event *)ptr;
+
+            watch_event_handle(event);
+        }
+
+        /* Filter of existing files does not forget removed ones */
+        if (ncache_dirty() == true)
+        {
+            ncache_build(watch.root);
+        }
+    }
+
+    watch_fallback();
+
+    return NULL;
+}
+
+static void watch_stats_report(void *arg)
+{
+    LOGINF("watches %zu, events %lu, overflows %lu, %s",
+           atomic_load(&watch.watches), atomic_load(&watch.events), atomic_load(&watch.overflows),
+           atomic_load(&watch.complete) == true ? "tree is watched" : "files are checked periodically");
+}
+
+int watch_start(const char *root)
+{
+    pthread_t thread = 0;
+    int result = 0;
+
+    if (root == NULL)
+    {
+        LOGERR("Invalid argument");
+
+        return -EINVAL;
+    }
+
+    watch.root = root;
+
+    watch.fd = inotify_init1(IN_CLOEXEC);
+    if (watch.fd < 0)
+    {
+        LOGERR("Fail to init inotify. Result: %s", strerror(errno));
+
+        return -errno;
+    }
+
+    stats_register(watch_stats_report, NULL);
+
+    result = watch_dir_add(root);
+    if (result == 0)
+    {
+        /* Changes are noticed at once, time to live only bounds staleness if an event is missed */
+        fcache_ttl_set(CONFIG_WATCH_TTL_MS);
+        rcache_ttl_set(CONFIG_WATCH_TTL_MS);
+        ncache_ttl_set(CONFIG_WATCH_TTL_MS);
+
+        atomic_store(&watch.complete, true);
+
+        /* Every added file is noticed, so missing ones may be answered without lookup */
+        ncache_build(root);
+    }
+    else
+    {
+        LOGERR("Not every directory is watched, cached files are checked every %u ms", CONFIG_FCACHE_TTL_MS);
+    }
+
+    /* Watches that were added still notice changes faster than periodic check */
+    result = pthread_create(&thread, NULL, watch_thread, NULL);
+    if (result != 0)
+    {
+        LOGERR("Fail to create watch thread. Result %d", result);
+
+        watch_fallback();
+
+        return -result;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/**
+ * @file watch.h
+ * @brief This module watches root directory tree for changes of served files
+ *
+ * The module do following:
+ *  - put inotify watch on every directory of the tree, including ones created later
+ *  - drop file and response of file from caches as soon as the file is modified, moved or deleted
+ *  - let cache of missing files know about added and removed files
+ *  - let caches keep files and misses longer while the whole tree is watched
+ *  - fall back to periodic check of cached files on disk once watch limit is reached
+ **/
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+/**
+ * @brief Watch directory tree and start thread that handles its changes
+ *
+ * Caches keep checking files on disk periodically if the tree can not be watched.
+ *
+ * @param root[in] - root directory, it shall be the prefix of paths of cached files
+ *
+ * @retval 0 in case of success, negative errno value otherwise
+ **/
+int watch_start(const char *root);
+
+#endif